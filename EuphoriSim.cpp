@@ -20,18 +20,42 @@ string findMood(double avg) {
     else return "Stressed 😓";
 }
 
-// Suggest songs based on mood
-void suggestSongs(string mood) {
-    cout << "\n--- Music Suggestions ---\n";
-    if (mood.find("Excited") != string::npos) {
-        cout << "1. Neon Pulse - Jetstream\n2. Uplift - StellarVox\n";
-    } else if (mood.find("Calm") != string::npos) {
-        cout << "1. Coffee & Rain - Slowfold\n2. Easy Sunday - Paper Boat\n";
-    } else if (mood.find("Normal") != string::npos) {
-        cout << "1. Focus Mode - Binary Hearts\n2. Walking Home - Alleyways\n";
-    } else {
-        cout << "1. Quiet Corners - MellowMuse\n2. Sunrise Drive - Nova Lane\n";
+// Songs with features in 0..1: tempo, energy, valence, acousticness
+struct Song {
+    string title, artist, vibe;
+    double f[4];
+};
+
+vector<Song> songs = {
+    {"Sunrise Drive", "Nova Lane", "Calm", {.35, .30, .70, .70}},
+    {"Midnight Sprint", "Electra", "Excited", {.85, .90, .60, .10}},
+    {"Coffee & Rain", "Slowfold", "Calm", {.30, .20, .50, .85}},
+    {"Neon Pulse", "Jetstream", "Excited", {.80, .85, .75, .05}},
+    {"Easy Sunday", "Paper Boat", "Calm", {.40, .25, .80, .75}},
+    {"Focus Mode", "Binary Hearts", "Normal", {.55, .50, .55, .40}},
+    {"Uplift", "StellarVox", "Excited", {.75, .80, .90, .15}},
+    {"Quiet Corners", "MellowMuse", "Calm", {.25, .15, .45, .90}},
+    {"Walking Home", "Alleyways", "Normal", {.50, .45, .65, .50}},
+    {"Heart Rate", "PulseUnit", "Excited", {.90, .95, .55, .05}}
+};
+
+// Suggest the two songs closest to the typing speed, among songs matching the mood
+// (stressed typists get anything but Excited)
+void suggestSongs(string mood, double avg) {
+    double energy = min(1.0, max(0.0, (240 - avg) / 180));
+    double target[4] = {min(1.0, max(0.0, (260 - avg) / 200)), energy, 0.6, 1 - energy};
+    vector<pair<double, int>> ranked;
+    for (int i = 0; i < (int)songs.size(); i++) {
+        bool stressed = mood.find("Stressed") != string::npos;
+        if (stressed ? songs[i].vibe == "Excited" : mood.find(songs[i].vibe) == string::npos) continue;
+        double d = 0;
+        for (int j = 0; j < 4; j++) d += (songs[i].f[j] - target[j]) * (songs[i].f[j] - target[j]);
+        ranked.push_back({d, i});
     }
+    sort(ranked.begin(), ranked.end());
+    cout << "\n--- Music Suggestions ---\n";
+    for (int i = 0; i < 2 && i < (int)ranked.size(); i++)
+        cout << i + 1 << ". " << songs[ranked[i].second].title << " - " << songs[ranked[i].second].artist << "\n";
     cout << "--------------------------\n";
 }
 
@@ -45,6 +69,82 @@ double dist(Point a, Point b) {
     return sqrt(pow(a.x - b.x, 2) + pow(a.y - b.y, 2));
 }
 
+// Place effects, read from life_rules.txt: the one copy of the rules, shared with code2.cpp.
+// Only the "event" and "place" lines matter here, but every line is checked exactly as code2
+// checks it, so a file one program rejects the other rejects too, with the same file:line message.
+struct Effect {
+    int energy, happy;
+    string caption;
+};
+
+struct Rules {
+    vector<Effect> events;
+    map<string, int> placeEvent; // place name -> index into events
+    int otherPlaces = -1;        // event for places not listed ("*")
+
+    bool load(const string &file, string &err) {
+        ifstream in(file);
+        if (!in) { err = "cannot open " + file; return false; }
+        map<string, int> eventIndex;
+        vector<pair<string, string>> places;
+        auto fail = [&](int ln, const string &msg) { err = file + ":" + to_string(ln) + ": " + msg; return false; };
+        auto inRange = [](int e, int h) { return e >= -100 && e <= 100 && h >= -100 && h <= 100; };
+        auto rest = [](stringstream &ss) {
+            string s;
+            getline(ss >> ws, s);
+            while (!s.empty() && isspace((unsigned char)s.back())) s.pop_back();
+            return s;
+        };
+        auto isMood = [](string m) {
+            for (auto &ch : m) ch = tolower((unsigned char)ch);
+            return m == "calm" || m == "neutral" || m == "excited" || m == "stressed";
+        };
+        string line;
+        for (int ln = 1; getline(in, line); ln++) {
+            stringstream ss(line);
+            string kind, name;
+            int e, h;
+            double p;
+            if (!(ss >> kind) || kind[0] == '#') continue;
+            if (kind == "event") {
+                Effect ef;
+                if (!(ss >> name >> ef.energy >> ef.happy)) return fail(ln, "expected 'event <name> <energy> <happiness> <caption>'");
+                if (eventIndex.count(name)) return fail(ln, "duplicate event '" + name + "'");
+                if (events.size() == 255) return fail(ln, "too many events");
+                if (!inRange(ef.energy, ef.happy)) return fail(ln, "deltas must be within -100..100");
+                ef.caption = rest(ss);
+                eventIndex[name] = events.size();
+                events.push_back(ef);
+            } else if (kind == "place") {
+                if (!(ss >> name)) return fail(ln, "expected 'place <event> <place name>'");
+                string place = rest(ss);
+                if (place.empty()) return fail(ln, "missing place name");
+                places.push_back({name, place});
+            } else if (kind == "mood" || kind == "random") {
+                if (!(ss >> name) || !isMood(name)) return fail(ln, "unknown mood '" + name + "'");
+                if (kind == "random") {
+                    if (!(ss >> p >> e >> h) || p < 0 || p > 1) return fail(ln, "expected 'random <mood> <probability 0..1> <energy> <happiness> <caption>'");
+                    if (!inRange(e, h)) return fail(ln, "deltas must be within -100..100");
+                } else if (!(ss >> e >> h) || !inRange(e, h)) return fail(ln, "expected 'mood <mood> <energy> <happiness>'");
+            } else if (kind == "sleep") {
+                if (!(ss >> e >> h) || !inRange(e, h)) return fail(ln, "expected 'sleep <energy> <happiness>'");
+            } else return fail(ln, "unknown directive '" + kind + "'");
+        }
+        for (auto &pl : places) {
+            if (!eventIndex.count(pl.first)) { err = file + ": place '" + pl.second + "' uses unknown event '" + pl.first + "'"; return false; }
+            if (pl.second == "*") otherPlaces = eventIndex[pl.first];
+            else placeEvent[pl.second] = eventIndex[pl.first];
+        }
+        if (otherPlaces < 0) { err = file + ": no 'place <event> *' fallback"; return false; }
+        return true;
+    }
+
+    int eventFor(const string &place) {
+        auto it = placeEvent.find(place);
+        return it == placeEvent.end() ? otherPlaces : it->second;
+    }
+};
+
 // Life simulation
 struct Citizen {
     string name;
@@ -53,26 +153,18 @@ struct Citizen {
     string mood;
 };
 
-void simulateDay(Citizen &c, vector<Point> route) {
+void simulateDay(Citizen &c, const vector<Point> &route, Rules &rules) {
+    // look the places up once, then the day is just table lookups
+    vector<int> ev;
+    for (const auto &p : route) ev.push_back(rules.eventFor(p.name));
+
     cout << "\n--- Daily Simulation ---\n";
     cout << "Citizen: " << c.name << " | Mood: " << c.mood << endl;
-    for (auto p : route) {
-        cout << "Visiting: " << p.name << " ... ";
-        if (p.name == "Office") {
-            c.energy -= 20; c.happy += 5;
-            cout << "Worked hard!\n";
-        } else if (p.name == "Gym") {
-            c.energy -= 15; c.happy += 10;
-            cout << "Good workout!\n";
-        } else if (p.name == "Park") {
-            c.energy += 10; c.happy += 8;
-            cout << "Relaxed in park!\n";
-        } else {
-            c.energy -= 10; c.happy += 2;
-            cout << "Small errand done!\n";
-        }
-        if (c.energy < 0) c.energy = 0;
-        if (c.happy > 100) c.happy = 100;
+    for (int i = 0; i < (int)route.size(); i++) {
+        Effect &e = rules.events[ev[i]];
+        c.energy = min(100, max(0, c.energy + e.energy));
+        c.happy = min(100, max(0, c.happy + e.happy));
+        cout << "Visiting: " << route[i].name << " ... " << e.caption << "\n";
     }
     cout << "End of day -> Energy: " << c.energy << ", Happiness: " << c.happy << endl;
     cout << "-------------------------\n";
@@ -80,6 +172,12 @@ void simulateDay(Citizen &c, vector<Point> route) {
 
 int main() {
     srand(time(0));
+    Rules rules;
+    string err;
+    if (!rules.load("life_rules.txt", err)) {
+        cerr << err << " (life rules)\n";
+        return 1;
+    }
     cout << "====== EuphoriSim - Mood Based Day Simulator ======\n";
     
     // Mood detection
@@ -98,7 +196,7 @@ int main() {
     cout << "\nYour average typing delay: " << (int)avg << " ms\n";
     cout << "Detected Mood: " << mood << endl;
     
-    suggestSongs(mood);
+    suggestSongs(mood, avg);
     
     // Step 2: Map route (simple)
     vector<Point> places = {
@@ -131,7 +229,7 @@ int main() {
     me.happy = 70;
     me.mood = mood;
     
-    simulateDay(me, route);
+    simulateDay(me, route, rules);
     
     // Step 4: Small guessing game
     cout << "\nLet's play a quick guessing game!\n";
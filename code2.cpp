@@ -1,343 +1,5024 @@
 // euphorisim.cpp
 // EuphoriSim - Mood-Driven Life & Route Simulator (single file)
-// Compile: g++ -std=c++17 -O2 euphorisim.cpp -o euphorisim
+// Compile: g++ -std=c++17 -O2 -pthread euphorisim.cpp -o euphorisim
+//          (add -DEUPHORISIM_TRACE=0 to compile out the --trace instrumentation,
+//           -DEUPHORISIM_BENCH_ALLOCS=1 to count allocations in --bench)
 
 #include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
 using namespace std;
 using clk = chrono::high_resolution_clock;
 using ms = chrono::duration<double, milli>;
+using steady = chrono::steady_clock; // monotonic, for deadlines and trace timestamps
 
 // -------------------- Utilities --------------------
-double rand01() {
-    return (double)rand() / RAND_MAX;
+// xoshiro256** random engine. Every stochastic stage owns an Rng; streams are derived from the
+// session seed (--seed) so a run can be replayed, and split() hands out non-overlapping
+// substreams (2^128 apart) for islands / worker threads.
+uint64_t splitmix64(uint64_t &x) {
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
-int randint(int a, int b) {
-    return a + rand() % (b - a + 1);
+struct Rng {
+    uint64_t s[4];
+    explicit Rng(uint64_t seed=1) { for (auto &w: s) w = splitmix64(seed); }
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+    uint64_t next() {
+        uint64_t r = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+        s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+        s[2] ^= t; s[3] = rotl(s[3], 45);
+        return r;
+    }
+    double uniform() { return (next() >> 11) * 0x1.0p-53; } // [0,1)
+    // uniform in [0,n) without modulo bias (Lemire's multiply-shift with rejection)
+    uint32_t bounded(uint32_t n) {
+        uint64_t m = (next() >> 32) * n;
+        uint32_t lo = (uint32_t)m;
+        if (lo < n) {
+            uint32_t t = (0u - n) % n;
+            while (lo < t) { m = (next() >> 32) * n; lo = (uint32_t)m; }
+        }
+        return (uint32_t)(m >> 32);
+    }
+    int range(int a, int b) { return a + (int)bounded((uint32_t)(b - a + 1)); } // inclusive
+    void fill_uniform(double *out, size_t n) { for (size_t i=0;i<n;++i) out[i] = uniform(); }
+    void fill_bounded(uint32_t *out, size_t n, uint32_t bound) { for (size_t i=0;i<n;++i) out[i] = bounded(bound); }
+    // advance this stream by 2^128 draws
+    void jump() {
+        static const uint64_t J[4] = { 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull };
+        uint64_t t[4] = {0,0,0,0};
+        for (uint64_t j: J) for (int b=0;b<64;++b) {
+            if (j & (1ull << b)) for (int w=0;w<4;++w) t[w] ^= s[w];
+            next();
+        }
+        memcpy(s, t, sizeof s);
+    }
+    // child stream starting at the current state; this stream skips ahead past it
+    Rng split() { Rng child = *this; jump(); return child; }
+};
+
+uint64_t g_seed = 1; // session seed, set once in main
+// Named streams: each stage derives its generator from the session seed and a fixed id, so adding
+// draws in one stage never shifts the sequence seen by another.
+enum RngStream : uint64_t { STREAM_TYPING = 1, STREAM_MUSIC, STREAM_GA, STREAM_LIFESIM, STREAM_GAME, STREAM_CITY };
+Rng rng_stream(uint64_t id) { uint64_t x = g_seed ^ (id * 0xD1B54A32D192ED03ull); return Rng(splitmix64(x)); }
+
+template<typename T>
+void shuffle_vec(vector<T> &v, Rng &rng) {
+    for (int i = (int)v.size()-1; i>0; --i) {
+        int j = rng.range(0, i);
+        swap(v[i], v[j]);
+    }
+}
+
+// Fixed-size worker pool shared by the parallel stages
+struct ThreadPool {
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    int limit = INT_MAX; // most helpers one parallel_for may use (--bench thread sweeps)
+    mutex mu;
+    condition_variable cv;
+    bool stopping = false;
+    explicit ThreadPool(int n) {
+        for (int i=0;i<n;++i) workers.emplace_back([this]{
+            for (;;) {
+                function<void()> task;
+                {
+                    unique_lock<mutex> lk(mu);
+                    cv.wait(lk, [this]{ return stopping || !tasks.empty(); });
+                    if (stopping && tasks.empty()) return;
+                    task = move(tasks.front()); tasks.pop_front();
+                }
+                task();
+            }
+        });
+    }
+    ~ThreadPool() {
+        { lock_guard<mutex> lk(mu); stopping = true; }
+        cv.notify_all();
+        for (auto &w: workers) w.join();
+    }
+    template<typename F>
+    future<invoke_result_t<F>> submit(F f) {
+        auto task = make_shared<packaged_task<invoke_result_t<F>()>>(move(f));
+        future<invoke_result_t<F>> res = task->get_future();
+        { lock_guard<mutex> lk(mu); tasks.emplace_back([task]{ (*task)(); }); }
+        cv.notify_one();
+        return res;
+    }
+    // runs body(0..n-1) across the pool and waits; the caller's thread takes a share too.
+    // Completion is tracked per item rather than per helper task, so it is safe to nest.
+    template<typename F>
+    void parallel_for(int n, F body) {
+        if (n <= 1 || workers.empty()) { for (int i=0;i<n;++i) body(i); return; }
+        struct Job { atomic<int> next{0}, done{0}; mutex m; condition_variable cv; };
+        auto job = make_shared<Job>();
+        function<void(int)> fn = body;
+        auto drain = [job, n, fn]{
+            for (int i; (i = job->next++) < n; ) {
+                fn(i);
+                if (++job->done == n) { lock_guard<mutex> lk(job->m); job->cv.notify_all(); }
+            }
+        };
+        int helpers = min({(int)workers.size(), n-1, limit});
+        for (int h=0; h<helpers; ++h) submit(drain);
+        drain();
+        unique_lock<mutex> lk(job->m);
+        job->cv.wait(lk, [&]{ return job->done.load() == n; });
+    }
+};
+ThreadPool& worker_pool() {
+    static ThreadPool pool(max(1u, thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+// Read-only view of a whole file without copying it: mmap'd on POSIX, read into memory where that
+// is not possible (other platforms, pipes, "-" for stdin). The view lives as long as the object.
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+    bool open(const string &path, string &err) {
+        close();
+        if (path == "-") {
+            owned.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+            data = owned.data(); size = owned.size();
+            return true;
+        }
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) { err = "cannot open " + path; return false; }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (st.st_size > 0) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::close(fd);
+                    madvise(p, st.st_size, MADV_SEQUENTIAL);
+                    mapped = p; data = (const char*)p; size = st.st_size;
+                    return true;
+                }
+            } else { ::close(fd); data = ""; return true; }
+        }
+        ::close(fd);
+#endif
+        ifstream in(path, ios::binary);
+        if (!in) { err = "cannot open " + path; return false; }
+        owned.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = owned.data(); size = owned.size();
+        return true;
+    }
+    void close() {
+#ifndef _WIN32
+        if (mapped) munmap(mapped, size);
+#endif
+        mapped = nullptr; data = nullptr; size = 0;
+        vector<char>().swap(owned);
+    }
+
+private:
+    void *mapped = nullptr;
+    vector<char> owned;
+};
+
+// -------------------- Instrumentation --------------------
+// Phase timers and counters for --trace PREFIX. Every thread appends to its own buffer, so
+// recording takes no lock; a buffer is registered once, on the thread's first event, and outlives
+// its thread. At exit everything is written as a Chrome trace (PREFIX.trace.json, for
+// chrome://tracing or Perfetto) plus CSV: per-phase totals and counters (PREFIX.phases.csv) and
+// per-generation GA statistics (PREFIX.ga.csv). With tracing off a scope costs one relaxed load;
+// build with -DEUPHORISIM_TRACE=0 to compile the macros out entirely.
+#ifndef EUPHORISIM_TRACE
+#define EUPHORISIM_TRACE 1
+#endif
+struct TraceSpan { const char *name; int64_t startNs, durNs; };
+// one island's generation (GA::Island::trace_generation)
+struct GAGenStats {
+    int run, island, generation;
+    int64_t atNs;
+    double bestCost, meanCost;
+    double diversity; // mean share of an individual's edges that are not in the island's best tour
+    int selections, crossovers, mutations;
+};
+struct TraceBuffer {
+    int tid;
+    vector<TraceSpan> spans;
+    vector<pair<const char*, int64_t>> counters; // running totals, keyed by the name literal's address
+    vector<GAGenStats> ga;
+    size_t dropped = 0;
+};
+struct Tracer {
+    static const size_t kMaxSpans = 1 << 20; // per thread; later spans are only counted
+    atomic<bool> enabled{false};
+    atomic<int> gaRuns{0};
+    steady::time_point t0 = steady::now();
+    string prefix;
+    mutex mu;
+    vector<shared_ptr<TraceBuffer>> buffers;
+
+    int64_t now_ns() const { return chrono::duration_cast<chrono::nanoseconds>(steady::now() - t0).count(); }
+    TraceBuffer& local() {
+        thread_local shared_ptr<TraceBuffer> buf = [this] {
+            auto b = make_shared<TraceBuffer>();
+            lock_guard<mutex> lk(mu);
+            b->tid = buffers.size();
+            buffers.push_back(b);
+            return b;
+        }();
+        return *buf;
+    }
+    void span(const char *name, int64_t start, int64_t dur) {
+        TraceBuffer &b = local();
+        if (b.spans.size() < kMaxSpans) b.spans.push_back({ name, start, dur });
+        else ++b.dropped;
+    }
+    void count(const char *name, int64_t n) {
+        auto &c = local().counters;
+        for (auto &kv: c) if (kv.first == name) { kv.second += n; return; }
+        c.push_back({ name, n });
+    }
+    // called once at exit, after the worker pool has been joined
+    void write() {
+        lock_guard<mutex> lk(mu);
+        struct Phase { long long calls = 0; double totalMs = 0, maxMs = 0; };
+        map<string, Phase> phases;
+        map<string, int64_t> totals;
+        vector<GAGenStats> ga;
+        size_t dropped = 0;
+        ofstream js(prefix + ".trace.json");
+        js << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        const char *sep = "";
+        js << fixed << setprecision(3);
+        for (auto &b: buffers) {
+            js << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+               << ",\"args\":{\"name\":\"thread " << b->tid << "\"}}";
+            sep = ",\n";
+            for (auto &s: b->spans) {
+                js << sep << "{\"name\":\"" << s.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                   << ",\"ts\":" << s.startNs / 1e3 << ",\"dur\":" << s.durNs / 1e3 << "}";
+                Phase &p = phases[s.name];
+                ++p.calls; p.totalMs += s.durNs / 1e6; p.maxMs = max(p.maxMs, s.durNs / 1e6);
+            }
+            for (auto &kv: b->counters) totals[kv.first] += kv.second;
+            ga.insert(ga.end(), b->ga.begin(), b->ga.end());
+            dropped += b->dropped;
+        }
+        sort(ga.begin(), ga.end(), [](const GAGenStats &a, const GAGenStats &b) {
+            return tie(a.run, a.generation, a.island) < tie(b.run, b.generation, b.island);
+        });
+        for (auto &g: ga)
+            js << sep << "{\"name\":\"ga run " << g.run << " island " << g.island << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << g.atNs / 1e3
+               << setprecision(6) << ",\"args\":{\"best\":" << g.bestCost << ",\"mean\":" << g.meanCost << ",\"diversity\":" << g.diversity << "}}"
+               << setprecision(3);
+        int64_t end = now_ns();
+        for (auto &kv: totals)
+            js << sep << "{\"name\":\"" << kv.first << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << end / 1e3 << ",\"args\":{\"total\":" << kv.second << "}}";
+        js << "\n]}\n";
+
+        ofstream pc(prefix + ".phases.csv");
+        pc << "kind,name,count,total_ms,mean_ms,max_ms\n" << setprecision(3) << fixed;
+        for (auto &[name, p]: phases) pc << "phase," << name << "," << p.calls << "," << p.totalMs << "," << p.totalMs / p.calls << "," << p.maxMs << "\n";
+        for (auto &[name, n]: totals) pc << "counter," << name << "," << n << ",,,\n";
+
+        ofstream gc(prefix + ".ga.csv");
+        gc << "run,island,generation,time_ms,best_cost,mean_cost,diversity,selections,crossovers,mutations\n" << setprecision(6);
+        for (auto &g: ga)
+            gc << g.run << "," << g.island << "," << g.generation << "," << g.atNs / 1e6 << "," << g.bestCost << "," << g.meanCost << ","
+               << g.diversity << "," << g.selections << "," << g.crossovers << "," << g.mutations << "\n";
+
+        if (!js || !pc || !gc) { cerr << "trace: cannot write " << prefix << ".*\n"; return; }
+        cerr << "trace: " << phases.size() << " phase(s), " << totals.size() << " counter(s), " << ga.size() << " GA generation record(s) -> "
+             << prefix << ".trace.json / .phases.csv / .ga.csv";
+        if (dropped) cerr << " (" << dropped << " span(s) over the per-thread limit dropped)";
+        cerr << "\n";
+    }
+};
+Tracer g_trace;
+
+struct TraceScope {
+    const char *name;
+    int64_t start;
+    explicit TraceScope(const char *n) : name(g_trace.enabled.load(memory_order_relaxed) ? n : nullptr), start(name ? g_trace.now_ns() : 0) {}
+    ~TraceScope() { if (name) g_trace.span(name, start, g_trace.now_ns() - start); }
+};
+#if EUPHORISIM_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ON() g_trace.enabled.load(memory_order_relaxed)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+#define TRACE_COUNT(name, n) do { if (TRACE_ON()) g_trace.count(name, n); } while (0)
+#else
+#define TRACE_ON() false
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_COUNT(name, n) ((void)0)
+#endif
+
+// -------------------- Keystroke Capture --------------------
+// A capture thread timestamps each key with the monotonic clock the moment read() returns it and
+// hands it to the consumer through a single-producer/single-consumer ring. The terminal is put in
+// non-canonical mode for the duration, so keys arrive one at a time instead of a line at a time.
+// A recorded key log can stand in for the terminal (replay), which makes runs reproducible.
+struct KeyEvent {
+    int64_t ns; // steady_clock timestamp in nanoseconds
+    int key;    // byte read
+};
+// steady_clock in nanoseconds whatever its native tick (a raw count() is only ns where period is 1ns)
+int64_t key_time_ns() { return chrono::duration_cast<chrono::nanoseconds>(steady::now().time_since_epoch()).count(); }
+
+// Lock-free SPSC ring: the producer only writes tail, the consumer only writes head, each on its
+// own cache line. N must be a power of two.
+template<typename T, size_t N>
+struct SpscRing {
+    static_assert((N & (N-1)) == 0, "ring size must be a power of two");
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+    alignas(64) T buf[N];
+    bool push(const T &v) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N) return false;
+        buf[t & (N-1)] = v;
+        tail.store(t+1, memory_order_release);
+        return true;
+    }
+    bool pop(T &v) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        v = buf[h & (N-1)];
+        head.store(h+1, memory_order_release);
+        return true;
+    }
+};
+
+// Key log format: one event per line, "<milliseconds> <key code>", e.g. "1532.250 104";
+// timestamps only need to be monotonic, their origin is arbitrary. '#' starts a comment.
+// Parses key-log text in place, calling f(ns, key) per event; no copies, no allocation. On a
+// malformed line returns false with the 1-based line number in badLine.
+template<typename F>
+bool parse_key_log(const char *p, const char *end, F f, int &badLine) {
+    auto digit = [](char c) { return c >= '0' && c <= '9'; };
+    for (int ln = 1; p < end; ++ln) {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p < end && *p != '#' && *p != '\n' && *p != '\r') {
+            const char *start = p;
+            int64_t ip = 0, frac = 0, scale = 100000; // fractional ms digits -> ns
+            while (p < end && digit(*p)) ip = ip*10 + (*p++ - '0');
+            if (p < end && *p == '.')
+                for (++p; p < end && digit(*p); ++p) { frac += (*p - '0') * scale; scale /= 10; }
+            while (p < end && (*p == ' ' || *p == '\t')) ++p;
+            int key = 0;
+            const char *kstart = p;
+            while (p < end && digit(*p)) key = key*10 + (*p++ - '0');
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+            if (kstart == start || p == kstart || (p < end && *p != '\n')) { badLine = ln; return false; }
+            f(ip * 1000000 + frac, key);
+        }
+        const char *eol = (const char*)memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+    return true;
+}
+bool load_key_log(const string &path, vector<KeyEvent> &out, string &err) {
+    MappedFile in;
+    if (!in.open(path, err)) return false;
+    int bad = 0;
+    if (!parse_key_log(in.data, in.data + in.size, [&](int64_t ns, int key) { out.push_back({ ns, key }); }, bad)) {
+        err = path + ":" + to_string(bad) + ": expected '<ms> <key code>'";
+        return false;
+    }
+    return true;
+}
+bool save_key_log(const string &path, const vector<KeyEvent> &events) {
+    ofstream out(path);
+    if (!out) return false;
+    out << "# EuphoriSim key log: <ms> <key code>\n" << fixed << setprecision(3);
+    for (auto &e: events) out << (e.ns - events[0].ns) / 1e6 << " " << e.key << "\n";
+    return (bool)out;
+}
+
+struct KeyCapture {
+    SpscRing<KeyEvent, 1024> ring;
+    atomic<bool> done{false}, stopping{false};
+    thread worker;
+#ifndef _WIN32
+    termios saved{};
+    bool rawMode = false;
+#endif
+
+    KeyCapture() = default;
+    KeyCapture(const KeyCapture&) = delete;
+    ~KeyCapture() { stop(); }
+
+    // Captures from the terminal on stdin; false if stdin is not a terminal (or on platforms
+    // without termios), in which case the caller falls back to cooked input. With lineMode the
+    // thread stops after Enter, so keys typed later stay with whoever reads stdin next.
+    bool start_tty(bool lineMode) {
+#ifndef _WIN32
+        if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) return false;
+        termios raw = saved;
+        raw.c_lflag &= ~ICANON; // keep ECHO and ISIG: the user still sees the text and Ctrl-C works
+        raw.c_cc[VMIN] = 1; raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) return false;
+        rawMode = true;
+        worker = thread([this, lineMode] {
+            pollfd pfd{ STDIN_FILENO, POLLIN, 0 };
+            while (!stopping.load(memory_order_relaxed)) {
+                if (poll(&pfd, 1, 50) <= 0) continue;
+                unsigned char b;
+                if (read(STDIN_FILENO, &b, 1) != 1 || b == 4) break; // EOF or Ctrl-D
+                push({ key_time_ns(), b });
+                if (lineMode && (b == '\n' || b == '\r')) break;
+            }
+            done.store(true, memory_order_release);
+        });
+        return true;
+#else
+        (void)lineMode;
+        return false;
+#endif
+    }
+    // Feeds recorded events through the same ring, up to the first Enter with lineMode.
+    void start_replay(vector<KeyEvent> events, bool lineMode) {
+        worker = thread([this, lineMode, ev = move(events)] {
+            for (auto &e: ev) {
+                if (stopping.load(memory_order_relaxed)) break;
+                push(e);
+                if (lineMode && (e.key == '\n' || e.key == '\r')) break;
+            }
+            done.store(true, memory_order_release);
+        });
+    }
+    // Blocks until the next event; false once the source is exhausted and the ring drained.
+    bool next(KeyEvent &e) {
+        while (!ring.pop(e)) {
+            if (done.load(memory_order_acquire)) return ring.pop(e);
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+        return true;
+    }
+    void stop() {
+        stopping.store(true, memory_order_relaxed);
+        if (worker.joinable()) worker.join();
+#ifndef _WIN32
+        if (rawMode) { tcsetattr(STDIN_FILENO, TCSANOW, &saved); rawMode = false; }
+#endif
+    }
+
+private:
+    void push(const KeyEvent &e) {
+        while (!ring.push(e) && !stopping.load(memory_order_relaxed)) this_thread::yield();
+    }
+};
+
+// -------------------- Typing-based Mood Detector --------------------
+// Running mean/variance (Welford), one pass and numerically stable; merge() combines two
+// accumulators (Chan et al.), which is how the sliding window below sums its buckets.
+struct Welford {
+    long long n = 0;
+    double mean = 0, m2 = 0;
+    void add(double x) { ++n; double d = x - mean; mean += d / n; m2 += d * (x - mean); }
+    void merge(const Welford &o) {
+        if (!o.n) return;
+        long long t = n + o.n;
+        double d = o.mean - mean;
+        mean += d * o.n / t; m2 += o.m2 + d * d * n * o.n / t; n = t;
+    }
+    double variance() const { return n ? m2 / n : 0; } // population variance, as the mood thresholds assume
+    double stddev() const { return sqrt(variance()); }
+};
+
+struct TypingSample {
+    vector<double> intervals; // ms
+    vector<KeyEvent> events;  // the captured line, when there was one (not for the WPM fallback)
+    Welford stats;
+    void add(double interval) { intervals.push_back(interval); stats.add(interval); }
+    double mean() const { return stats.mean; }
+    double stddev() const { return stats.stddev(); }
+};
+
+// Times one line of typing. Keys come from the replay log if given, else from a raw-mode capture
+// thread, else (stdin not a terminal) from cooked cin. recordPath, if set, saves the line's events.
+TypingSample record_typing_sample(const string &replayPath = "", const string &recordPath = "") {
+    TRACE_SCOPE("mood.capture");
+    cout << "Type a short sentence (press ENTER when done). Try to type normally.\n";
+    cout << "Start typing when you're ready >>> ";
+    TypingSample ts;
+    vector<KeyEvent> events;
+    KeyCapture cap;
+    vector<KeyEvent> replay;
+    string err;
+    bool captured = false;
+    if (!replayPath.empty()) {
+        if (load_key_log(replayPath, replay, err)) { cap.start_replay(move(replay), true); captured = true; }
+        else cout << "(" << err << ")\n";
+    }
+    cout.flush();
+    if (captured || cap.start_tty(true)) {
+        KeyEvent e;
+        while (cap.next(e)) {
+            events.push_back(e);
+            if (!replayPath.empty()) cout << (char)e.key;
+            if (e.key == '\n' || e.key == '\r' || events.size() > 500) break;
+        }
+        cap.stop();
+        if (!replayPath.empty() && (events.empty() || events.back().key != '\n')) cout << "\n";
+    } else {
+        // cooked input: the terminal delivers the line at once, so most gaps are buffering noise
+        cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear previous newline
+        string s;
+        char c;
+        // We'll read until newline
+        while (true) {
+            if (!cin.get(c)) break;
+            events.push_back({ key_time_ns(), (unsigned char)c });
+            s.push_back(c);
+            if (c == '\n') break;
+            // If user typed a ctrl char, ignore
+            if ((int)s.size() > 500) break;
+        }
+    }
+    if (!recordPath.empty() && !events.empty() && !save_key_log(recordPath, events)) cout << "(cannot write " << recordPath << ")\n";
+    ts.events = events;
+    // Build intervals between successive visible keys (ignore the first)
+    for (size_t i=1;i<events.size();++i) {
+        double d = (events[i].ns - events[i-1].ns) / 1e6;
+        // ignore very large gaps (pauses) and also extreme micro-gaps
+        if (d > 10 && d < 2000) ts.add(d);
+    }
+    if (ts.intervals.empty()) {
+        // fallback: ask for approximate typing speed (words per minute)
+        cout << "(No accurate keystroke timing captured.) Enter approximate words per minute (WPM): ";
+        int wpm = 0;
+        if (!(cin >> wpm) || wpm <= 0) wpm = 40; // unreadable or nonsensical answer: assume an average typist
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        double msPerChar = 60000.0 / (wpm * 5.0);
+        double jitter[10];
+        rng_stream(STREAM_TYPING).fill_uniform(jitter, 10);
+        for (int i=0;i<10;i++) ts.add(msPerChar + (jitter[i]-0.5)*msPerChar*0.2);
+    }
+    return ts;
+}
+
+enum Mood { MOOD_CALM, MOOD_NEUTRAL, MOOD_EXCITED, MOOD_STRESSED };
+string mood_name(Mood m){
+    switch(m){
+        case MOOD_CALM: return "Calm";
+        case MOOD_NEUTRAL: return "Neutral";
+        case MOOD_EXCITED: return "Excited";
+        case MOOD_STRESSED: return "Stressed";
+    }
+    return "Unknown";
+}
+
+Mood infer_mood(double mean, double sd) {
+    // heuristics (tuned to be robust):
+    // - low mean (fast typing) + low stddev -> Excited / confident
+    // - medium mean, medium sd -> Neutral
+    // - high mean (slow) + low sd -> Calm (deliberate)
+    // - high mean + high sd -> Stressed (pauses, hesitations)
+    if (mean < 120 && sd < 50) return MOOD_EXCITED;
+    if (mean < 160 && sd < 90) return MOOD_NEUTRAL;
+    if (mean >= 160 && sd < 120) return MOOD_CALM;
+    return MOOD_STRESSED;
+}
+Mood infer_mood(const TypingSample &ts) { return infer_mood(ts.mean(), ts.stddev()); }
+
+// P-square streaming quantile (Jain & Chlamtac): five markers track the p-quantile in O(1)
+// memory, nudged by piecewise-parabolic interpolation as samples arrive.
+struct P2Quantile {
+    double p;
+    long long count = 0;
+    double q[5], np[5], dn[5];
+    long long pos[5];
+    explicit P2Quantile(double p = 0.5) : p(p), dn{0, p/2, p, (1+p)/2, 1} {}
+    void add(double x) {
+        if (count < 5) {
+            q[count++] = x;
+            if (count == 5) {
+                sort(q, q+5);
+                for (int i=0;i<5;++i) pos[i] = i;
+                np[0] = 0; np[1] = 2*p; np[2] = 4*p; np[3] = 2+2*p; np[4] = 4;
+            }
+            return;
+        }
+        int k;
+        if (x < q[0]) { q[0] = x; k = 0; }
+        else if (x >= q[4]) { q[4] = x; k = 3; }
+        else { k = 0; while (x >= q[k+1]) ++k; }
+        for (int i=k+1;i<5;++i) ++pos[i];
+        for (int i=0;i<5;++i) np[i] += dn[i];
+        for (int i=1;i<4;++i) {
+            double d = np[i] - pos[i];
+            if ((d >= 1 && pos[i+1] - pos[i] > 1) || (d <= -1 && pos[i-1] - pos[i] < -1)) {
+                int sg = d > 0 ? 1 : -1;
+                double qp = q[i] + (double)sg / (pos[i+1] - pos[i-1])
+                    * ((pos[i] - pos[i-1] + sg) * (q[i+1] - q[i]) / (pos[i+1] - pos[i])
+                     + (pos[i+1] - pos[i] - sg) * (q[i] - q[i-1]) / (pos[i] - pos[i-1]));
+                if (q[i-1] < qp && qp < q[i+1]) q[i] = qp;
+                else q[i] += sg * (q[i+sg] - q[i]) / (pos[i+sg] - pos[i]);
+                pos[i] += sg;
+            }
+        }
+        ++count;
+    }
+    double value() const {
+        if (count >= 5) return q[2];
+        if (count == 0) return 0;
+        double t[5];
+        for (int i=0;i<count;++i) { int j = i; for (; j > 0 && t[j-1] > q[i]; --j) t[j] = t[j-1]; t[j] = q[i]; }
+        return t[(int)llround(p * (count-1))];
+    }
+};
+
+// Per-keystroke rhythm analysis in O(1) memory: Welford moments and P-square quantiles over the
+// whole session, burst / pause counters, and a sliding time window (a ring of kBuckets Welford
+// buckets) whose mood is re-estimated after every key. Feed key() monotonic timestamps in ms.
+struct RhythmAnalyzer {
+    static const int kBuckets = 10;
+    double windowMs = 10000;  // sliding window length
+    double burstMs = 100;     // gaps below this continue a burst...
+    int burstKeys = 4;        // ...which counts once it spans this many keys
+    double pauseMs = 2000;    // gaps above this are pauses, kept out of the rhythm stats
+    double minGapMs = 10;     // gaps below this are buffering artifacts, not keystrokes
+    int minWindowKeys = 5;    // fewer intervals than this in the window -> no estimate yet
+
+    Welford total;
+    P2Quantile p50{0.5}, p90{0.9};
+    long long keys = 0, bursts = 0, pauses = 0;
+    Mood mood = MOOD_NEUTRAL; bool hasMood = false;
+    function<void(double tMs, Mood m, const Welford &window)> onMood; // called when the window mood changes
+
+    void key(double tMs) {
+        ++keys;
+        if (keys > 1) gap(tMs, tMs - lastMs);
+        lastMs = tMs;
+    }
+    Welford window() const {
+        Welford w;
+        for (int i=0;i<kBuckets;++i) if (bucketId[i] > lastBucket - kBuckets && bucketId[i] <= lastBucket) w.merge(bucket[i]);
+        return w;
+    }
+
+private:
+    double lastMs = 0;
+    int run = 0;
+    long long lastBucket = 0;
+    Welford bucket[kBuckets];
+    long long bucketId[kBuckets] = {};
+
+    void gap(double tMs, double d) {
+        if (d < minGapMs) return;
+        if (d > pauseMs) { ++pauses; run = 0; return; }
+        total.add(d); p50.add(d); p90.add(d);
+        if (d < burstMs) { if (++run == burstKeys - 1) ++bursts; }
+        else run = 0;
+        long long b = (long long)(tMs / (windowMs / kBuckets)) + 1; // +1 so id 0 means "empty"
+        int slot = b % kBuckets;
+        if (bucketId[slot] != b) { bucket[slot] = Welford(); bucketId[slot] = b; }
+        bucket[slot].add(d);
+        lastBucket = b;
+        Welford w = window();
+        if (w.n < minWindowKeys) return;
+        Mood m = infer_mood(w.mean, w.stddev());
+        if (!hasMood || m != mood) { mood = m; hasMood = true; if (onMood) onMood(tMs, m, w); }
+    }
+};
+
+// --watch: tracks mood over a long session. Reads keystrokes (raw capture, a replayed key log,
+// or cooked stdin as a last resort) until EOF and reports the windowed mood each time it changes.
+// (Cooked input hands keys over a line at a time; those near-zero gaps are dropped as buffering
+// artifacts.)
+int watch_mood(const string &replayPath = "") {
+    RhythmAnalyzer ra;
+    ra.onMood = [](double t, Mood m, const Welford &w) {
+        cout << "[" << fixed << setprecision(1) << setw(7) << t/1000 << " s] " << mood_name(m)
+             << " (window: " << w.n << " gaps, mean " << (int)w.mean << " ms, sd " << (int)w.stddev() << " ms)\n" << flush;
+    };
+    KeyCapture cap;
+    bool captured = false;
+    if (!replayPath.empty()) {
+        vector<KeyEvent> events;
+        string err;
+        if (!load_key_log(replayPath, events, err)) { cerr << err << "\n"; return 1; }
+        cap.start_replay(move(events), false);
+        captured = true;
+    }
+    cout << "Watching typing rhythm over a " << (int)(ra.windowMs/1000) << " s window. Type freely; Ctrl-D to stop.\n" << flush;
+    if (captured || cap.start_tty(false)) {
+        KeyEvent e;
+        int64_t t0 = -1;
+        while (cap.next(e)) {
+            if (t0 < 0) t0 = e.ns;
+            ra.key((e.ns - t0) / 1e6);
+        }
+        cap.stop();
+    } else {
+        auto t0 = chrono::steady_clock::now();
+        char c;
+        while (cin.get(c)) ra.key(ms(chrono::steady_clock::now() - t0).count());
+    }
+    cout << "\nSession: " << ra.keys << " keys, mean gap " << (int)ra.total.mean << " ms (sd " << (int)ra.total.stddev()
+         << "), median ~" << (int)ra.p50.value() << " ms, p90 ~" << (int)ra.p90.value() << " ms, "
+         << ra.bursts << " bursts, " << ra.pauses << " pauses\n";
+    return 0;
+}
+
+// -------------------- Mood Classifier --------------------
+// A fixed feature vector per typed line, scored by a model loaded from a weights file
+// (--mood-model) and trained offline on labelled logs (--train-mood). Without a model the
+// session keeps the infer_mood thresholds.
+enum MoodFeature {
+    F_MEAN, F_SD, F_P10, F_P50, F_P90, F_CV,  // gap distribution (kept gaps, 10..2000 ms)
+    F_BURST_LEN,     // mean keys per burst (>= 4 keys, every gap under 100 ms)
+    F_BURST_FRAC,    // share of kept gaps inside bursts
+    F_HESITATION,    // share of all gaps of 500 ms or more
+    F_DIGRAPH_MS,    // mean gap over common English digraphs (th, he, in, ...)
+    F_DIGRAPH_RATIO, // that mean over the overall mean: practised pairs come out faster
+    F_CORRECTIONS,   // backspaces per key
+    kMoodFeatures
+};
+const int kMoods = 4;
+const char* feature_name(int f) {
+    static const char *names[kMoodFeatures] = { "mean", "sd", "p10", "p50", "p90", "cv", "burst_len", "burst_frac",
+                                                "hesitation", "digraph_ms", "digraph_ratio", "corrections" };
+    return names[f];
+}
+bool parse_mood(string s, Mood &m) {
+    for (auto &c: s) c = tolower((unsigned char)c);
+    for (int i=0;i<kMoods;++i) {
+        string n = mood_name((Mood)i);
+        for (auto &c: n) c = tolower((unsigned char)c);
+        if (s == n) { m = (Mood)i; return true; }
+    }
+    return false;
+}
+
+// common digraphs as a 26x26 bit table
+bool common_digraph(int a, int b) {
+    static const auto table = [] {
+        array<bool, 26*26> t{};
+        for (const char *d: { "th","he","in","er","an","re","on","at","en","nd","ti","es","or","te","of","ed","is","it","al","ar","st","to","nt","ng" })
+            t[(d[0]-'a')*26 + d[1]-'a'] = true;
+        return t;
+    }();
+    a = tolower(a); b = tolower(b);
+    return a >= 'a' && a <= 'z' && b >= 'a' && b <= 'z' && table[(a-'a')*26 + b-'a'];
+}
+
+// Fills f[kMoodFeatures] from one typed line. The moment sums run branch-free over the gap array
+// in independent lanes, so the compiler can keep them in vector registers.
+void extract_features(const KeyEvent *ev, int n, float *f) {
+    fill(f, f + kMoodFeatures, 0.0f);
+    int m = n - 1;
+    if (m < 1) return;
+    thread_local vector<double> gap, kept;
+    gap.resize(m);
+    for (int i=0;i<m;++i) gap[i] = (ev[i+1].ns - ev[i].ns) * 1e-6;
+    const int L = 4;
+    double s[L] = {}, s2[L] = {}, cnt[L] = {}, slow[L] = {};
+    int i = 0;
+    for (; i + L <= m; i += L)
+        for (int j=0;j<L;++j) {
+            double g = gap[i+j], k = (g > 10) & (g < 2000);
+            s[j] += k*g; s2[j] += k*g*g; cnt[j] += k; slow[j] += g >= 500;
+        }
+    for (; i < m; ++i) { double g = gap[i], k = (g > 10) & (g < 2000); s[0] += k*g; s2[0] += k*g*g; cnt[0] += k; slow[0] += g >= 500; }
+    for (int j=1;j<L;++j) { s[0] += s[j]; s2[0] += s2[j]; cnt[0] += cnt[j]; slow[0] += slow[j]; }
+    f[F_HESITATION] = slow[0] / m;
+    if (cnt[0] == 0) return;
+    double mean = s[0] / cnt[0], sd = sqrt(max(0.0, s2[0] / cnt[0] - mean*mean));
+    f[F_MEAN] = mean; f[F_SD] = sd; f[F_CV] = sd / max(mean, 1.0);
+
+    kept.clear();
+    double digraph = 0; int digraphs = 0, bursts = 0, burstGaps = 0, run = 0, corrections = 0;
+    for (int k=0;k<m;++k) {
+        double g = gap[k];
+        bool keep = g > 10 && g < 2000;
+        if (keep) kept.push_back(g);
+        if (keep && common_digraph(ev[k].key, ev[k+1].key)) { digraph += g; ++digraphs; }
+        if (keep && g < 100) ++run;
+        else { if (run >= 3) { ++bursts; burstGaps += run; } run = 0; }
+    }
+    if (run >= 3) { ++bursts; burstGaps += run; }
+    for (int k=0;k<n;++k) corrections += ev[k].key == 8 || ev[k].key == 127;
+    auto pct = [&](double p) {
+        size_t at = min(kept.size() - 1, (size_t)(p * kept.size()));
+        nth_element(kept.begin(), kept.begin() + at, kept.end());
+        return kept[at];
+    };
+    f[F_P10] = pct(0.1); f[F_P50] = pct(0.5); f[F_P90] = pct(0.9);
+    f[F_BURST_LEN] = bursts ? (double)(burstGaps + bursts) / bursts : 0;
+    f[F_BURST_FRAC] = (double)burstGaps / kept.size();
+    f[F_DIGRAPH_MS] = digraphs ? digraph / digraphs : mean;
+    f[F_DIGRAPH_RATIO] = f[F_DIGRAPH_MS] / max(mean, 1.0);
+    f[F_CORRECTIONS] = (double)corrections / n;
+}
+
+// Gap statistics of one typed line, with the interactive session's filter.
+Welford gap_stats(const KeyEvent *ev, int n) {
+    Welford w;
+    for (int i=1;i<n;++i) {
+        double d = (ev[i].ns - ev[i-1].ns) / 1e6;
+        if (d > 10 && d < 2000) w.add(d);
+    }
+    return w;
+}
+
+// Splits a key log into typed lines (events up to and including Enter) and calls f(events, n)
+// for each. Returns false with the offending line number on a parse error.
+template<typename F>
+bool for_each_typed_line(const char *p, const char *end, F f, int &badLine) {
+    vector<KeyEvent> line;
+    bool ok = parse_key_log(p, end, [&](int64_t ns, int key) {
+        line.push_back({ ns, key });
+        if (key == '\n' || key == '\r') { f(line.data(), (int)line.size()); line.clear(); }
+    }, badLine);
+    if (ok && !line.empty()) f(line.data(), (int)line.size());
+    return ok;
+}
+
+// Models score standardized features, z = (x - mu) / sd:
+//   MODEL_LOGISTIC  multinomial logistic regression, one weight row (bias first) per mood
+//   MODEL_FOREST    small random forest; leaves hold mood probabilities, trees are averaged
+//   MODEL_KNN       k nearest stored training points, inverse-distance weighted vote
+// Weights file (text): "mood-model 1 <kind> <features>", then the mu and sd rows, then
+//   logistic: kMoods rows of 1+F numbers
+//   forest:   "trees T", each "tree N" followed by N nodes "feature threshold left right p0..p3"
+//             (feature -1 marks a leaf)
+//   knn:      "knn K N", then N rows "label z1..zF"
+enum ModelKind { MODEL_LOGISTIC, MODEL_FOREST, MODEL_KNN };
+const char* model_kind_name(ModelKind k) {
+    switch (k) {
+        case MODEL_LOGISTIC: return "logistic";
+        case MODEL_FOREST: return "forest";
+        case MODEL_KNN: return "knn";
+    }
+    return "unknown";
+}
+
+struct MoodModel {
+    struct TreeNode { int feature; float threshold; int left, right; float prob[kMoods]; };
+    ModelKind kind = MODEL_LOGISTIC;
+    bool loaded = false;
+    float mu[kMoodFeatures] = {}, sd[kMoodFeatures] = {};
+    vector<float> weights;          // logistic: kMoods x (1 + kMoodFeatures)
+    vector<vector<TreeNode>> trees; // forest
+    int k = 7;                      // knn
+    vector<float> points;           // knn: N x kMoodFeatures, standardized
+    vector<int> labels;
+
+    void standardize(const float *x, float *z) const {
+        for (int j=0;j<kMoodFeatures;++j) z[j] = (x[j] - mu[j]) / sd[j];
+    }
+    // mood probabilities for one standardized row
+    void scores(const float *z, float *p) const {
+        fill(p, p + kMoods, 0.0f);
+        if (kind == MODEL_LOGISTIC) {
+            float mx = -numeric_limits<float>::infinity(), sum = 0;
+            for (int c=0;c<kMoods;++c) {
+                const float *w = &weights[c * (1 + kMoodFeatures)];
+                float a = w[0];
+                for (int j=0;j<kMoodFeatures;++j) a += w[1+j] * z[j];
+                p[c] = a; mx = max(mx, a);
+            }
+            for (int c=0;c<kMoods;++c) sum += p[c] = exp(p[c] - mx);
+            for (int c=0;c<kMoods;++c) p[c] /= sum;
+        } else if (kind == MODEL_FOREST) {
+            for (auto &t: trees) {
+                int at = 0;
+                while (t[at].feature >= 0) at = z[t[at].feature] <= t[at].threshold ? t[at].left : t[at].right;
+                for (int c=0;c<kMoods;++c) p[c] += t[at].prob[c] / trees.size();
+            }
+        } else {
+            thread_local vector<pair<float,int>> d;
+            int N = labels.size();
+            d.resize(N);
+            for (int i=0;i<N;++i) {
+                const float *q = &points[(size_t)i * kMoodFeatures];
+                float s = 0;
+                for (int j=0;j<kMoodFeatures;++j) s += (q[j] - z[j]) * (q[j] - z[j]);
+                d[i] = { s, labels[i] };
+            }
+            int kk = min(k, N);
+            partial_sort(d.begin(), d.begin() + kk, d.end());
+            float sum = 0;
+            for (int i=0;i<kk;++i) { float w = 1 / (sqrt(d[i].first) + 1e-3f); p[d[i].second] += w; sum += w; }
+            for (int c=0;c<kMoods;++c) p[c] /= sum;
+        }
+    }
+    // batched inference over n feature rows (row-major n x kMoodFeatures)
+    void classify(const float *X, int n, Mood *out) const {
+        float z[kMoodFeatures], p[kMoods];
+        for (int i=0;i<n;++i) {
+            standardize(X + (size_t)i * kMoodFeatures, z);
+            scores(z, p);
+            out[i] = (Mood)(max_element(p, p + kMoods) - p);
+        }
+    }
+
+    bool save(const string &path) const {
+        ofstream out(path);
+        if (!out) return false;
+        out << "# EuphoriSim mood model; features:";
+        for (int j=0;j<kMoodFeatures;++j) out << " " << feature_name(j);
+        out << "\nmood-model 1 " << model_kind_name(kind) << " " << kMoodFeatures << "\n" << setprecision(9);
+        for (float v: mu) out << v << " ";
+        out << "\n";
+        for (float v: sd) out << v << " ";
+        out << "\n";
+        if (kind == MODEL_LOGISTIC) {
+            for (int c=0;c<kMoods;++c) {
+                for (int j=0;j<=kMoodFeatures;++j) out << weights[c * (1 + kMoodFeatures) + j] << " ";
+                out << "\n";
+            }
+        } else if (kind == MODEL_FOREST) {
+            out << "trees " << trees.size() << "\n";
+            for (auto &t: trees) {
+                out << "tree " << t.size() << "\n";
+                for (auto &nd: t) {
+                    out << nd.feature << " " << nd.threshold << " " << nd.left << " " << nd.right;
+                    for (float v: nd.prob) out << " " << v;
+                    out << "\n";
+                }
+            }
+        } else {
+            out << "knn " << k << " " << labels.size() << "\n";
+            for (size_t i=0;i<labels.size();++i) {
+                out << labels[i];
+                for (int j=0;j<kMoodFeatures;++j) out << " " << points[i * kMoodFeatures + j];
+                out << "\n";
+            }
+        }
+        return (bool)out;
+    }
+    bool load(const string &path, string &err) {
+        ifstream in(path);
+        if (!in) { err = "cannot open " + path; return false; }
+        string line, tag, kindName;
+        while (in.peek() == '#') getline(in, line);
+        int version = 0, nf = 0;
+        in >> tag >> version >> kindName >> nf;
+        if (!in || tag != "mood-model" || version != 1) { err = path + ": not a mood model"; return false; }
+        if (nf != kMoodFeatures) { err = path + ": model has " + to_string(nf) + " features, expected " + to_string(kMoodFeatures); return false; }
+        if (kindName == "logistic") kind = MODEL_LOGISTIC;
+        else if (kindName == "forest") kind = MODEL_FOREST;
+        else if (kindName == "knn") kind = MODEL_KNN;
+        else { err = path + ": unknown model kind '" + kindName + "'"; return false; }
+        for (float &v: mu) in >> v;
+        for (float &v: sd) { in >> v; if (!(v > 0)) v = 1; }
+        weights.clear(); trees.clear(); points.clear(); labels.clear();
+        if (kind == MODEL_LOGISTIC) {
+            weights.resize(kMoods * (1 + kMoodFeatures));
+            for (float &w: weights) in >> w;
+        } else if (kind == MODEL_FOREST) {
+            int T = 0;
+            in >> tag >> T;
+            if (!in || tag != "trees" || T < 1) { err = path + ": expected 'trees <count>' with at least one tree"; return false; }
+            for (int t=0; in && t<T; ++t) {
+                int N = 0;
+                in >> tag >> N;
+                if (!in || tag != "tree") { err = path + ": expected 'tree <nodes>' for tree " + to_string(t); return false; }
+                vector<TreeNode> nodes(max(N, 0));
+                for (auto &nd: nodes) { in >> nd.feature >> nd.threshold >> nd.left >> nd.right; for (float &v: nd.prob) in >> v; }
+                // children come after their parent (the trainer writes nodes in preorder), so every walk
+                // from the root moves forward and ends at a leaf
+                for (int i=0;i<N;++i) {
+                    const TreeNode &nd = nodes[i];
+                    if (nd.feature >= kMoodFeatures || (nd.feature >= 0 && (nd.left <= i || nd.right <= i || nd.left >= N || nd.right >= N))) {
+                        err = path + ": malformed tree"; return false;
+                    }
+                }
+                if (nodes.empty()) { err = path + ": empty tree"; return false; }
+                trees.push_back(move(nodes));
+            }
+        } else {
+            int N = 0;
+            in >> tag >> k >> N;
+            if (!in || tag != "knn") { err = path + ": expected 'knn <k> <rows>'"; return false; }
+            // the vote needs k stored rows, or its weights sum to nothing
+            if (k < 1 || k > N) { err = path + ": knn k = " + to_string(k) + " must be between 1 and the " + to_string(N) + " stored rows"; return false; }
+            for (int i=0; in && i<N; ++i) {
+                int lab; in >> lab;
+                labels.push_back(min(max(lab, 0), kMoods-1));
+                for (int j=0;j<kMoodFeatures;++j) { float v; in >> v; points.push_back(v); }
+            }
+            if (labels.empty()) { err = path + ": no neighbours stored"; return false; }
+        }
+        if (!in) { err = path + ": truncated model"; return false; }
+        loaded = true;
+        return true;
+    }
+};
+
+// --mood-model loads into this; classify_mood falls back to the thresholds while it is empty
+MoodModel g_moodModel;
+Mood classify_mood(const KeyEvent *ev, int n, const Welford &w) {
+    TRACE_SCOPE("mood.classify");
+    if (!g_moodModel.loaded || n < 2) return infer_mood(w.mean, w.stddev());
+    float x[kMoodFeatures];
+    extract_features(ev, n, x);
+    Mood m;
+    g_moodModel.classify(x, 1, &m);
+    return m;
+}
+
+// ---- offline training ----
+void fit_logistic(MoodModel &mdl, const vector<float> &Z, const vector<int> &y) {
+    int n = y.size(), W = 1 + kMoodFeatures;
+    mdl.weights.assign(kMoods * W, 0.0f);
+    vector<float> grad(kMoods * W);
+    float z[kMoodFeatures], p[kMoods];
+    const double lr = 0.5, l2 = 1e-3;
+    for (int epoch=0; epoch<400; ++epoch) {
+        fill(grad.begin(), grad.end(), 0.0f);
+        for (int i=0;i<n;++i) {
+            copy_n(&Z[(size_t)i * kMoodFeatures], kMoodFeatures, z);
+            mdl.scores(z, p);
+            for (int c=0;c<kMoods;++c) {
+                float e = p[c] - (y[i] == c);
+                grad[c*W] += e;
+                for (int j=0;j<kMoodFeatures;++j) grad[c*W + 1 + j] += e * z[j];
+            }
+        }
+        for (int c=0;c<kMoods;++c)
+            for (int j=0;j<W;++j) mdl.weights[c*W + j] -= lr * (grad[c*W + j] / n + (j ? l2 * mdl.weights[c*W + j] : 0));
+    }
+}
+void fit_forest(MoodModel &mdl, const vector<float> &Z, const vector<int> &y, Rng &rng, int treeCount = 25, int maxDepth = 6) {
+    int n = y.size(), tries = max(1, (int)sqrt((double)kMoodFeatures));
+    auto zv = [&](int i, int j) { return Z[(size_t)i * kMoodFeatures + j]; };
+    mdl.trees.clear();
+    for (int t=0;t<treeCount;++t) {
+        vector<int> rows(n);
+        for (int &r: rows) r = rng.bounded(n); // bootstrap
+        vector<MoodModel::TreeNode> nodes;
+        function<int(int,int,int)> grow = [&](int lo, int hi, int depth) {
+            int id = nodes.size();
+            nodes.push_back({ -1, 0, 0, 0, {} });
+            float cnt[kMoods] = {};
+            for (int i=lo;i<hi;++i) cnt[y[rows[i]]]++;
+            for (int c=0;c<kMoods;++c) nodes[id].prob[c] = cnt[c] / (hi - lo);
+            if (depth >= maxDepth || hi - lo < 4 || *max_element(cnt, cnt + kMoods) == hi - lo) return id;
+            double bestGini = 1e18; int bestF = -1; float bestT = 0;
+            vector<pair<float,int>> col(hi - lo);
+            for (int tr=0; tr<tries; ++tr) {
+                int fj = rng.bounded(kMoodFeatures);
+                for (int i=lo;i<hi;++i) col[i-lo] = { zv(rows[i], fj), y[rows[i]] };
+                sort(col.begin(), col.end());
+                float left[kMoods] = {};
+                for (int i=0; i+1<(int)col.size(); ++i) {
+                    left[col[i].second]++;
+                    if (col[i].first == col[i+1].first) continue;
+                    double nl = i + 1, nr = col.size() - nl, gl = 1, gr = 1;
+                    for (int c=0;c<kMoods;++c) { gl -= (left[c]/nl)*(left[c]/nl); gr -= ((cnt[c]-left[c])/nr)*((cnt[c]-left[c])/nr); }
+                    double g = nl*gl + nr*gr;
+                    if (g < bestGini) { bestGini = g; bestF = fj; bestT = (col[i].first + col[i+1].first) / 2; }
+                }
+            }
+            if (bestF < 0) return id;
+            int mid = partition(rows.begin() + lo, rows.begin() + hi, [&](int r) { return zv(r, bestF) <= bestT; }) - rows.begin();
+            if (mid == lo || mid == hi) return id;
+            int l = grow(lo, mid, depth+1), r = grow(mid, hi, depth+1);
+            nodes[id].feature = bestF; nodes[id].threshold = bestT; nodes[id].left = l; nodes[id].right = r;
+            return id;
+        };
+        grow(0, n, 0);
+        mdl.trees.push_back(move(nodes));
+    }
+}
+
+// --train-mood OUT MANIFEST [--model KIND]: MANIFEST lists "<mood> <key log>" per line; every typed
+// line of a log is a sample with that label. 20% of the samples are held out to report accuracy,
+// then the model is refit on everything and written to OUT.
+int train_mood_model(const string &outPath, const string &manifest, ModelKind kind) {
+    ifstream mf(manifest);
+    if (!mf) { cerr << "cannot open " << manifest << "\n"; return 1; }
+    vector<float> X;
+    vector<int> y;
+    string line;
+    while (getline(mf, line)) {
+        istringstream ls(line);
+        string label, path;
+        if (!(ls >> label) || label[0] == '#') continue;
+        getline(ls >> ws, path);
+        Mood m;
+        if (!parse_mood(label, m) || path.empty()) { cerr << manifest << ": skipping '" << line << "'\n"; continue; }
+        MappedFile in;
+        string err;
+        int bad = 0;
+        if (!in.open(path, err)) { cerr << err << "\n"; return 1; }
+        bool ok = for_each_typed_line(in.data, in.data + in.size, [&](const KeyEvent *ev, int n) {
+            if (gap_stats(ev, n).n < 2) return;
+            X.resize(X.size() + kMoodFeatures);
+            extract_features(ev, n, &X[X.size() - kMoodFeatures]);
+            y.push_back(m);
+        }, bad);
+        if (!ok) { cerr << path << ":" << bad << ": expected '<ms> <key code>'\n"; return 1; }
+    }
+    int n = y.size();
+    if (n < 10) { cerr << "need at least 10 labelled samples, got " << n << "\n"; return 1; }
+    Rng rng(0x7a11);
+    auto fit = [&](MoodModel &mdl, const vector<int> &rows) {
+        mdl.kind = kind;
+        for (int j=0;j<kMoodFeatures;++j) {
+            Welford w;
+            for (int i: rows) w.add(X[(size_t)i * kMoodFeatures + j]);
+            mdl.mu[j] = w.mean; mdl.sd[j] = w.stddev() > 1e-9 ? w.stddev() : 1;
+        }
+        vector<float> Z(rows.size() * kMoodFeatures);
+        vector<int> yy;
+        for (size_t r=0;r<rows.size();++r) { mdl.standardize(&X[(size_t)rows[r] * kMoodFeatures], &Z[r * kMoodFeatures]); yy.push_back(y[rows[r]]); }
+        if (kind == MODEL_LOGISTIC) fit_logistic(mdl, Z, yy);
+        else if (kind == MODEL_FOREST) fit_forest(mdl, Z, yy, rng);
+        else { mdl.points = Z; mdl.labels = yy; }
+        mdl.loaded = true;
+    };
+    auto accuracy = [&](const MoodModel &mdl, const vector<int> &rows) {
+        vector<float> Xs;
+        for (int i: rows) Xs.insert(Xs.end(), &X[(size_t)i * kMoodFeatures], &X[(size_t)(i+1) * kMoodFeatures]);
+        vector<Mood> pred(rows.size());
+        mdl.classify(Xs.data(), rows.size(), pred.data());
+        int hit = 0;
+        for (size_t r=0;r<rows.size();++r) hit += pred[r] == y[rows[r]];
+        return (double)hit / rows.size();
+    };
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    shuffle_vec(order, rng);
+    vector<int> train(order.begin(), order.begin() + n*4/5), test(order.begin() + n*4/5, order.end());
+    MoodModel holdout;
+    fit(holdout, train);
+    // the thresholds as a baseline
+    int base = 0;
+    for (int i: test) {
+        const float *x = &X[(size_t)i * kMoodFeatures];
+        base += infer_mood(x[F_MEAN], x[F_SD]) == y[i];
+    }
+    cout << n << " samples; " << model_kind_name(kind) << " held-out accuracy " << fixed << setprecision(3) << accuracy(holdout, test)
+         << " (thresholds: " << (double)base / test.size() << ")\n";
+    MoodModel full;
+    fit(full, order);
+    if (!full.save(outPath)) { cerr << "cannot write " << outPath << "\n"; return 1; }
+    cout << "Wrote " << outPath << "\n";
+    return 0;
+}
+
+// -------------------- Music Recommender (simple) --------------------
+// Song features, all in [0,1]: tempo (BPM/200), energy, valence, acousticness.
+const int kSongFeatures = 4;
+using SongFeatures = array<float, kSongFeatures>;
+struct Song { string title, artist, vibe; SongFeatures feat{}; };
+vector<Song> song_library = {
+    {"Sunrise Drive","Nova Lane","calm", {.35f,.30f,.70f,.70f}},
+    {"Midnight Sprint","Electra","excited", {.85f,.90f,.60f,.10f}},
+    {"Coffee & Rain","Slowfold","calm", {.30f,.20f,.50f,.85f}},
+    {"Neon Pulse","The Jetstream","excited", {.80f,.85f,.75f,.05f}},
+    {"Easy Sunday","Paper Boat","calm", {.40f,.25f,.80f,.75f}},
+    {"Focus Mode","Binary Hearts","neutral", {.55f,.50f,.55f,.40f}},
+    {"Uplift","StellarVox","excited", {.75f,.80f,.90f,.15f}},
+    {"Quiet Corners","MellowMuse","calm", {.25f,.15f,.45f,.90f}},
+    {"Walking Home","Alleyways","neutral", {.50f,.45f,.65f,.50f}},
+    {"Heart Rate","PulseUnit","excited", {.90f,.95f,.55f,.05f}}
+};
+// vibes a mood may draw from; applied as a pre-filter before any ranking
+bool vibe_suits(Mood m, string_view v) {
+    switch (m) {
+        case MOOD_CALM: return v == "calm";
+        case MOOD_EXCITED: return v == "excited";
+        case MOOD_NEUTRAL: return v == "neutral" || v == "calm";
+        case MOOD_STRESSED: return v != "excited";
+    }
+    return false;
+}
+// Continuous counterpart of infer_mood: the point in feature space the typing rhythm asks for.
+// Quick typing wants tempo and energy, an erratic rhythm (stddev large next to the mean) pulls
+// valence down, and acousticness mirrors energy.
+SongFeatures mood_target(double mean, double sd) {
+    double cv = sd / max(mean, 1.0);
+    auto unit = [](double v) { return (float)min(1.0, max(0.0, v)); };
+    float energy = unit((240 - mean) / 180);
+    return { unit((260 - mean) / 200), energy, unit(0.9 - 0.8*cv), 1 - energy };
+}
+SongFeatures mood_target(const TypingSample &ts) { return mood_target(ts.mean(), ts.stddev()); }
+
+// -------------------- HNSW Index --------------------
+// Hierarchical navigable small-world graph over song features, one graph per vibe so the vibe
+// filter is a true pre-filter (a query only walks the graphs of the vibes it accepts).
+// Nodes are posting positions (see SongCatalog), which keeps each vibe's nodes contiguous.
+// Links live in flat arrays so the catalog can serve them straight from the mmap:
+//   level0[p*M0 ..]         up to M0 neighbours at level 0, padded with kNoNode
+//   upper[upperStart[p] + (l-1)*M ..]  up to M neighbours at level l >= 1
+struct HnswView {
+    static constexpr uint32_t kNoNode = ~0u;
+    int M = 8, M0 = 16;
+    const float *feat = nullptr;       // kSongFeatures floats per track
+    const uint32_t *postings = nullptr; // posting position -> track id
+    const uint8_t *level = nullptr;
+    const uint32_t *level0 = nullptr, *upperStart = nullptr, *upper = nullptr;
+    uint32_t n = 0;
+
+    const uint32_t* links(uint32_t p, int l) const { return l == 0 ? level0 + (size_t)p*M0 : upper + upperStart[p] + (size_t)(l-1)*M; }
+    int cap(int l) const { return l == 0 ? M0 : M; }
+    float dist(const float *q, uint32_t p) const {
+        const float *f = feat + (size_t)postings[p] * kSongFeatures;
+        float s = 0;
+        for (int i=0;i<kSongFeatures;++i) s += (q[i]-f[i])*(q[i]-f[i]);
+        return s;
+    }
+    uint32_t greedy(const float *q, uint32_t cur, int l) const {
+        float dc = dist(q, cur);
+        for (bool moved = true; moved; ) {
+            moved = false;
+            const uint32_t *nb = links(cur, l);
+            for (int i=0; i<cap(l) && nb[i] != kNoNode; ++i) {
+                float d = dist(q, nb[i]);
+                if (d < dc) { dc = d; cur = nb[i]; moved = true; }
+            }
+        }
+        return cur;
+    }
+    // best-first search of one level from ep; returns up to ef (dist, node) pairs, nearest first
+    vector<pair<float,uint32_t>> search_level(const float *q, uint32_t ep, int ef, int l) const {
+        thread_local vector<uint32_t> seen;
+        thread_local uint32_t epoch = 0;
+        if (seen.size() < n) seen.assign(n, 0), epoch = 0;
+        if (++epoch == 0) fill(seen.begin(), seen.end(), 0), epoch = 1;
+        priority_queue<pair<float,uint32_t>, vector<pair<float,uint32_t>>, greater<>> frontier;
+        priority_queue<pair<float,uint32_t>> best; // max-heap of the ef closest so far
+        float d0 = dist(q, ep);
+        frontier.push({d0, ep}); best.push({d0, ep}); seen[ep] = epoch;
+        while (!frontier.empty()) {
+            auto [dc, c] = frontier.top();
+            if (dc > best.top().first && (int)best.size() >= ef) break;
+            frontier.pop();
+            const uint32_t *nb = links(c, l);
+            for (int i=0; i<cap(l) && nb[i] != kNoNode; ++i) {
+                uint32_t v = nb[i];
+                if (seen[v] == epoch) continue;
+                seen[v] = epoch;
+                float d = dist(q, v);
+                if ((int)best.size() < ef || d < best.top().first) {
+                    frontier.push({d, v}); best.push({d, v});
+                    if ((int)best.size() > ef) best.pop();
+                }
+            }
+        }
+        vector<pair<float,uint32_t>> out(best.size());
+        for (size_t i = out.size(); i-- > 0; best.pop()) out[i] = best.top();
+        return out;
+    }
+    // k nearest nodes to q in the graph entered at ep (top level top)
+    vector<pair<float,uint32_t>> knn(const float *q, uint32_t ep, int top, int k, int ef) const {
+        for (int l = top; l > 0; --l) ep = greedy(q, ep, l);
+        auto res = search_level(q, ep, max(ef, k), 0);
+        if ((int)res.size() > k) res.resize(k);
+        return res;
+    }
+};
+
+// Offline construction (Malkov & Yashunin): nodes are inserted one at a time, linked to the
+// neighbours picked by the diversity heuristic, and over-full neighbour lists are re-pruned.
+struct HnswBuilder {
+    HnswView g;
+    vector<uint8_t> level;
+    vector<uint32_t> level0, upperStart, upper;
+    int efConstruction = 64;
+
+    HnswBuilder(const float *feat, const uint32_t *postings, uint32_t n, int M = 8, int M0 = 16) {
+        g.M = M; g.M0 = M0; g.feat = feat; g.postings = postings; g.n = n;
+        Rng rng(0x5eed);
+        double mult = 1 / log((double)M);
+        level.resize(n); upperStart.resize(n+1, 0);
+        for (uint32_t p=0;p<n;++p) {
+            level[p] = (uint8_t)min(15.0, floor(-log(max(rng.uniform(), 1e-12)) * mult));
+            upperStart[p+1] = upperStart[p] + level[p] * M;
+        }
+        level0.assign((size_t)n * M0, HnswView::kNoNode);
+        upper.assign(upperStart[n], HnswView::kNoNode);
+        g.level = level.data(); g.level0 = level0.data(); g.upperStart = upperStart.data(); g.upper = upper.data();
+    }
+    uint32_t* links(uint32_t p, int l) { return const_cast<uint32_t*>(g.links(p, l)); }
+    // keeps a candidate only if it is closer to the base than to every neighbour already kept
+    void select(vector<pair<float,uint32_t>> &cand, int m) {
+        sort(cand.begin(), cand.end());
+        vector<pair<float,uint32_t>> kept;
+        for (auto &c: cand) {
+            if ((int)kept.size() >= m) break;
+            const float *fc = g.feat + (size_t)g.postings[c.second] * kSongFeatures;
+            bool ok = true;
+            for (auto &k: kept) if (g.dist(fc, k.second) < c.first) { ok = false; break; }
+            if (ok) kept.push_back(c);
+        }
+        cand.swap(kept);
+    }
+    void link(uint32_t from, uint32_t to, int l) {
+        uint32_t *nb = links(from, l);
+        int cap = g.cap(l), cnt = 0;
+        while (cnt < cap && nb[cnt] != HnswView::kNoNode) ++cnt;
+        if (cnt < cap) { nb[cnt] = to; return; }
+        const float *ff = g.feat + (size_t)g.postings[from] * kSongFeatures;
+        vector<pair<float,uint32_t>> cand;
+        for (int i=0;i<cap;++i) cand.push_back({g.dist(ff, nb[i]), nb[i]});
+        cand.push_back({g.dist(ff, to), to});
+        select(cand, cap);
+        for (int i=0;i<cap;++i) nb[i] = i < (int)cand.size() ? cand[i].second : HnswView::kNoNode;
+    }
+    // builds the graph over nodes [lo, hi); returns (entry node, top level), or kNoNode if empty
+    pair<uint32_t,int> build(uint32_t lo, uint32_t hi) {
+        uint32_t ep = HnswView::kNoNode; int top = -1;
+        for (uint32_t p=lo; p<hi; ++p) {
+            const float *q = g.feat + (size_t)g.postings[p] * kSongFeatures;
+            int lp = level[p];
+            if (ep == HnswView::kNoNode) { ep = p; top = lp; continue; }
+            uint32_t cur = ep;
+            for (int l = top; l > lp; --l) cur = g.greedy(q, cur, l);
+            for (int l = min(lp, top); l >= 0; --l) {
+                auto cand = g.search_level(q, cur, efConstruction, l);
+                cur = cand[0].second;
+                select(cand, g.M);
+                uint32_t *nb = links(p, l);
+                for (size_t i=0;i<cand.size();++i) { nb[i] = cand[i].second; link(cand[i].second, p, l); }
+            }
+            if (lp > top) { ep = p; top = lp; }
+        }
+        return {ep, top};
+    }
+};
+
+// Binary song catalog, usable in place from an mmap: no parsing or copying at startup.
+// Artists and vibes are interned, and tracks are grouped into per-vibe posting lists so a
+// recommendation only touches the tracks it returns. Layout (native endian, sections 8-aligned):
+//   CatalogHeader
+//   CatalogTrack tracks[nTracks]
+//   StrSpan artists[nArtists], vibes[nVibes]
+//   uint32 postStart[nVibes+1], postings[nTracks]  (track ids of vibe v: postings[postStart[v] .. postStart[v+1]))
+//   char strings[stringsLen]
+// and, with CATALOG_FEATURES, the song features plus one HNSW graph per vibe:
+//   float features[nTracks*kSongFeatures]
+//   uint8 level[nTracks], uint32 level0[nTracks*hnswM0], upperStart[nTracks+1], upper[upperLen]
+//   uint32 entry[nVibes*2]  (entry node and top level of each vibe's graph)
+struct StrSpan { uint32_t off, len; };
+struct CatalogTrack { StrSpan title; uint32_t artist, vibe; };
+enum CatalogFlags : uint32_t { CATALOG_FEATURES = 1 };
+struct CatalogHeader {
+    uint32_t magic, version, nTracks, nArtists, nVibes, flags;
+    uint32_t hnswM, hnswM0;
+    uint64_t tracksOff, artistsOff, vibesOff, postStartOff, postingsOff, stringsOff, stringsLen;
+    uint64_t featuresOff, levelOff, level0Off, upperStartOff, upperOff, upperLen, entryOff;
+};
+
+struct SongCatalog {
+    static const uint32_t kMagic = 0x43535350; // "PSSC"
+    static const uint32_t kVersion = 2;
+    const CatalogHeader *hdr = nullptr;
+    const CatalogTrack *tracks = nullptr;
+    const StrSpan *artists = nullptr, *vibes = nullptr;
+    const uint32_t *postStart = nullptr, *postings = nullptr;
+    const char *strings = nullptr;
+    const uint32_t *entry = nullptr;
+    HnswView index;
+    vector<uint64_t> owned; // backing store for adopt()ed catalogs (e.g. the built-in library)
+    MappedFile file;
+
+    SongCatalog() = default;
+    SongCatalog(const SongCatalog&) = delete;
+    SongCatalog& operator=(const SongCatalog&) = delete;
+
+    int size() const { return hdr ? hdr->nTracks : 0; }
+    int vibe_count() const { return hdr ? hdr->nVibes : 0; }
+    bool has_index() const { return hdr && (hdr->flags & CATALOG_FEATURES); }
+    string_view str(StrSpan s) const { return string_view(strings + s.off, s.len); }
+    string_view title(int t) const { return str(tracks[t].title); }
+    string_view artist(int t) const { return str(artists[tracks[t].artist]); }
+    string_view vibe(int t) const { return str(vibes[tracks[t].vibe]); }
+    string_view vibe_name(int v) const { return str(vibes[v]); }
+    int vibe_id(string_view name) const {
+        for (int v=0; v<vibe_count(); ++v) if (vibe_name(v) == name) return v;
+        return -1;
+    }
+    const uint32_t* posting_begin(int v) const { return postings + postStart[v]; }
+    uint32_t posting_size(int v) const { return postStart[v+1] - postStart[v]; }
+    Song song(int t) const {
+        Song s{ string(title(t)), string(artist(t)), string(vibe(t)) };
+        if (has_index()) copy_n(index.feat + (size_t)t*kSongFeatures, kSongFeatures, s.feat.begin());
+        return s;
+    }
+    // the k tracks nearest to target among the vibes accepted by `keep`, nearest first
+    template<typename Keep>
+    vector<pair<float,uint32_t>> nearest(const SongFeatures &target, int k, Keep keep, int ef = 48) const {
+        vector<pair<float,uint32_t>> all;
+        for (int v=0; v<vibe_count(); ++v) {
+            if (entry[2*v] == HnswView::kNoNode || !keep(vibe_name(v))) continue;
+            for (auto [d, p]: index.knn(target.data(), entry[2*v], entry[2*v+1], k, ef)) all.push_back({d, postings[p]});
+        }
+        sort(all.begin(), all.end());
+        if ((int)all.size() > k) all.resize(k);
+        return all;
+    }
+
+    // takes ownership of a serialized catalog (see build_catalog)
+    bool adopt(const vector<char> &buf, string &err) {
+        unmap();
+        owned.assign((buf.size() + 7) / 8, 0);
+        memcpy(owned.data(), buf.data(), buf.size());
+        return bind(owned.data(), buf.size(), err);
+    }
+    bool open(const string &path, string &err) {
+        TRACE_SCOPE("catalog.open");
+        unmap();
+        if (!file.open(path, err)) return false;
+        if (!bind(file.data, file.size, err)) { unmap(); err = path + ": " + err; return false; }
+        return true;
+    }
+    // full check of every track, posting and index link (O(tracks * M0), reads the whole file);
+    // open() checks only the header and per-vibe tables, see --verify-catalog
+    bool verify(string &err) const {
+        if (!hdr) { err = "no catalog"; return false; }
+        if (!contents_valid()) { err = "corrupt catalog (id, string or link out of range)"; return false; }
+        return true;
+    }
+
+private:
+    void unmap() { file.close(); hdr = nullptr; }
+    // points the section pointers into [base, base+len) after checking that every section fits and
+    // that the per-vibe tables are consistent; O(vibes), so opening never reads the tracks themselves
+    bool bind(const void *base, size_t len, string &err) {
+        const char *b = (const char*)base;
+        // count elements of `size` bytes at off, bounded by division so a huge count cannot wrap
+        auto fits = [&](uint64_t off, uint64_t count, uint64_t size) { return off % 8 == 0 && off <= len && count <= (len - off) / size; };
+        if (len < sizeof(CatalogHeader)) { err = "truncated catalog"; return false; }
+        const CatalogHeader *h = (const CatalogHeader*)b;
+        if (h->magic != kMagic || h->version != kVersion) { err = "not a song catalog (or an unsupported version)"; return false; }
+        uint64_t n = h->nTracks, V = h->nVibes;
+        if (!fits(h->tracksOff, n, sizeof(CatalogTrack)) || !fits(h->artistsOff, h->nArtists, sizeof(StrSpan))
+            || !fits(h->vibesOff, V, sizeof(StrSpan)) || !fits(h->postStartOff, V + 1, 4)
+            || !fits(h->postingsOff, n, 4) || !fits(h->stringsOff, h->stringsLen, 1)) {
+            err = "corrupt catalog (section out of bounds)"; return false;
+        }
+        if ((h->flags & CATALOG_FEATURES) && (h->hnswM == 0 || h->hnswM0 == 0 || h->hnswM > 256 || h->hnswM0 > 256 || !fits(h->featuresOff, n, kSongFeatures * 4)
+            || !fits(h->levelOff, n, 1) || !fits(h->level0Off, n, h->hnswM0 * 4) || !fits(h->upperStartOff, n + 1, 4)
+            || !fits(h->upperOff, h->upperLen, 4) || !fits(h->entryOff, V, 8))) {
+            err = "corrupt catalog (index section out of bounds)"; return false;
+        }
+        hdr = h;
+        tracks = (const CatalogTrack*)(b + h->tracksOff);
+        artists = (const StrSpan*)(b + h->artistsOff); vibes = (const StrSpan*)(b + h->vibesOff);
+        postStart = (const uint32_t*)(b + h->postStartOff); postings = (const uint32_t*)(b + h->postingsOff);
+        strings = b + h->stringsOff;
+        if (h->flags & CATALOG_FEATURES) {
+            index.M = h->hnswM; index.M0 = h->hnswM0; index.n = h->nTracks;
+            index.feat = (const float*)(b + h->featuresOff); index.postings = postings;
+            index.level = (const uint8_t*)(b + h->levelOff); index.level0 = (const uint32_t*)(b + h->level0Off);
+            index.upperStart = (const uint32_t*)(b + h->upperStartOff); index.upper = (const uint32_t*)(b + h->upperOff);
+            entry = (const uint32_t*)(b + h->entryOff);
+        }
+        if (!tables_valid()) { hdr = nullptr; err = "corrupt catalog (vibe table or entry point out of range)"; return false; }
+        return true;
+    }
+    // vibe names, posting ranges and per-vibe entry points: enough for every query to start in range
+    bool tables_valid() const {
+        uint64_t n = hdr->nTracks, V = hdr->nVibes;
+        for (uint64_t v=0; v<V; ++v) if ((uint64_t)vibes[v].off + vibes[v].len > hdr->stringsLen) return false;
+        if (postStart[0] != 0 || postStart[V] != n) return false;
+        for (uint64_t v=0; v<V; ++v) if (postStart[v] > postStart[v+1]) return false;
+        if (!(hdr->flags & CATALOG_FEATURES)) return true;
+        if (index.upperStart[0] != 0 || index.upperStart[n] > hdr->upperLen) return false;
+        for (uint64_t v=0; v<V; ++v)
+            if (entry[2*v] != HnswView::kNoNode && (entry[2*v] >= n || entry[2*v+1] > index.level[entry[2*v]])) return false;
+        return true;
+    }
+    bool contents_valid() const {
+        uint64_t n = hdr->nTracks, V = hdr->nVibes;
+        auto in_blob = [&](StrSpan s) { return (uint64_t)s.off + s.len <= hdr->stringsLen; };
+        for (uint64_t a=0; a<hdr->nArtists; ++a) if (!in_blob(artists[a])) return false;
+        for (uint64_t t=0; t<n; ++t)
+            if (!in_blob(tracks[t].title) || tracks[t].artist >= hdr->nArtists || tracks[t].vibe >= V) return false;
+        for (uint64_t p=0; p<n; ++p) if (postings[p] >= n) return false;
+        if (!(hdr->flags & CATALOG_FEATURES)) return true;
+        // every node's upper block holds exactly its levels, and a link at level l reaches a node that has level l
+        const HnswView &g = index;
+        for (uint64_t p=0; p<n; ++p) if ((uint64_t)g.upperStart[p] + (uint64_t)g.level[p] * g.M != g.upperStart[p+1]) return false;
+        for (uint64_t p=0; p<n; ++p)
+            for (int l=0; l<=g.level[p]; ++l) {
+                const uint32_t *nb = g.links(p, l);
+                for (int i=0; i<g.cap(l); ++i) if (nb[i] != HnswView::kNoNode && (nb[i] >= n || g.level[nb[i]] < l)) return false;
+            }
+        return true;
+    }
+};
+
+// Serializes songs into the catalog layout above (the offline step; see --build-catalog).
+// withFeatures stores Song::feat and builds the per-vibe HNSW graphs.
+vector<char> build_catalog(const vector<Song> &songs, bool withFeatures) {
+    string blob;
+    auto put_str = [&](const string &x) { StrSpan sp{ (uint32_t)blob.size(), (uint32_t)x.size() }; blob += x; return sp; };
+    vector<StrSpan> artistSpans, vibeSpans;
+    unordered_map<string,uint32_t> artistId, vibeId;
+    auto intern = [&](unordered_map<string,uint32_t> &ids, vector<StrSpan> &spans, const string &x) {
+        auto [it, fresh] = ids.emplace(x, (uint32_t)spans.size());
+        if (fresh) spans.push_back(put_str(x));
+        return it->second;
+    };
+    vector<CatalogTrack> tracks;
+    for (auto &sg: songs) {
+        StrSpan t = put_str(sg.title);
+        uint32_t a = intern(artistId, artistSpans, sg.artist);
+        tracks.push_back({ t, a, intern(vibeId, vibeSpans, sg.vibe) });
+    }
+    uint32_t V = vibeSpans.size(), n = tracks.size();
+    vector<uint32_t> postStart(V+1, 0), postings(n);
+    for (auto &t: tracks) postStart[t.vibe+1]++;
+    for (uint32_t v=0; v<V; ++v) postStart[v+1] += postStart[v];
+    vector<uint32_t> fill(postStart.begin(), postStart.end()-1);
+    for (uint32_t i=0; i<n; ++i) postings[fill[tracks[i].vibe]++] = i;
+
+    vector<float> features;
+    vector<uint32_t> entry(2*V, HnswView::kNoNode);
+    unique_ptr<HnswBuilder> hnsw;
+    if (withFeatures) {
+        for (auto &sg: songs) features.insert(features.end(), sg.feat.begin(), sg.feat.end());
+        hnsw = make_unique<HnswBuilder>(features.data(), postings.data(), n);
+        worker_pool().parallel_for(V, [&](int v) { tie(entry[2*v], entry[2*v+1]) = hnsw->build(postStart[v], postStart[v+1]); }); // vibes share no nodes
+    }
+
+    CatalogHeader h{};
+    h.magic = SongCatalog::kMagic; h.version = SongCatalog::kVersion;
+    h.nTracks = n; h.nArtists = artistSpans.size(); h.nVibes = V;
+    uint64_t off = sizeof h;
+    auto section = [&](uint64_t bytes) { uint64_t at = (off + 7) & ~7ull; off = at + bytes; return at; };
+    h.tracksOff = section(tracks.size() * sizeof(CatalogTrack));
+    h.artistsOff = section(artistSpans.size() * sizeof(StrSpan));
+    h.vibesOff = section(vibeSpans.size() * sizeof(StrSpan));
+    h.postStartOff = section(postStart.size() * 4);
+    h.postingsOff = section(postings.size() * 4);
+    h.stringsOff = section(blob.size()); h.stringsLen = blob.size();
+    if (hnsw) {
+        h.flags = CATALOG_FEATURES; h.hnswM = hnsw->g.M; h.hnswM0 = hnsw->g.M0;
+        h.featuresOff = section(features.size() * 4);
+        h.levelOff = section(n);
+        h.level0Off = section(hnsw->level0.size() * 4);
+        h.upperStartOff = section(hnsw->upperStart.size() * 4);
+        h.upperOff = section(hnsw->upper.size() * 4); h.upperLen = hnsw->upper.size();
+        h.entryOff = section(entry.size() * 4);
+    }
+    vector<char> out(off, 0);
+    auto put = [&](uint64_t at, const void *src, size_t bytes) { if (bytes) memcpy(out.data() + at, src, bytes); };
+    put(0, &h, sizeof h);
+    put(h.tracksOff, tracks.data(), tracks.size() * sizeof(CatalogTrack));
+    put(h.artistsOff, artistSpans.data(), artistSpans.size() * sizeof(StrSpan));
+    put(h.vibesOff, vibeSpans.data(), vibeSpans.size() * sizeof(StrSpan));
+    put(h.postStartOff, postStart.data(), postStart.size() * 4);
+    put(h.postingsOff, postings.data(), postings.size() * 4);
+    put(h.stringsOff, blob.data(), blob.size());
+    if (hnsw) {
+        put(h.featuresOff, features.data(), features.size() * 4);
+        put(h.levelOff, hnsw->level.data(), n);
+        put(h.level0Off, hnsw->level0.data(), hnsw->level0.size() * 4);
+        put(h.upperStartOff, hnsw->upperStart.data(), hnsw->upperStart.size() * 4);
+        put(h.upperOff, hnsw->upper.data(), hnsw->upper.size() * 4);
+        put(h.entryOff, entry.data(), entry.size() * 4);
+    }
+    return out;
+}
+// --build-catalog IN OUT: IN has one "title<TAB>artist<TAB>vibe" per line ('#' starts a comment),
+// optionally followed by tempo, energy, valence and acousticness columns (each 0..1). Features
+// and the index are stored only when every track has them.
+int build_catalog_file(const string &in, const string &out) {
+    ifstream f(in);
+    if (!f) { cerr << "cannot open " << in << "\n"; return 1; }
+    vector<Song> songs;
+    bool withFeatures = true;
+    string line;
+    while (getline(f, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        vector<string> col;
+        for (size_t a = 0, b; ; a = b+1) {
+            b = line.find('\t', a);
+            col.push_back(line.substr(a, b == string::npos ? b : b-a));
+            if (b == string::npos) break;
+        }
+        if (col.size() < 3) { cerr << in << ": skipping malformed line: " << line << "\n"; continue; }
+        Song sg{ col[0], col[1], col[2] };
+        withFeatures &= col.size() >= 3 + kSongFeatures;
+        for (int i=0; i<kSongFeatures && 3+i < (int)col.size(); ++i) sg.feat[i] = strtof(col[3+i].c_str(), nullptr);
+        songs.push_back(move(sg));
+    }
+    auto t0 = clk::now();
+    vector<char> buf = build_catalog(songs, withFeatures && !songs.empty());
+    ofstream o(out, ios::binary);
+    o.write(buf.data(), buf.size());
+    if (!o) { cerr << "cannot write " << out << "\n"; return 1; }
+    cout << "Wrote " << songs.size() << " tracks to " << out << " (" << buf.size() << " bytes"
+         << (withFeatures ? ", with HNSW index" : ", no features") << ", " << fixed << setprecision(0) << ms(clk::now() - t0).count() << " ms)\n";
+    return 0;
+}
+
+// --verify-catalog FILE: the full content check that --catalog skips for startup speed; run it on
+// catalogs that were not built locally before serving them.
+int verify_catalog_file(const string &path) {
+    SongCatalog cat;
+    string err;
+    auto t0 = clk::now();
+    if (!cat.open(path, err)) { cerr << err << "\n"; return 1; }
+    if (!cat.verify(err)) { cerr << path << ": " << err << "\n"; return 1; }
+    cout << path << ": " << cat.size() << " tracks, " << cat.vibe_count() << " vibes" << (cat.has_index() ? ", with HNSW index" : "")
+         << ", OK (" << fixed << setprecision(0) << ms(clk::now() - t0).count() << " ms)\n";
+    return 0;
+}
+
+// --catalog opens a file into g_catalog; otherwise the first use loads the built-in library
+SongCatalog g_catalog;
+SongCatalog& song_catalog() {
+    static once_flag once;
+    call_once(once, [] { string err; if (!g_catalog.hdr) g_catalog.adopt(build_catalog(song_library, true), err); });
+    return g_catalog;
+}
+
+// Samples up to k distinct tracks uniformly from the union of the posting lists of the vibes that
+// suit the mood: Floyd's algorithm over the concatenated lists, so O(k + vibes) per request
+// regardless of catalog size. Used when the catalog carries no features.
+vector<Song> recommend_by_mood(Mood m, int k, Rng &rng) {
+    TRACE_SCOPE("music.recommend_by_mood");
+    const SongCatalog &cat = song_catalog();
+    vector<int> vs;
+    for (int v=0; v<cat.vibe_count(); ++v) if (vibe_suits(m, cat.vibe_name(v))) vs.push_back(v);
+    uint32_t total = 0;
+    for (int v: vs) total += cat.posting_size(v);
+    vector<Song> res;
+    if (total == 0) {
+        for (int i=0;i<k && i<cat.size();++i) res.push_back(cat.song(i));
+        return res;
+    }
+    int want = min<uint32_t>(k, total);
+    vector<uint32_t> picks;
+    for (uint32_t j = total - want; j < total; ++j) {
+        uint32_t t = rng.bounded(j + 1);
+        picks.push_back(find(picks.begin(), picks.end(), t) == picks.end() ? t : j);
+    }
+    shuffle_vec(picks, rng);
+    for (uint32_t p: picks) {
+        size_t i = 0;
+        while (p >= cat.posting_size(vs[i])) p -= cat.posting_size(vs[i++]);
+        res.push_back(cat.song(cat.posting_begin(vs[i])[p]));
+    }
+    return res;
+}
+// Ranks by feature distance to the typing-derived target (mood_target), vibes filtered by mood;
+// falls back to recommend_by_mood when the catalog has no index or no track passes the filter.
+vector<Song> recommend_for(const SongFeatures &target, Mood m, int k, Rng &rng) {
+    TRACE_SCOPE("music.recommend");
+    const SongCatalog &cat = song_catalog();
+    if (!cat.has_index()) return recommend_by_mood(m, k, rng);
+    vector<Song> res;
+    for (auto [d, t]: cat.nearest(target, k, [&](string_view v) { return vibe_suits(m, v); })) res.push_back(cat.song(t));
+    return res.empty() ? recommend_by_mood(m, k, rng) : res;
+}
+vector<Song> recommend_for(const TypingSample &ts, Mood m, int k, Rng &rng) { return recommend_for(mood_target(ts), m, k, rng); }
+
+// -------------------- Batch Mood Inference --------------------
+// Headless scoring of recorded key logs (--batch). Each typed line in a log (keys up to Enter) is
+// one sample: its gaps go through the same filter and infer_mood thresholds as the interactive
+// session, and the row carries the mood plus recommendations. Files are mapped and parsed in
+// place, one file per task on the worker pool; rows come out in input order.
+enum BatchFormat { BATCH_CSV, BATCH_JSONL };
+
+string csv_field(string_view v) {
+    if (v.find_first_of(",\"\n\r") == string_view::npos) return string(v);
+    string out = "\"";
+    for (char c: v) { if (c == '"') out += '"'; out += c; }
+    return out + "\"";
+}
+string json_string(string_view v) {
+    string out = "\"";
+    for (unsigned char c: v) {
+        if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+        else if (c < 0x20) { char buf[8]; snprintf(buf, sizeof buf, "\\u%04x", c); out += buf; }
+        else out += (char)c;
+    }
+    return out + "\"";
+}
+
+struct BatchResult {
+    string rows, err;
+    long long keys = 0, samples = 0;
+};
+
+// appends the CSV or JSONL row of one scored sample
+void append_batch_row(string &rows, const string &path, int index, long long keys, const Welford &w, Mood m,
+                      BatchFormat fmt, int recs, Rng &rng) {
+    vector<Song> songs = recommend_for(mood_target(w.mean, w.stddev()), m, recs, rng);
+    char num[96];
+    if (fmt == BATCH_CSV) {
+        snprintf(num, sizeof num, ",%d,%lld,%lld,%.1f,%.1f,", index, keys, w.n, w.mean, w.stddev());
+        rows += csv_field(path); rows += num; rows += mood_name(m);
+        for (int k=0;k<recs;++k) { rows += ','; if (k < (int)songs.size()) rows += csv_field(songs[k].title + " - " + songs[k].artist); }
+    } else {
+        snprintf(num, sizeof num, ",\"sample\":%d,\"keys\":%lld,\"gaps\":%lld,\"mean_ms\":%.1f,\"stddev_ms\":%.1f", index, keys, w.n, w.mean, w.stddev());
+        rows += "{\"file\":" + json_string(path) + num + ",\"mood\":\"" + mood_name(m) + "\",\"recommendations\":[";
+        for (size_t k=0;k<songs.size();++k)
+            rows += (k ? ",{\"title\":" : "{\"title\":") + json_string(songs[k].title) + ",\"artist\":" + json_string(songs[k].artist) + "}";
+        rows += "]}";
+    }
+    rows += '\n';
+}
+Rng batch_rng(int fileIndex) {
+    uint64_t seed = g_seed ^ (STREAM_MUSIC * 0xD1B54A32D192ED03ull) ^ ((uint64_t)fileIndex << 32);
+    return Rng(splitmix64(seed)); // only used when the catalog has no index
+}
+
+// Writes every input's rows to stdout in input order as early as that order allows: the earliest
+// unfinished input writes straight through, later ones hold their rows until it finishes.
+struct BatchOutput {
+    mutex mu;
+    size_t next = 0;
+    vector<string> held, errs;
+    vector<char> finished;
+    explicit BatchOutput(size_t n) : held(n), errs(n), finished(n, 0) {}
+    void write(size_t i, const string &rows) {
+        lock_guard<mutex> lk(mu);
+        if (i == next) cout << rows << flush;
+        else held[i] += rows;
+    }
+    void finish(size_t i, const string &err) {
+        lock_guard<mutex> lk(mu);
+        errs[i] = err; finished[i] = 1;
+        while (next < finished.size() && finished[next]) {
+            if (!errs[next].empty()) cerr << errs[next] << "\n";
+            if (++next < finished.size()) { cout << held[next]; string().swap(held[next]); }
+        }
+        cout.flush();
+    }
+};
+
+BatchResult score_key_log(const string &path, int fileIndex, BatchFormat fmt, int recs) {
+    TRACE_SCOPE("batch.file");
+    BatchResult r;
+    MappedFile in;
+    if (!in.open(path, r.err)) return r;
+    Rng rng = batch_rng(fileIndex);
+    struct Sample { int index; long long keys; Welford w; };
+    vector<Sample> samples;
+    vector<float> X; // feature rows for the model, scored in one batch below
+    int sample = 0, bad = 0;
+    bool ok = for_each_typed_line(in.data, in.data + in.size, [&](const KeyEvent *ev, int n) {
+        r.keys += n;
+        Welford w = gap_stats(ev, n);
+        if (w.n) {
+            samples.push_back({ sample, n, w });
+            if (g_moodModel.loaded) { X.resize(X.size() + kMoodFeatures); extract_features(ev, n, &X[X.size() - kMoodFeatures]); }
+        }
+        ++sample;
+    }, bad);
+    if (!ok) { r.err = path + ":" + to_string(bad) + ": expected '<ms> <key code>'"; return r; }
+    vector<Mood> moods(samples.size());
+    if (g_moodModel.loaded) g_moodModel.classify(X.data(), samples.size(), moods.data());
+    else for (size_t i=0;i<samples.size();++i) moods[i] = infer_mood(samples[i].w.mean, samples[i].w.stddev());
+    for (size_t i=0;i<samples.size();++i) append_batch_row(r.rows, path, samples[i].index, samples[i].keys, samples[i].w, moods[i], fmt, recs, rng);
+    r.samples = samples.size();
+    TRACE_COUNT("batch.samples", r.samples);
+    return r;
+}
+// stdin ("-") is scored a typed line at a time and each row written as soon as its Enter arrives,
+// so a live session or an endless pipe streams instead of being read to the end first
+BatchResult score_key_stream(istream &in, int fileIndex, BatchFormat fmt, int recs, BatchOutput &out) {
+    TRACE_SCOPE("batch.stream");
+    BatchResult r;
+    Rng rng = batch_rng(fileIndex);
+    vector<KeyEvent> line;
+    string text, row;
+    int sample = 0, ln = 0, bad;
+    auto score = [&] {
+        r.keys += line.size();
+        Welford w = gap_stats(line.data(), line.size());
+        if (w.n) {
+            row.clear();
+            append_batch_row(row, "-", sample, line.size(), w, classify_mood(line.data(), line.size(), w), fmt, recs, rng);
+            out.write(fileIndex, row);
+            ++r.samples;
+        }
+        ++sample;
+        line.clear();
+    };
+    while (getline(in, text)) {
+        ++ln;
+        if (!parse_key_log(text.data(), text.data() + text.size(), [&](int64_t ns, int key) { line.push_back({ ns, key }); }, bad)) {
+            r.err = "-:" + to_string(ln) + ": expected '<ms> <key code>'";
+            return r;
+        }
+        if (!line.empty() && (line.back().key == '\n' || line.back().key == '\r')) score();
+    }
+    if (!line.empty()) score();
+    TRACE_COUNT("batch.samples", r.samples);
+    return r;
+}
+
+// --batch [FILE...]: scores every log ("-" or no file: stdin) and writes the rows to stdout, each
+// file's as soon as it and every file before it are done.
+int run_batch(const vector<string> &files, BatchFormat fmt, int recs = 3) {
+    vector<string> inputs = files.empty() ? vector<string>{"-"} : files;
+    song_catalog(); // load once before the workers share it
+    auto t0 = clk::now();
+    if (fmt == BATCH_CSV) {
+        cout << "file,sample,keys,gaps,mean_ms,stddev_ms,mood";
+        for (int i=1;i<=recs;++i) cout << ",rec" << i;
+        cout << "\n" << flush;
+    }
+    BatchOutput out(inputs.size());
+    vector<BatchResult> results(inputs.size());
+    worker_pool().parallel_for(inputs.size(), [&](int i) {
+        BatchResult &r = results[i];
+        if (inputs[i] == "-") r = score_key_stream(cin, i, fmt, recs, out);
+        else { r = score_key_log(inputs[i], i, fmt, recs); out.write(i, r.rows); string().swap(r.rows); }
+        out.finish(i, r.err);
+    });
+    long long keys = 0, samples = 0;
+    int failed = 0;
+    for (auto &r: results) {
+        if (!r.err.empty()) { ++failed; continue; }
+        keys += r.keys; samples += r.samples;
+    }
+    double sec = chrono::duration<double>(clk::now() - t0).count();
+    cerr << inputs.size() - failed << " file(s), " << samples << " samples, " << keys << " keys in "
+         << fixed << setprecision(3) << sec << " s (" << setprecision(2) << keys / max(sec, 1e-9) / 1e6 << " M keys/s)\n";
+    return failed ? 1 : 0;
+}
+
+// -------------------- Small Map + Distance --------------------
+struct Point { string name; double x,y; };
+double dist(const Point &a, const Point &b) {
+    double dx = a.x - b.x, dy = a.y - b.y;
+    return sqrt(dx*dx + dy*dy);
+}
+
+// -------------------- Coordinate Store + Batch Tour Cost --------------------
+// Structure-of-arrays copy of a stop list: x[] and y[] are separate 64-byte aligned arrays so cost
+// kernels stream plain doubles, and the names live in their own (cold) vector.
+template<typename T, size_t Align>
+struct AlignedAllocator {
+    using value_type = T;
+    template<typename U> struct rebind { using other = AlignedAllocator<U, Align>; };
+    AlignedAllocator() = default;
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+    T* allocate(size_t n) {
+        void *p = ::operator new(n * sizeof(T), align_val_t(Align));
+        return static_cast<T*>(p);
+    }
+    void deallocate(T *p, size_t) { ::operator delete(p, align_val_t(Align)); }
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+struct CoordStore {
+    vector<double, AlignedAllocator<double, 64>> x, y;
+    vector<string> names;
+    CoordStore() {}
+    explicit CoordStore(const vector<Point> &p) : x(p.size()), y(p.size()), names(p.size()) {
+        for (size_t i=0;i<p.size();++i) { x[i] = p[i].x; y[i] = p[i].y; names[i] = p[i].name; }
+    }
+    int size() const { return x.size(); }
+    double dist(int a, int b) const {
+        double dx = x[a] - x[b], dy = y[a] - y[b];
+        return sqrt(dx*dx + dy*dy);
+    }
+};
+// packed n x n matrix of pairwise distances, row-major
+vector<double> distance_matrix(const CoordStore &cs) {
+    int n = cs.size();
+    vector<double> D((size_t)n*n);
+    for (int i=0;i<n;++i) for (int j=0;j<n;++j) D[(size_t)i*n+j] = cs.dist(i, j);
+    return D;
+}
+
+// Tour-cost kernels. A batch call prices `count` closed tours of `len` stops each, tour j starting
+// at base + which[j]*stride. Every batch kernel adds edges in tour order, so all of them return
+// exactly the scalar sum; the single-tour tour_cost_avx2 below sums four lanes and can differ from
+// it in the last bits. The widest kernels the CPU supports are picked once at start-up.
+void batch_tour_costs_scalar(const CoordStore &cs, const int *base, size_t stride, const int *which, int count, int len, double *out) {
+    for (int j=0;j<count;++j) {
+        const int *t = base + (size_t)which[j]*stride;
+        double c = 0;
+        for (int i=0;i<len-1;++i) c += cs.dist(t[i], t[i+1]);
+        out[j] = c + cs.dist(t[len-1], t[0]);
+    }
+}
+double tour_cost_scalar(const CoordStore &cs, const int *t, int len) {
+    int zero = 0; double c;
+    batch_tour_costs_scalar(cs, t, 0, &zero, 1, len, &c);
+    return c;
+}
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 (baseline on x86-64): two tours per step, coordinates loaded lane by lane
+void batch_tour_costs_sse2(const CoordStore &cs, const int *base, size_t stride, const int *which, int count, int len, double *out) {
+    const double *X = cs.x.data(), *Y = cs.y.data();
+    int j = 0;
+    for (; j+2<=count; j+=2) {
+        const int *t0 = base + (size_t)which[j]*stride, *t1 = base + (size_t)which[j+1]*stride;
+        __m128d fx = _mm_set_pd(X[t1[0]], X[t0[0]]), fy = _mm_set_pd(Y[t1[0]], Y[t0[0]]);
+        __m128d px = fx, py = fy, acc = _mm_setzero_pd();
+        for (int i=1;i<len;++i) {
+            __m128d cx = _mm_set_pd(X[t1[i]], X[t0[i]]), cy = _mm_set_pd(Y[t1[i]], Y[t0[i]]);
+            __m128d dx = _mm_sub_pd(cx, px), dy = _mm_sub_pd(cy, py);
+            acc = _mm_add_pd(acc, _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy))));
+            px = cx; py = cy;
+        }
+        __m128d dx = _mm_sub_pd(fx, px), dy = _mm_sub_pd(fy, py);
+        acc = _mm_add_pd(acc, _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy))));
+        _mm_storeu_pd(out + j, acc);
+    }
+    batch_tour_costs_scalar(cs, base, stride, which + j, count - j, len, out + j);
+}
+// masked gathers with a zero source: same as the plain forms, without GCC's uninitialised-source warning
+__attribute__((target("avx2"))) inline __m256d gather4_pd(const double *base, __m128i idx) {
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, idx, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+}
+// AVX2: four tours per step; the stop ids at position i of the four tours are packed into one
+// vector (plain loads beat an index gather), then their x and y come in with two gathers
+__attribute__((target("avx2")))
+void batch_tour_costs_avx2(const CoordStore &cs, const int *base, size_t stride, const int *which, int count, int len, double *out) {
+    const double *X = cs.x.data(), *Y = cs.y.data();
+    int j = 0;
+    for (; j+4<=count; j+=4) {
+        const int *t0 = base + (size_t)which[j]*stride, *t1 = base + (size_t)which[j+1]*stride;
+        const int *t2 = base + (size_t)which[j+2]*stride, *t3 = base + (size_t)which[j+3]*stride;
+        __m128i id = _mm_setr_epi32(t0[0], t1[0], t2[0], t3[0]);
+        __m256d fx = gather4_pd(X, id), fy = gather4_pd(Y, id);
+        __m256d px = fx, py = fy, acc = _mm256_setzero_pd();
+        for (int i=1;i<len;++i) {
+            id = _mm_setr_epi32(t0[i], t1[i], t2[i], t3[i]);
+            __m256d cx = gather4_pd(X, id), cy = gather4_pd(Y, id);
+            __m256d dx = _mm256_sub_pd(cx, px), dy = _mm256_sub_pd(cy, py);
+            acc = _mm256_add_pd(acc, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+            px = cx; py = cy;
+        }
+        __m256d dx = _mm256_sub_pd(fx, px), dy = _mm256_sub_pd(fy, py);
+        acc = _mm256_add_pd(acc, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+        _mm256_storeu_pd(out + j, acc);
+    }
+    batch_tour_costs_sse2(cs, base, stride, which + j, count - j, len, out + j);
+}
+// AVX2 single tour: four consecutive edges per step (lane sums are reassociated, unlike the batch kernels)
+__attribute__((target("avx2")))
+double tour_cost_avx2(const CoordStore &cs, const int *t, int len) {
+    const double *X = cs.x.data(), *Y = cs.y.data();
+    __m256d acc = _mm256_setzero_pd();
+    int i = 0;
+    for (; i+4<len; i+=4) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(t + i)), b = _mm_loadu_si128((const __m128i*)(t + i + 1));
+        __m256d dx = _mm256_sub_pd(gather4_pd(X, b), gather4_pd(X, a));
+        __m256d dy = _mm256_sub_pd(gather4_pd(Y, b), gather4_pd(Y, a));
+        acc = _mm256_add_pd(acc, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double c = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i<len; ++i) c += cs.dist(t[i], t[i+1==len ? 0 : i+1]);
+    return c;
+}
+#endif
+struct TourCostKernel {
+    const char *name;
+    void (*batch)(const CoordStore&, const int*, size_t, const int*, int, int, double*);
+    double (*single)(const CoordStore&, const int*, int);
+};
+const TourCostKernel& tour_cost_kernel() {
+    static const TourCostKernel k = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return TourCostKernel{ "avx2", batch_tour_costs_avx2, tour_cost_avx2 };
+        if (__builtin_cpu_supports("sse2")) return TourCostKernel{ "sse2", batch_tour_costs_sse2, tour_cost_scalar };
+#endif
+        return TourCostKernel{ "scalar", batch_tour_costs_scalar, tour_cost_scalar };
+    }();
+    return k;
+}
+void batch_tour_costs(const CoordStore &cs, const int *base, size_t stride, const int *which, int count, int len, double *out) {
+    if (count > 0 && len > 0) tour_cost_kernel().batch(cs, base, stride, which, count, len, out);
+}
+double tour_cost(const CoordStore &cs, const vector<int> &t) {
+    return t.empty() ? 0 : tour_cost_kernel().single(cs, t.data(), t.size());
+}
+
+// -------------------- Spatial Index --------------------
+// k-nearest-neighbour candidate lists from a uniform bucket grid (~2 points per cell). Each query
+// scans rings of cells outward and stops once the next ring cannot beat the current k-th best,
+// so the build is O(n k log k) instead of O(n^2).
+// Uniform bucket grid over 2-D points, about two per cell; points with non-finite coordinates are
+// left out. search() visits cells in rings around the query's cell (queries outside the bounding
+// box start from the nearest border cell) until done(reach) says the answer is settled, where every
+// point not yet visited is at least `reach` away.
+struct PointGrid {
+    int G = 0;
+    double minX = 0, minY = 0, cell = 1;
+    vector<int> start, items; // points of cell c are items[start[c] .. start[c+1])
+    void build(const double *x, const double *y, int n) {
+        double maxX = -numeric_limits<double>::infinity(), maxY = maxX;
+        minX = minY = numeric_limits<double>::infinity();
+        int m = 0;
+        for (int i=0;i<n;++i) {
+            if (!isfinite(x[i]) || !isfinite(y[i])) continue;
+            minX = min(minX, x[i]); maxX = max(maxX, x[i]); minY = min(minY, y[i]); maxY = max(maxY, y[i]); ++m;
+        }
+        G = m ? max(1, (int)sqrt(m / 2.0)) : 0;
+        cell = m ? max(max(maxX-minX, maxY-minY) / G, 1e-9) : 1;
+        // counting sort of points into cells
+        start.assign((size_t)G*G+1, 0); items.resize(m);
+        for (int i=0;i<n;++i) if (isfinite(x[i]) && isfinite(y[i])) start[cell_of(x[i], y[i]) + 1]++;
+        for (size_t c=0;c<(size_t)G*G;++c) start[c+1] += start[c];
+        vector<int> fillPos(start.begin(), start.end()-1);
+        for (int i=0;i<n;++i) if (isfinite(x[i]) && isfinite(y[i])) items[fillPos[cell_of(x[i], y[i])]++] = i;
+    }
+    int coord(double v, double lo) const { return (int)clamp(floor((v-lo)/cell), 0.0, (double)(G-1)); }
+    size_t cell_of(double x, double y) const { return (size_t)coord(y, minY)*G + coord(x, minX); }
+    template<typename Visit, typename Done>
+    void search(double qx, double qy, Visit visit, Done done) const {
+        if (!G) return;
+        int x0 = coord(qx, minX), y0 = coord(qy, minY);
+        auto at = [&](int gx, int gy) {
+            if (gx < 0 || gy < 0 || gx >= G || gy >= G) return;
+            size_t c = (size_t)gy*G + gx;
+            for (int s=start[c]; s<start[c+1]; ++s) visit(items[s]);
+        };
+        for (int r=0; r<G; ++r) {
+            if (r == 0) at(x0, y0);
+            for (int t=-r; t<=r && r>0; ++t) { at(x0+t, y0-r); at(x0+t, y0+r); }
+            for (int t=-r+1; t<r; ++t) { at(x0-r, y0+t); at(x0+r, y0+t); }
+            // anything in ring r+1 is at least r cells away
+            if (done(r*cell)) break;
+        }
+    }
+};
+
+struct NeighborLists {
+    int k = 0;
+    vector<int> nbr; // n*k stop indices, nearest first
+    const int* of(int i) const { return &nbr[(size_t)i*k]; }
+};
+NeighborLists build_neighbor_lists(const CoordStore &p, int k) {
+    NeighborLists nl;
+    int n = p.size();
+    nl.k = max(0, min(k, n-1));
+    if (!nl.k) return nl;
+    nl.nbr.resize((size_t)n*nl.k);
+    PointGrid grid;
+    grid.build(p.x.data(), p.y.data(), n);
+    int chunks = min(n, 64);
+    worker_pool().parallel_for(chunks, [&](int ch) {
+        vector<pair<double,int>> heap; // max-heap on squared distance, at most k entries
+        heap.reserve(nl.k+1);
+        for (int i=(long long)n*ch/chunks; i<(long long)n*(ch+1)/chunks; ++i) {
+            heap.clear();
+            grid.search(p.x[i], p.y[i], [&](int j) {
+                if (j == i) return;
+                double dx = p.x[i]-p.x[j], dy = p.y[i]-p.y[j], d2 = dx*dx + dy*dy;
+                if ((int)heap.size() < nl.k) { heap.push_back({d2, j}); push_heap(heap.begin(), heap.end()); }
+                else if (d2 < heap[0].first) { pop_heap(heap.begin(), heap.end()); heap.back() = {d2, j}; push_heap(heap.begin(), heap.end()); }
+            }, [&](double reach) { return (int)heap.size() == nl.k && heap[0].first <= reach*reach; });
+            sort_heap(heap.begin(), heap.end());
+            for (int j=0;j<nl.k;++j) nl.nbr[(size_t)i*nl.k + j] = heap[j].second;
+        }
+    });
+    return nl;
+}
+// position along a Hilbert curve over a 2^16 x 2^16 grid; sorting by it gives a cheap, local starting tour
+uint64_t hilbert_key(uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = 1u << 15; s; s >>= 1) {
+        uint32_t rx = (x & s) ? 1 : 0, ry = (y & s) ? 1 : 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (!ry) { if (rx) { x = 0xFFFF - x; y = 0xFFFF - y; } swap(x, y); }
+    }
+    return d;
+}
+
+// -------------------- Road Network --------------------
+// Road graph in compressed-sparse-row form, loaded from a text file with one record per line:
+//   v <id> <x> <y>     node coordinates (needed to snap stops onto the network)
+//   e <u> <v> <cost>   undirected road segment, cost >= 0; bare "u v cost" and OSM-style "u,v,cost" CSV also work
+// '#' starts a comment and non-numeric lines (CSV headers) are skipped. Ids are used as dense indices.
+const double kUnreachable = 1e9; // cost given to stop pairs with no road path, so tours stay finite
+struct RoadGraph {
+    int n = 0;
+    vector<int> offset;  // n+1, edges of node v are [offset[v], offset[v+1])
+    vector<int> head;
+    vector<float> weight;
+    vector<double> x, y; // per-node coordinates, empty if the file has none
+    PointGrid grid;      // over x/y, built by index_coords()
+    void index_coords() { grid.build(x.data(), y.data(), x.size()); }
+    int nearest_node(double px, double py) const {
+        int best = -1; double bd = numeric_limits<double>::infinity();
+        grid.search(px, py, [&](int v) {
+            double dx = x[v]-px, dy = y[v]-py, d2 = dx*dx + dy*dy;
+            if (d2 < bd) { bd = d2; best = v; }
+        }, [&](double reach) { return best >= 0 && bd <= reach*reach; });
+        return best;
+    }
+};
+bool load_road_graph(const string &path, RoadGraph &g, string &err) {
+    ifstream in(path, ios::binary);
+    if (!in) { err = "cannot open " + path; return false; }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    struct Edge { int u, v; float w; };
+    vector<Edge> edges;
+    vector<tuple<int,double,double>> coords;
+    int maxId = -1, lineNo = 0;
+    const char *p = text.c_str(), *end = p + text.size();
+    while (p < end) {
+        ++lineNo;
+        const char *eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        while (p < eol && (*p == ' ' || *p == '\t')) ++p;
+        char kind = 'e';
+        if (p < eol && (*p == 'v' || *p == 'e') && p+1 < eol && (p[1] == ' ' || p[1] == '\t')) kind = *p, p += 2;
+        if (p < eol && *p != '#' && (isdigit((unsigned char)*p) || *p == '-' || *p == '+')) {
+            char *q;
+            double f[3]; int got = 0;
+            for (; got < 3; ++got) {
+                while (p < eol && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+                f[got] = strtod(p, &q);
+                if (q == p || q > eol) break;
+                p = q;
+            }
+            // shortest paths (Dijkstra, the hierarchy) are only right with non-negative costs
+            if (got == 3 && kind == 'e' && !(f[2] >= 0 && isfinite(f[2]))) {
+                err = path + ":" + to_string(lineNo) + ": road cost must be a finite non-negative number";
+                return false;
+            }
+            if (got == 3 && f[0] >= 0 && (kind == 'v' || f[1] >= 0)) {
+                if (kind == 'v') coords.emplace_back((int)f[0], f[1], f[2]), maxId = max(maxId, (int)f[0]);
+                else edges.push_back({(int)f[0], (int)f[1], (float)f[2]}), maxId = max({maxId, (int)f[0], (int)f[1]});
+            }
+        }
+        p = eol + 1;
+    }
+    if (maxId < 0) { err = path + ": no nodes or edges"; return false; }
+    g.n = maxId + 1;
+    g.offset.assign(g.n + 1, 0);
+    for (auto &e: edges) { g.offset[e.u+1]++; g.offset[e.v+1]++; }
+    for (int v=0; v<g.n; ++v) g.offset[v+1] += g.offset[v];
+    g.head.resize(g.offset[g.n]); g.weight.resize(g.offset[g.n]);
+    vector<int> fillPos(g.offset.begin(), g.offset.end()-1);
+    for (auto &e: edges) {
+        g.head[fillPos[e.u]] = e.v; g.weight[fillPos[e.u]++] = e.w;
+        g.head[fillPos[e.v]] = e.u; g.weight[fillPos[e.v]++] = e.w;
+    }
+    if (!coords.empty()) {
+        g.x.assign(g.n, numeric_limits<double>::infinity()); g.y.assign(g.n, numeric_limits<double>::infinity());
+        for (auto &[id, cx, cy]: coords) { g.x[id] = cx; g.y[id] = cy; }
+        g.index_coords();
+    }
+    return true;
+}
+// content fingerprint (size + a hash of every byte) used to tell whether a cached preprocessing still
+// matches its graph; an edit that keeps size and mtime (cp -p, coarse timestamps) still changes it.
+// 0 if the file cannot be read.
+uint64_t file_fingerprint(const string &path) {
+    MappedFile f; string err;
+    if (!f.open(path, err)) return 0;
+    uint64_t h = f.size * 0x9E3779B97F4A7C15ull, w;
+    size_t i = 0;
+    for (; i + 8 <= f.size; i += 8) { memcpy(&w, f.data + i, 8); h = (h ^ w) * 0xBF58476D1CE4E5B9ull; h ^= h >> 31; }
+    for (w = 0; i < f.size; ++i) w = w << 8 | (unsigned char)f.data[i];
+    h ^= w;
+    return splitmix64(h);
+}
+
+// Binary-heap Dijkstra from every stop over the full graph, one search per source on the worker
+// pool; each search stops as soon as all stops are settled. Routing uses the contraction hierarchy
+// below; this is its reference, which --bench times it against and checks it with.
+vector<double> road_matrix_dijkstra(const RoadGraph &g, const vector<int> &nodes) {
+    int k = nodes.size();
+    vector<double> M((size_t)k*k, kUnreachable);
+    worker_pool().parallel_for(k, [&](int i) {
+        thread_local vector<float> dist;
+        thread_local vector<int> seen, want;
+        thread_local int stamp = 0;
+        if ((int)dist.size() < g.n) { dist.assign(g.n, 0); seen.assign(g.n, 0); want.assign(g.n, 0); stamp = 0; }
+        ++stamp;
+        int left = 0;
+        for (int t: nodes) if (want[t] != stamp) want[t] = stamp, ++left;
+        priority_queue<pair<float,int>, vector<pair<float,int>>, greater<>> pq;
+        dist[nodes[i]] = 0; seen[nodes[i]] = -stamp; // -stamp: reached, +stamp: settled
+        pq.push({0.f, nodes[i]});
+        while (!pq.empty() && left) {
+            auto [d, v] = pq.top(); pq.pop();
+            if (seen[v] == stamp || d > dist[v]) continue;
+            seen[v] = stamp;
+            if (want[v] == stamp) --left;
+            for (int e=g.offset[v]; e<g.offset[v+1]; ++e) {
+                int u = g.head[e]; float nd = d + g.weight[e];
+                if (seen[u] == stamp) continue;
+                if (seen[u] != -stamp || nd < dist[u]) { dist[u] = nd; seen[u] = -stamp; pq.push({nd, u}); }
+            }
+        }
+        for (int j=0;j<k;++j) if (seen[nodes[j]] == stamp) M[(size_t)i*k+j] = dist[nodes[j]];
+    });
+    return M;
+}
+
+// Contraction hierarchy for the undirected road graph. Nodes are contracted in lazy
+// edge-difference order, adding shortcuts where a bounded witness search finds no path around the
+// node. Afterwards every node keeps only its edges to higher-ranked nodes (the upward graph), and a
+// shortest path is the best meeting point of two upward searches. Stop-to-stop matrices use the
+// bucket many-to-many scheme: one upward search per target fills buckets, one per source reads them.
+struct ContractionHierarchy {
+    int n = 0;
+    vector<int> rank;
+    vector<int> upOffset, upHead;
+    vector<float> upWeight;
+    static const uint32_t kMagic = 0x48435350; // "PSCH"
+    static const uint32_t kVersion = 1;
+
+    void build(const RoadGraph &g) {
+        n = g.n;
+        vector<vector<pair<int,float>>> adj(n);
+        for (int v=0; v<n; ++v)
+            for (int e=g.offset[v]; e<g.offset[v+1]; ++e) {
+                int u = g.head[e];
+                if (u == v) continue;
+                auto it = find_if(adj[v].begin(), adj[v].end(), [&](auto &a){ return a.first == u; });
+                if (it == adj[v].end()) adj[v].push_back({u, g.weight[e]});
+                else it->second = min(it->second, g.weight[e]);
+            }
+        vector<char> contracted(n, 0);
+        vector<int> deleted(n, 0);
+        vector<float> wd(n, numeric_limits<float>::infinity());
+        vector<int> touched;
+        vector<pair<float,int>> heap; // min-heap via greater<>, reused across searches
+        // bounded Dijkstra from src that never enters `skip`; leaves distances in wd (undo via touched)
+        auto witness = [&](int src, int skip, float limit, int maxSettled) {
+            heap.clear();
+            wd[src] = 0; touched.push_back(src); heap.push_back({0.f, src});
+            for (int settled = 0; !heap.empty() && settled < maxSettled; ) {
+                pop_heap(heap.begin(), heap.end(), greater<>());
+                auto [d, v] = heap.back(); heap.pop_back();
+                if (d > wd[v]) continue;
+                if (d > limit) break;
+                ++settled;
+                for (auto [u, w]: adj[v]) {
+                    if (u == skip || contracted[u] || d + w >= wd[u]) continue;
+                    if (wd[u] == numeric_limits<float>::infinity()) touched.push_back(u);
+                    wd[u] = d + w; heap.push_back({d + w, u}); push_heap(heap.begin(), heap.end(), greater<>());
+                }
+            }
+        };
+        auto add_edge = [&](int a, int b, float w) {
+            auto it = find_if(adj[a].begin(), adj[a].end(), [&](auto &e){ return e.first == b; });
+            if (it == adj[a].end()) adj[a].push_back({b, w}); else it->second = min(it->second, w);
+        };
+        // number of shortcuts contracting v needs; with apply=true they are inserted. Estimates use a
+        // tighter witness budget: a missed witness only costs a redundant shortcut, never a wrong path.
+        auto shortcuts = [&](int v, bool apply) {
+            int count = 0;
+            auto &nb = adj[v];
+            float maxOut = 0;
+            for (auto &e: nb) maxOut = max(maxOut, e.second);
+            for (size_t i=0; i<nb.size(); ++i) {
+                auto [u, wu] = nb[i];
+                witness(u, v, wu + maxOut, apply ? 500 : 50);
+                for (size_t j=i+1; j<nb.size(); ++j) {
+                    auto [w, ww] = nb[j];
+                    if (wd[w] <= wu + ww) continue;
+                    ++count;
+                    if (apply) { add_edge(u, w, wu + ww); add_edge(w, u, wu + ww); }
+                }
+                for (int t: touched) wd[t] = numeric_limits<float>::infinity();
+                touched.clear();
+            }
+            return count;
+        };
+        auto priority = [&](int v) { return 2*shortcuts(v, false) - (int)adj[v].size() + deleted[v]; };
+        priority_queue<pair<int,int>, vector<pair<int,int>>, greater<>> order;
+        for (int v=0; v<n; ++v) order.push({priority(v), v});
+        rank.assign(n, 0);
+        for (int r=0; !order.empty(); ) {
+            auto [p, v] = order.top(); order.pop();
+            if (contracted[v]) continue;
+            int now = priority(v);
+            if (!order.empty() && now > order.top().first) { order.push({now, v}); continue; } // lazy update
+            shortcuts(v, true);
+            contracted[v] = 1; rank[v] = r++;
+            for (auto &e: adj[v]) {
+                auto &back = adj[e.first];
+                back.erase(find_if(back.begin(), back.end(), [&](auto &a){ return a.first == v; }));
+                deleted[e.first]++;
+            }
+            // adj[v] now only holds still-uncontracted, i.e. higher-ranked, neighbours: its upward edges
+        }
+        upOffset.assign(n+1, 0);
+        for (int v=0; v<n; ++v) upOffset[v+1] = upOffset[v] + adj[v].size();
+        upHead.resize(upOffset[n]); upWeight.resize(upOffset[n]);
+        for (int v=0; v<n; ++v)
+            for (size_t i=0; i<adj[v].size(); ++i) { upHead[upOffset[v]+i] = adj[v][i].first; upWeight[upOffset[v]+i] = adj[v][i].second; }
+    }
+
+    bool save(const string &path, uint64_t fingerprint) const {
+        ofstream out(path, ios::binary);
+        if (!out) return false;
+        uint32_t hdr[2] = { kMagic, kVersion };
+        int64_t m = upHead.size();
+        out.write((const char*)hdr, sizeof hdr);
+        out.write((const char*)&fingerprint, sizeof fingerprint);
+        out.write((const char*)&n, sizeof n);
+        out.write((const char*)&m, sizeof m);
+        out.write((const char*)rank.data(), sizeof(int)*n);
+        out.write((const char*)upOffset.data(), sizeof(int)*(n+1));
+        out.write((const char*)upHead.data(), sizeof(int)*m);
+        out.write((const char*)upWeight.data(), sizeof(float)*m);
+        return (bool)out;
+    }
+    // reads a hierarchy saved for this graph file (fingerprint) with n nodes; rejects anything truncated,
+    // oversized or inconsistent (ranks not a permutation, edge lists out of order, a link leaving the
+    // graph or going down in rank, a negative cost) and leaves the hierarchy empty so the caller rebuilds
+    bool load(const string &path, uint64_t fingerprint, int nodes) {
+        *this = ContractionHierarchy();
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in) return false;
+        uint64_t fileSize = in.tellg();
+        in.seekg(0);
+        uint32_t hdr[2]; uint64_t fp; int64_t m; int fileN;
+        in.read((char*)hdr, sizeof hdr); in.read((char*)&fp, sizeof fp);
+        if (!in || hdr[0] != kMagic || hdr[1] != kVersion || fp != fingerprint) return false;
+        in.read((char*)&fileN, sizeof fileN); in.read((char*)&m, sizeof m);
+        // rank and upOffset (n and n+1 ints) then m (head, weight) pairs must fill the rest of the
+        // file exactly, which bounds n and m before anything is allocated
+        uint64_t rest = fileSize - (sizeof hdr + sizeof fp + sizeof fileN + sizeof m), nodeBytes = (uint64_t)nodes * 8 + 4;
+        if (!in || fileN != nodes || m < 0 || rest < nodeBytes || (rest - nodeBytes) % 8 || (rest - nodeBytes) / 8 != (uint64_t)m) return false;
+        n = fileN;
+        rank.resize(n); upOffset.resize(n+1); upHead.resize(m); upWeight.resize(m);
+        in.read((char*)rank.data(), sizeof(int)*n);
+        in.read((char*)upOffset.data(), sizeof(int)*(n+1));
+        in.read((char*)upHead.data(), sizeof(int)*m);
+        in.read((char*)upWeight.data(), sizeof(float)*m);
+        if (!in || !valid()) { *this = ContractionHierarchy(); return false; }
+        return true;
+    }
+    bool valid() const {
+        vector<char> used(n, 0);
+        for (int r: rank) { if (r < 0 || r >= n || used[r]) return false; used[r] = 1; }
+        if (upOffset[0] != 0 || upOffset[n] != (int64_t)upHead.size()) return false;
+        for (int v=0; v<n; ++v) {
+            if (upOffset[v] > upOffset[v+1]) return false;
+            for (int e=upOffset[v]; e<upOffset[v+1]; ++e)
+                if (upHead[e] < 0 || upHead[e] >= n || rank[upHead[e]] <= rank[v] || !(upWeight[e] >= 0)) return false;
+        }
+        return true;
+    }
+
+    // Dijkstra over the upward graph from s, calling settle(v, dist) for every node reached.
+    // Scratch is per thread, so concurrent searches on one hierarchy are fine.
+    template<typename F>
+    void upward_search(int s, F settle) const {
+        thread_local vector<float> dist;
+        thread_local vector<int> seen, done;
+        thread_local int stamp = 0;
+        if ((int)dist.size() < n) { dist.assign(n, 0); seen.assign(n, 0); done.assign(n, 0); stamp = 0; }
+        ++stamp;
+        priority_queue<pair<float,int>, vector<pair<float,int>>, greater<>> pq;
+        dist[s] = 0; seen[s] = stamp; pq.push({0.f, s});
+        while (!pq.empty()) {
+            auto [d, v] = pq.top(); pq.pop();
+            if (done[v] == stamp) continue;
+            done[v] = stamp;
+            settle(v, d);
+            for (int e=upOffset[v]; e<upOffset[v+1]; ++e) {
+                int u = upHead[e]; float nd = d + upWeight[e];
+                if (done[u] == stamp || (seen[u] == stamp && nd >= dist[u])) continue;
+                seen[u] = stamp; dist[u] = nd; pq.push({nd, u});
+            }
+        }
+    }
+    vector<double> matrix(const vector<int> &nodes) const {
+        int k = nodes.size();
+        vector<double> M((size_t)k*k, kUnreachable);
+        struct Entry { int target; float d; int next; };
+        vector<Entry> entries;
+        unordered_map<int,int> bucket; // node -> first entry
+        for (int j=0;j<k;++j)
+            upward_search(nodes[j], [&](int v, float d) {
+                auto it = bucket.try_emplace(v, -1).first;
+                entries.push_back({j, d, it->second});
+                it->second = entries.size() - 1;
+            });
+        worker_pool().parallel_for(k, [&](int i) {
+            double *row = &M[(size_t)i*k];
+            upward_search(nodes[i], [&](int v, float d) {
+                auto it = bucket.find(v);
+                if (it == bucket.end()) return;
+                for (int e = it->second; e >= 0; e = entries[e].next)
+                    row[entries[e].target] = min(row[entries[e].target], (double)d + entries[e].d);
+            });
+        });
+        for (int i=0;i<k;++i) M[(size_t)i*k+i] = 0;
+        return M;
+    }
+};
+
+// A road graph plus its hierarchy; the hierarchy is read from <file>.ch when that cache was built
+// from the same file, and rebuilt (and re-cached) otherwise.
+struct RoadNetwork {
+    RoadGraph graph;
+    ContractionHierarchy ch;
+    bool fromCache = false;
+    uint64_t fingerprint = 0; // file_fingerprint of the graph file
+    bool open(const string &path, string &err) {
+        TRACE_SCOPE("roads.open");
+        if (!load_road_graph(path, graph, err)) return false;
+        if (graph.x.empty()) { err = path + ": no node coordinates ('v id x y' lines), cannot place stops"; return false; }
+        fingerprint = file_fingerprint(path);
+        fromCache = ch.load(path + ".ch", fingerprint, graph.n);
+        if (!fromCache) { ch.build(graph); ch.save(path + ".ch", fingerprint); }
+        return true;
+    }
+    // stop-to-stop road costs (row-major, stops.size()^2), each stop snapped to its nearest node
+    vector<double> stop_matrix(const vector<Point> &stops) const {
+        TRACE_SCOPE("roads.stop_matrix");
+        vector<int> nodes;
+        for (auto &s: stops) nodes.push_back(graph.nearest_node(s.x, s.y));
+        return ch.matrix(nodes);
+    }
+};
+
+// -------------------- Genetic Algorithm for Route Optimization --------------------
+// Island model: `islands` independent sub-populations evolve on the worker pool, each with its
+// own RNG stream, and exchange elites every `migrationInterval` generations. Islands never touch
+// each other between migrations, so a run depends only on the seed and the island count.
+// With enable_local_search() the GA becomes memetic: offspring are polished by 2-opt / Or-opt
+// over k-nearest candidate lists before they enter the population.
+enum MigrationTopology { MIGRATE_RING, MIGRATE_ALL, MIGRATE_RANDOM };
+// Parent selection. The tables behind each strategy are rebuilt once per generation:
+//   SEL_ROULETTE   linear scan of the fitness vector, O(pop) per draw (the original scheme)
+//   SEL_PREFIX     prefix sums + binary search, O(log pop) per draw, same draw->parent mapping as roulette
+//   SEL_ALIAS      Walker/Vose alias table, O(1) per draw
+//   SEL_TOURNAMENT best of `tournamentSize` uniform picks, no table at all
+enum SelectionStrategy { SEL_ROULETTE, SEL_PREFIX, SEL_ALIAS, SEL_TOURNAMENT };
+
+// Anytime run control: stop at maxGenerations, at the wall-clock budget, once the best tour has not
+// improved for stallGenerations, or when another thread raises *stop, whichever comes first (0
+// disables a limit). onProgress runs on the calling thread after every generation (after every
+// migration epoch in island mode).
+struct GAProgress { int generation; double bestCost; double elapsedMs; };
+struct RunOptions {
+    int maxGenerations = 300;
+    double budgetMs = 0;
+    int stallGenerations = 0;
+    function<void(const GAProgress&)> onProgress;
+    const atomic<bool> *stop = nullptr;
+};
+const char* selection_name(SelectionStrategy s) {
+    switch (s) {
+        case SEL_ROULETTE: return "roulette";
+        case SEL_PREFIX: return "prefix";
+        case SEL_ALIAS: return "alias";
+        case SEL_TOURNAMENT: return "tournament";
+    }
+    return "unknown";
+}
+
+struct GA {
+    CoordStore coords;
+    int popSize; // individuals per island
+    int geneLen; // number of places to visit
+    double crossoverRate;
+    double mutationRate;
+    int islands;
+    int migrationInterval; // generations between elite exchanges
+    int migrants;          // elites sent per exchange
+    MigrationTopology topology;
+    SelectionStrategy selection = SEL_PREFIX;
+    int tournamentSize = 3;
+    vector<double> D;      // packed geneLen x geneLen distance matrix, built once, shared read-only (empty above kMatrixMaxStops)
+    Rng rng;               // drives migration routing only; islands carry their own streams
+    bool localSearch = false;
+    double localSearchRate = 1.0; // probability an offspring is polished
+    NeighborLists nbrs;
+    static const int kMatrixMaxStops = 512; // ~2 MB; past cache size a matrix lookup is slower than recomputing sqrt
+
+    // 2-opt / Or-opt improvement of one tour in place, restricted to the k-nearest candidate
+    // lists. Only stops sitting on the FIFO (don't-look bits cleared) are examined; a stop is
+    // re-queued whenever one of its tour edges changes.
+    struct LocalSearch {
+        const GA *ga;
+        int n;
+        int *t;                // tour being improved
+        vector<int> pos;       // pos[stop] = index in t
+        vector<int> queue;     // circular FIFO of stops to examine
+        vector<char> queued;
+        int qHead, qSize;
+        vector<int> adjA, adjB; // parents' (pred,succ) per stop, to queue only stops with new edges
+        void init(const GA *g) {
+            ga = g; n = g->geneLen;
+            pos.resize(n); queue.resize(n); queued.assign(n, 0); adjA.resize(2*n); adjB.resize(2*n);
+        }
+        int succ(int v) const { int p = pos[v]+1; return t[p==n ? 0 : p]; }
+        int pred(int v) const { int p = pos[v]; return t[p ? p-1 : n-1]; }
+        void push(int v) { if (!queued[v]) { queued[v] = 1; queue[(qHead+qSize)%n] = v; ++qSize; } }
+        // reverse the forward path x..y, or its complement when shorter; both leave the same cycle
+        void reverse_path(int x, int y) {
+            int i = pos[x], j = pos[y];
+            int len = (j - i + n) % n + 1;
+            if (2*len > n) { i = (j+1) % n; j = (pos[x]-1+n) % n; len = n - len; }
+            for (; len >= 2; len -= 2) {
+                swap(t[i], t[j]); pos[t[i]] = i; pos[t[j]] = j;
+                i = i+1==n ? 0 : i+1; j = j ? j-1 : n-1;
+            }
+        }
+        // drop edges {a,b},{c,d} and add {a,c},{b,d}; b follows a and d follows c in the same direction
+        void move2(int a, int b, int c, int d) {
+            if (b == c || a == d) return;
+            if (succ(a) == b) reverse_path(b, c); else reverse_path(c, b);
+        }
+        bool in_segment(int v, int s1, int len) const { return (pos[v] - pos[s1] + n) % n < len; }
+        bool try_2opt(int a, double &cost) {
+            const int *cand = ga->nbrs.of(a);
+            for (int dir=0; dir<2; ++dir) {
+                int b = dir ? pred(a) : succ(a);
+                double dab = ga->d(a, b);
+                for (int q=0;q<ga->nbrs.k;++q) {
+                    int c = cand[q];
+                    double g1 = dab - ga->d(a, c);
+                    if (g1 <= 1e-12) break; // candidates are sorted, nothing further can pay off
+                    int e = dir ? pred(c) : succ(c);
+                    if (c == b || e == a) continue;
+                    double gain = g1 + ga->d(c, e) - ga->d(b, e);
+                    if (gain > 1e-9) {
+                        move2(a, b, c, e);
+                        cost -= gain;
+                        push(a); push(b); push(c); push(e);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        // move the 1-3 stop segment starting at a between two adjacent stops u,v near it, either way round
+        bool try_oropt(int a, double &cost) {
+            for (int len=1; len<=3 && len+3<=n; ++len) {
+                int s1 = a, s2 = t[(pos[a]+len-1) % n];
+                int p = pred(s1), nx = succ(s2);
+                double g = ga->d(p, s1) + ga->d(s2, nx) - ga->d(p, nx);
+                if (g <= 1e-9) continue;
+                const int *cand = ga->nbrs.of(s1);
+                for (int q=0;q<ga->nbrs.k;++q) {
+                    int c = cand[q];
+                    if (ga->d(s1, c) >= g) break;
+                    if (in_segment(c, s1, len)) continue;
+                    for (int side=0; side<2; ++side) {
+                        int u = side ? c : pred(c), v = side ? succ(c) : c;
+                        if (in_segment(u, s1, len) || in_segment(v, s1, len) || u == nx || v == p) continue;
+                        double duv = ga->d(u, v);
+                        double keep = g + duv - ga->d(u, s1) - ga->d(s2, v); // u s1..s2 v
+                        double flip = g + duv - ga->d(u, s2) - ga->d(s1, v); // u s2..s1 v
+                        if (max(keep, flip) <= 1e-9) continue;
+                        move2(p, s1, u, v);
+                        move2(p, u, nx, s2);
+                        if (keep >= flip) move2(u, s2, s1, v);
+                        cost -= max(keep, flip);
+                        push(p); push(nx); push(s1); push(s2); push(u); push(v);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        void record_adjacency(const int *tour, vector<int> &adj) {
+            for (int i=0;i<n;++i) {
+                adj[2*tour[i]] = tour[i ? i-1 : n-1];
+                adj[2*tour[i]+1] = tour[i+1==n ? 0 : i+1];
+            }
+        }
+        // improves `tour` in place and patches `cost`; with parents given, only stops that gained an
+        // edge neither parent had start out queued
+        void improve(int *tour, double &cost, const int *parentA=nullptr, const int *parentB=nullptr) {
+            t = tour;
+            for (int i=0;i<n;++i) pos[t[i]] = i;
+            qHead = qSize = 0;
+            if (parentA) { record_adjacency(parentA, adjA); record_adjacency(parentB ? parentB : parentA, adjB); }
+            for (int i=0;i<n;++i) {
+                int v = t[i], s = t[i+1==n ? 0 : i+1];
+                auto has = [&](const vector<int> &adj){ return adj[2*v] == s || adj[2*v+1] == s; };
+                if (!parentA || (!has(adjA) && !has(adjB))) { push(v); push(s); }
+            }
+            while (qSize) {
+                int a = queue[qHead]; qHead = qHead+1==n ? 0 : qHead+1; --qSize;
+                queued[a] = 0;
+                if (try_2opt(a, cost) || try_oropt(a, cost)) push(a);
+            }
+        }
+    };
+    struct Island {
+        const GA *ga;
+        int index;
+        Rng rng;
+        // Population arenas: popSize chromosomes of geneLen genes stored back to back.
+        // `pop` is the current generation, offspring are written into `next`, then the two swap,
+        // so evolving reuses the same two blocks and never allocates. (In island mode run() still
+        // makes a few small allocations per migration epoch, dispatching the islands to the pool.)
+        vector<int> pop, next;
+        vector<int> spare;   // landing slot for a second child that does not fit (odd popSize)
+        vector<int> mark;    // crossover scratch: mark[v]==stamp means gene v is already placed (two halves, one per child)
+        int stamp;
+        vector<double> cost, nextCost; // cached tour cost per individual, double-buffered like pop/next
+        double spareCost;
+        vector<double> fitness;
+        vector<int> order;   // migration scratch: individuals ranked by cost
+        double totalFitness;
+        vector<double> prefix;        // SEL_PREFIX: running fitness sums
+        vector<double> aliasProb;     // SEL_ALIAS: acceptance probability per slot
+        vector<int> aliasIdx, small, large; // SEL_ALIAS: fallback per slot + Vose work lists
+        vector<int> best;
+        double bestCost;
+        int gen;
+        int ran = 0;                  // generations the last evolve() call got through
+        LocalSearch ls;
+        vector<int> pending;          // offspring slots whose cost is computed in one batch per generation
+        vector<double> pendingCost;
+        vector<int> traceSucc;        // trace_generation scratch: successor of each stop in `best`
+        void init(const GA *g, int k, Rng stream) {
+            ga = g; index = k; rng = stream;
+            int P = ga->popSize, L = ga->geneLen;
+            pop.resize((size_t)P*L); next.resize((size_t)P*L);
+            spare.resize(L); mark.assign(2*L, 0); stamp = 0;
+            cost.assign(P, 0); nextCost.assign(P, 0); spareCost = 0;
+            fitness.assign(P, 0); order.resize(P); best.resize(L); gen = 0;
+            prefix.resize(P); aliasProb.resize(P); aliasIdx.resize(P); small.resize(P); large.resize(P);
+            pending.reserve(P); pendingCost.resize(P);
+            init_population();
+        }
+        int* chrom(int i) { return &pop[(size_t)i*ga->geneLen]; }
+        int* child(int i) { return i < ga->popSize ? &next[(size_t)i*ga->geneLen] : spare.data(); }
+        double& child_cost(int i) { return i < ga->popSize ? nextCost[i] : spareCost; }
+        // random permutations, or, given a warm tour, that tour plus copies with one random segment
+        // reversed each (close enough to keep its structure, different enough to recombine)
+        void init_population(const int *warm = nullptr) {
+            int L = ga->geneLen;
+            for (int i=0;i<ga->popSize;++i) {
+                int *c = chrom(i);
+                if (warm) {
+                    copy(warm, warm+L, c);
+                    if (i && L > 3) { int a = rng.range(1, L-2), b = rng.range(a+1, L-1); reverse(c+a, c+b+1); }
+                } else {
+                    iota(c, c+L, 0);
+                    for (int k=L-1;k>0;--k) swap(c[k], c[rng.range(0, k)]);
+                }
+                cost[i] = ga->route_cost(c);
+            }
+            copy(chrom(0), chrom(0)+L, best.begin()); bestCost = cost[0];
+        }
+        // costs are kept up to date as offspring are built, so this only maps them to fitness
+        void evaluate() {
+            for (int i=0;i<ga->popSize;++i)
+                fitness[i] = 1.0 / (1.0 + cost[i]); // higher fitness for shorter cost
+        }
+        void prepare_selection() {
+            int P = ga->popSize;
+            totalFitness = 0;
+            for (int i=0;i<P;++i) { totalFitness += fitness[i]; prefix[i] = totalFitness; }
+            if (ga->selection != SEL_ALIAS) return;
+            // Vose: scale weights to mean 1, then pair each under-full slot with an over-full donor
+            int ns = 0, nl = 0;
+            for (int i=0;i<P;++i) {
+                aliasProb[i] = fitness[i] * P / totalFitness;
+                aliasIdx[i] = i;
+                (aliasProb[i] < 1.0 ? small[ns++] : large[nl++]) = i;
+            }
+            while (ns && nl) {
+                int s = small[--ns], l = large[nl-1];
+                aliasIdx[s] = l;
+                aliasProb[l] -= 1.0 - aliasProb[s];
+                if (aliasProb[l] < 1.0) { --nl; small[ns++] = l; }
+            }
+            while (nl) aliasProb[large[--nl]] = 1.0;
+            while (ns) aliasProb[small[--ns]] = 1.0; // only reached through rounding error
+        }
+        int roulette_select() {
+            double r = rng.uniform() * totalFitness;
+            double acc = 0;
+            for (int i=0;i<ga->popSize;++i) {
+                acc += fitness[i];
+                if (acc >= r) return i;
+            }
+            return ga->popSize-1;
+        }
+        int prefix_select() {
+            double r = rng.uniform() * totalFitness;
+            int i = lower_bound(prefix.begin(), prefix.end(), r) - prefix.begin();
+            return min(i, ga->popSize-1);
+        }
+        int alias_select() {
+            int i = rng.bounded(ga->popSize);
+            return rng.uniform() < aliasProb[i] ? i : aliasIdx[i];
+        }
+        int tournament_select() {
+            int bestIdx = rng.bounded(ga->popSize);
+            for (int t=1;t<ga->tournamentSize;++t) {
+                int i = rng.bounded(ga->popSize);
+                if (fitness[i] > fitness[bestIdx]) bestIdx = i;
+            }
+            return bestIdx;
+        }
+        int select() {
+            switch (ga->selection) {
+                case SEL_ROULETTE: return roulette_select();
+                case SEL_PREFIX: return prefix_select();
+                case SEL_ALIAS: return alias_select();
+                case SEL_TOURNAMENT: return tournament_select();
+            }
+            return 0;
+        }
+        void ordered_crossover(const int *a, const int *b, int *c1, int *c2) {
+            int n = ga->geneLen;
+            int l = rng.range(0, n-1), r = rng.range(0, n-1);
+            if (l > r) swap(l,r);
+            if (++stamp == INT_MAX) { fill(mark.begin(), mark.end(), 0); stamp = 1; }
+            int *used1 = mark.data(), *used2 = mark.data() + n;
+            // copy slice
+            for (int i=l;i<=r;++i) {
+                c1[i] = a[i]; used1[a[i]] = stamp;
+                c2[i] = b[i]; used2[b[i]] = stamp;
+            }
+            // fill remaining preserving order
+            int idx1 = (r+1)%n;
+            for (int i=0;i<n;++i) {
+                int v = b[(r+1+i)%n];
+                if (used1[v] != stamp) { c1[idx1]=v; used1[v]=stamp; idx1=(idx1+1)%n; }
+            }
+            int idx2 = (r+1)%n;
+            for (int i=0;i<n;++i) {
+                int v = a[(r+1+i)%n];
+                if (used2[v] != stamp) { c2[idx2]=v; used2[v]=stamp; idx2=(idx2+1)%n; }
+            }
+        }
+        // sum of the (distinct) tour edges starting at positions e[0..m)
+        double edges_cost(const int *chrom, const int *e, int m) {
+            int L = ga->geneLen;
+            double c = 0;
+            for (int k=0;k<m;++k) c += ga->d(chrom[e[k]], chrom[e[k]+1==L ? 0 : e[k]+1]);
+            return c;
+        }
+        // swap two genes and patch the cached cost with the O(1) delta of the (at most four) touched
+        // edges; a NaN cost marks a child that is still waiting for its batch evaluation.
+        // Returns whether the chromosome changed.
+        bool mutate(int *chrom, double &c) {
+            if (rng.uniform() > ga->mutationRate) return false;
+            int L = ga->geneLen;
+            int i = rng.range(0, L-1), j = rng.range(0, L-1);
+            if (i == j) return false;
+            if (std::isnan(c)) { swap(chrom[i], chrom[j]); return true; }
+            int cand[4] = { i ? i-1 : L-1, i, j ? j-1 : L-1, j };
+            int e[4], m = 0;
+            for (int v: cand) if (find(e, e+m, v) == e+m) e[m++] = v;
+            double before = edges_cost(chrom, e, m);
+            swap(chrom[i], chrom[j]);
+            c += edges_cost(chrom, e, m) - before;
+            return true;
+        }
+        // records the generation just finished (only called while tracing): cost spread, and how far
+        // the island has converged as the share of edges individuals do not share with its best tour
+        void trace_generation(int selections, int crossovers, int mutations) {
+            int P = ga->popSize, L = ga->geneLen;
+            traceSucc.resize(L);
+            for (int i=0;i<L;++i) traceSucc[best[i]] = best[i+1==L ? 0 : i+1];
+            double sum = 0;
+            long long foreign = 0;
+            for (int i=0;i<P;++i) {
+                sum += cost[i];
+                const int *c = chrom(i);
+                for (int j=0;j<L;++j) {
+                    int a = c[j], b = c[j+1==L ? 0 : j+1];
+                    foreign += traceSucc[a] != b && traceSucc[b] != a;
+                }
+            }
+            g_trace.local().ga.push_back({ ga->traceRun, index, gen + 1, g_trace.now_ns(), bestCost, sum / P,
+                                           (double)foreign / ((double)P * L), selections, crossovers, mutations });
+        }
+        // runs up to `generations` generations, fewer once the deadline passes; returns how many ran
+        int evolve(int generations, steady::time_point deadline = steady::time_point::max()) {
+            int P = ga->popSize, L = ga->geneLen;
+            evaluate();
+            int g = 0;
+            for (; g<generations && steady::now() < deadline; ++g, ++gen) {
+                TRACE_SCOPE("ga.generation");
+                int crossovers = 0, mutations = 0;
+                // elitism: keep best
+                int eliteIdx = 0;
+                double bestF = fitness[0];
+                for (int i=1;i<P;++i) if (fitness[i] > bestF) { bestF = fitness[i]; eliteIdx = i; }
+                copy(chrom(eliteIdx), chrom(eliteIdx)+L, child(0));
+                child_cost(0) = cost[eliteIdx];
+                prepare_selection();
+                pending.clear();
+                for (int k=1; k<P; k+=2) {
+                    int p1 = select();
+                    int p2 = select();
+                    int *c1 = child(k), *c2 = child(k+1);
+                    double &k1 = child_cost(k), &k2 = child_cost(k+1);
+                    if (rng.uniform() < ga->crossoverRate) {
+                        ordered_crossover(chrom(p1), chrom(p2), c1, c2);
+                        ++crossovers;
+                        k1 = k2 = numeric_limits<double>::quiet_NaN();
+                        pending.push_back(k);
+                        if (k+1 < P) pending.push_back(k+1);
+                    } else {
+                        copy(chrom(p1), chrom(p1)+L, c1); k1 = cost[p1];
+                        copy(chrom(p2), chrom(p2)+L, c2); k2 = cost[p2];
+                    }
+                    mutations += mutate(c1, k1) + mutate(c2, k2);
+                    if (ga->localSearch) {
+                        if (rng.uniform() < ga->localSearchRate) ls.improve(c1, k1, chrom(p1), chrom(p2));
+                        if (k+1 < P && rng.uniform() < ga->localSearchRate) ls.improve(c2, k2, chrom(p2), chrom(p1));
+                    }
+                }
+                ga->batch_costs(next.data(), pending.data(), pending.size(), pendingCost.data());
+                for (size_t q=0;q<pending.size();++q) nextCost[pending[q]] = pendingCost[q];
+                pop.swap(next); cost.swap(nextCost);
+                evaluate();
+                // update best
+                for (int i=0;i<P;++i) {
+                    if (cost[i] < bestCost) { bestCost = cost[i]; copy(chrom(i), chrom(i)+L, best.begin()); }
+                }
+                if (TRACE_ON()) trace_generation(P / 2 * 2, crossovers, mutations);
+            }
+            return g;
+        }
+        // ranks individuals by cost into `order` (best first); only the first/last m need to be exact
+        void rank(int m) {
+            iota(order.begin(), order.end(), 0);
+            auto byCost = [&](int a, int b){ return cost[a] < cost[b] || (cost[a] == cost[b] && a < b); };
+            partial_sort(order.begin(), order.begin()+m, order.end(), byCost);
+            nth_element(order.begin()+m, order.end()-m, order.end(), byCost);
+        }
+    };
+    vector<Island> isl;
+    vector<int> emigrants; // migration buffer: migrants chromosomes per island
+    vector<double> emigrantCost;
+    int traceRun;          // numbers this GA's rows in the --trace output
+
+    GA(const vector<Point>&p, int pop=120, double cr=0.8, double mr=0.12,
+       int islandCount=1, int migrateEvery=25, MigrationTopology topo=MIGRATE_RING, uint64_t seed=0) {
+        coords = CoordStore(p); popSize = pop; geneLen = p.size(); crossoverRate=cr; mutationRate=mr;
+        islands = max(1, islandCount); migrationInterval = max(1, migrateEvery); topology = topo;
+        migrants = max(1, min(popSize/10, 4));
+        if (geneLen <= kMatrixMaxStops) D = distance_matrix(coords);
+        rng = seed ? Rng(seed) : rng_stream(STREAM_GA);
+        traceRun = g_trace.gaRuns++;
+        isl.resize(islands);
+        for (int k=0;k<islands;++k) isl[k].init(this, k, rng.split());
+        emigrants.resize((size_t)islands*migrants*geneLen); emigrantCost.resize((size_t)islands*migrants);
+    }
+    double d(int a, int b) const { return D.empty() ? coords.dist(a, b) : D[(size_t)a*geneLen+b]; }
+    // Prices tours with an external symmetric cost matrix (e.g. road travel costs) instead of
+    // straight-line distance; cached costs and bests are recomputed. Coordinates still seed the
+    // memetic candidate lists, so call this before enable_local_search.
+    void set_cost_matrix(vector<double> M) {
+        D = move(M);
+        for (auto &I: isl) {
+            I.bestCost = numeric_limits<double>::infinity();
+            for (int i=0;i<popSize;++i) {
+                I.cost[i] = route_cost(I.chrom(i));
+                if (I.cost[i] < I.bestCost) { I.bestCost = I.cost[i]; copy(I.chrom(i), I.chrom(i)+geneLen, I.best.begin()); }
+            }
+        }
+    }
+    // Switches on the memetic stage: builds the k-nearest candidate lists, reseeds every island with
+    // Hilbert-curve tours (over randomly shifted grids, for diversity) and polishes them. Past the
+    // deadline the remaining seeds are left unpolished so the set-up stays within a latency budget.
+    void enable_local_search(int k=8, double rate=1.0, steady::time_point deadline = steady::time_point::max()) {
+        TRACE_SCOPE("ga.local_search_seed");
+        if (geneLen < 5) return; // too few stops for 2-opt/Or-opt moves; the islands' LocalSearch stays unset
+        localSearch = true; localSearchRate = rate;
+        nbrs = build_neighbor_lists(coords, k);
+        double minX = *min_element(coords.x.begin(), coords.x.end()), maxX = *max_element(coords.x.begin(), coords.x.end());
+        double minY = *min_element(coords.y.begin(), coords.y.end()), maxY = *max_element(coords.y.begin(), coords.y.end());
+        double span = max(max(maxX-minX, maxY-minY), 1e-9);
+        worker_pool().parallel_for(islands, [&](int k) {
+            Island &I = isl[k];
+            I.ls.init(this);
+            vector<pair<uint64_t,int>> keyed(geneLen);
+            for (int i=0;i<popSize;++i) {
+                double ox = i ? I.rng.uniform()*span : 0, oy = i ? I.rng.uniform()*span : 0;
+                for (int s=0;s<geneLen;++s) {
+                    double fx = fmod(coords.x[s] - minX + ox, span*1.0000001) / span;
+                    double fy = fmod(coords.y[s] - minY + oy, span*1.0000001) / span;
+                    keyed[s] = { hilbert_key((uint32_t)(fx*65535), (uint32_t)(fy*65535)), s };
+                }
+                sort(keyed.begin(), keyed.end());
+                int *c = I.chrom(i);
+                for (int s=0;s<geneLen;++s) c[s] = keyed[s].second;
+                I.cost[i] = route_cost(c);
+                if (i == 0 || steady::now() < deadline) I.ls.improve(c, I.cost[i]);
+            }
+            I.bestCost = numeric_limits<double>::infinity();
+            for (int i=0;i<popSize;++i) if (I.cost[i] < I.bestCost) { I.bestCost = I.cost[i]; copy(I.chrom(i), I.chrom(i)+geneLen, I.best.begin()); }
+        });
+    }
+    // Restarts every island from `tour` (see Island::init_population), e.g. a cached route adapted to
+    // a slightly different stop set. Call after enable_local_search() so the seeds get polished too.
+    void seed_population(const vector<int> &tour) {
+        worker_pool().parallel_for(islands, [&](int k) {
+            Island &I = isl[k];
+            I.init_population(tour.data());
+            for (int i=0; localSearch && i<popSize; ++i) I.ls.improve(I.chrom(i), I.cost[i]);
+            I.bestCost = numeric_limits<double>::infinity();
+            for (int i=0;i<popSize;++i) if (I.cost[i] < I.bestCost) { I.bestCost = I.cost[i]; copy(I.chrom(i), I.chrom(i)+geneLen, I.best.begin()); }
+        });
+    }
+    // prices tours base + which[j]*geneLen: walks the matrix while it is cache resident, otherwise
+    // hands the batch to the SIMD kernel over the coordinate arrays
+    void batch_costs(const int *base, const int *which, int count, double *out) const {
+        if (D.empty()) { batch_tour_costs(coords, base, geneLen, which, count, geneLen, out); return; }
+        for (int j=0;j<count;++j) {
+            const int *chrom = base + (size_t)which[j]*geneLen;
+            double c = 0;
+            for (int i=0;i<geneLen-1;++i) c += d(chrom[i], chrom[i+1]);
+            out[j] = c + d(chrom[geneLen-1], chrom[0]);
+        }
+    }
+    double route_cost(const int *chrom) const {
+        // route starts at 0 (home), visits all indices in chrom order, and returns to home
+        int zero = 0; double c;
+        batch_costs(chrom, &zero, 1, &c);
+        return c;
+    }
+    // copy each island's elites aside first, then overwrite the receivers' worst individuals,
+    // so the outcome does not depend on the order islands are visited in
+    void migrate() {
+        int m = min(migrants, popSize/2);
+        if (islands < 2 || m < 1) return;
+        for (int k=0;k<islands;++k) {
+            Island &I = isl[k];
+            I.rank(m);
+            for (int j=0;j<m;++j) {
+                copy(I.chrom(I.order[j]), I.chrom(I.order[j])+geneLen, &emigrants[((size_t)k*migrants+j)*geneLen]);
+                emigrantCost[(size_t)k*migrants+j] = I.cost[I.order[j]];
+            }
+        }
+        auto receive = [&](int from, int to, int slot, int j) {
+            Island &I = isl[to];
+            int victim = I.order[popSize-1-slot];
+            const int *src = &emigrants[((size_t)from*migrants+j)*geneLen];
+            copy(src, src+geneLen, I.chrom(victim));
+            I.cost[victim] = emigrantCost[(size_t)from*migrants+j];
+        };
+        for (int k=0;k<islands;++k) {
+            if (topology == MIGRATE_RING) {
+                for (int j=0;j<m;++j) receive(k, (k+1)%islands, j, j);
+            } else if (topology == MIGRATE_RANDOM) {
+                int to = rng.range(0, islands-2); if (to >= k) ++to;
+                for (int j=0;j<m;++j) receive(k, to, j, j);
+            } else {
+                // fully connected: every island takes the single best of each other island,
+                // spread over its m worst slots (later senders overwrite earlier ones when islands > m+1)
+                for (int to=0; to<islands; ++to) if (to != k) receive(k, to, (k < to ? k : k-1) % m, 0);
+            }
+        }
+    }
+    int best_island() const {
+        int bi = 0;
+        for (int k=1;k<islands;++k) if (isl[k].bestCost < isl[bi].bestCost) bi = k;
+        return bi;
+    }
+    vector<int> run(int generations=300) {
+        RunOptions opt;
+        opt.maxGenerations = generations;
+        return run(opt);
+    }
+    vector<int> run(const RunOptions &opt) {
+        TRACE_SCOPE("ga.run");
+        auto t0 = steady::now();
+        auto deadline = opt.budgetMs > 0 ? t0 + chrono::duration_cast<steady::duration>(ms(opt.budgetMs)) : steady::time_point::max();
+        double bestCost = isl[best_island()].bestCost;
+        int lastImprovement = 0;
+        for (int g=0; g<opt.maxGenerations; ) {
+            // one pool dispatch per epoch (not per generation); a single island runs inline
+            int span = islands > 1 ? min(migrationInterval, opt.maxGenerations-g) : 1;
+            worker_pool().parallel_for(islands, [&](int k){ isl[k].ran = isl[k].evolve(span, deadline); });
+            int ran = 0; // a deadline can cut the epoch short; count what the furthest island got through
+            for (auto &I: isl) ran = max(ran, I.ran);
+            g += ran;
+            if (islands > 1) { TRACE_SCOPE("ga.migrate"); migrate(); }
+            double c = isl[best_island()].bestCost;
+            if (c < bestCost) { bestCost = c; lastImprovement = g; }
+            if (opt.onProgress) opt.onProgress({g, bestCost, ms(steady::now() - t0).count()});
+            if (steady::now() >= deadline) break;
+            if (opt.stallGenerations > 0 && g - lastImprovement >= opt.stallGenerations) break;
+            if (opt.stop && opt.stop->load(memory_order_relaxed)) break;
+        }
+        return isl[best_island()].best;
+    }
+};
+
+// -------------------- Exact Solver + Route Dispatcher --------------------
+// Held-Karp bitmask DP with Home (stop 0) as the fixed start: dp[mask][j] is the cheapest path
+// from Home through exactly the stops in `mask`, ending at j. O(2^(n-1) (n-1)^2) time and
+// O(2^(n-1) (n-1)) memory, so it is practical up to ~20 stops.
+const int kHeldKarpMaxStops = 20;
+vector<int> held_karp(const vector<double> &D, int n) {
+    vector<int> tour(n);
+    iota(tour.begin(), tour.end(), 0);
+    if (n <= 3) return tour; // every cycle through <= 3 stops has the same cost
+    int m = n - 1;
+    size_t full = ((size_t)1 << m) - 1;
+    vector<double> dp((full+1)*m, numeric_limits<double>::infinity());
+    vector<uint8_t> parent((full+1)*m, 0);
+    auto w = [&](int a, int b){ return D[(size_t)a*n+b]; };
+    for (int j=0;j<m;++j) dp[((size_t)1<<j)*m + j] = w(0, j+1);
+    // supersets always have larger masks, so one increasing sweep settles every state before it is read
+    for (size_t mask=1; mask<=full; ++mask) {
+        for (int j=0;j<m;++j) {
+            if (!(mask >> j & 1)) continue;
+            double base = dp[mask*m + j];
+            if (base == numeric_limits<double>::infinity()) continue;
+            for (int k=0;k<m;++k) {
+                if (mask >> k & 1) continue;
+                size_t s = (mask | (size_t)1 << k)*m + k;
+                double v = base + w(j+1, k+1);
+                if (v < dp[s]) { dp[s] = v; parent[s] = (uint8_t)j; }
+            }
+        }
+    }
+    int last = 0;
+    for (int j=1;j<m;++j) if (dp[full*m+j] + w(j+1,0) < dp[full*m+last] + w(last+1,0)) last = j;
+    size_t mask = full;
+    for (int pos=n-1; pos>=1; --pos) {
+        tour[pos] = last + 1;
+        int prev = parent[mask*m + last];
+        mask &= ~((size_t)1 << last);
+        last = prev;
+    }
+    return tour;
+}
+
+enum RouteSolver { SOLVER_EXACT, SOLVER_GA, SOLVER_GA_LOCAL, SOLVER_CACHED };
+const char* solver_name(RouteSolver s) {
+    switch (s) {
+        case SOLVER_EXACT: return "exact (Held-Karp)";
+        case SOLVER_GA: return "genetic algorithm";
+        case SOLVER_GA_LOCAL: return "memetic GA (2-opt + Or-opt)";
+        case SOLVER_CACHED: return "route cache";
+    }
+    return "unknown";
+}
+struct RoutePlan {
+    vector<int> tour; // indices into the stop list, rotated so Home (0) comes first
+    double cost;
+    RouteSolver solver;
+    double elapsedMs;
+    int generations;  // GA generations actually run (0 for the exact solver)
+    bool warmStarted = false; // GA seeded from a known tour rather than random permutations
+};
+// Picks the solver from the stop count and a time budget: exact DP whenever its estimated run time
+// fits the budget, the plain GA for tiny maps under a tight budget, and the memetic GA otherwise
+// (smaller populations as tours get long, since every offspring is locally optimised).
+// The GA paths are anytime: they return the best tour found once the budget is spent or the best
+// cost has been flat for a while. onProgress, if set, sees the GA's best cost as it improves.
+// `costs`, if given, is a stops x stops matrix (e.g. RoadNetwork::stop_matrix) that replaces
+// straight-line distance. `warmTour`, if given, seeds the GA instead of random permutations; the
+// exact solver has no use for it. `stop`, if given, ends the GA early once it is raised.
+RoutePlan plan_route(const vector<Point> &stops, double budgetMs = 50, function<void(const GAProgress&)> onProgress = nullptr,
+                     const vector<double> *costs = nullptr, const vector<int> *warmTour = nullptr, const atomic<bool> *stop = nullptr) {
+    TRACE_SCOPE("route.solve");
+    auto t0 = clk::now();
+    auto deadline = steady::now() + chrono::duration_cast<steady::duration>(ms(budgetMs));
+    int n = stops.size();
+    RoutePlan plan;
+    double dpMs = ldexp(1.0, n-1) * (n-1) * (n-1) * 3e-6; // ~3 ns per DP transition (memory bound)
+    if (n <= kHeldKarpMaxStops && dpMs <= budgetMs) {
+        CoordStore cs(stops);
+        plan.solver = SOLVER_EXACT;
+        plan.tour = held_karp(costs ? *costs : distance_matrix(cs), n);
+        plan.cost = costs ? 0 : tour_cost(cs, plan.tour);
+        for (int i=0; costs && i<n; ++i) plan.cost += (*costs)[(size_t)plan.tour[i]*n + plan.tour[(i+1)%n]];
+        plan.generations = 0;
+    } else {
+        plan.solver = n <= 12 ? SOLVER_GA : SOLVER_GA_LOCAL;
+        int pop = plan.solver == SOLVER_GA ? 160 : n <= 1000 ? 40 : 12;
+        // the memetic GA runs one island per pool thread (up to 8), as far as ~16M genes per
+        // population buffer allow; islands evolve in parallel and exchange migrants every 25 generations
+        int threads = (int)worker_pool().workers.size() + 1;
+        int islands = plan.solver == SOLVER_GA_LOCAL ? clamp((int)(16e6 / ((double)pop * n)), 1, min(threads, 8)) : 1;
+        GA ga(stops, pop, 0.85, 0.10, islands);
+        if (costs) ga.set_cost_matrix(*costs);
+        if (plan.solver == SOLVER_GA_LOCAL) ga.enable_local_search(8, 1.0, deadline);
+        if (warmTour) { ga.seed_population(*warmTour); plan.warmStarted = true; }
+        RunOptions opt;
+        opt.maxGenerations = plan.solver == SOLVER_GA ? 250 : n <= 1000 ? 100 : 60;
+        opt.budgetMs = max(1e-3, ms(deadline - steady::now()).count()); // 0 would mean unlimited
+        opt.stallGenerations = plan.solver == SOLVER_GA ? 80 : 20;
+        opt.stop = stop;
+        plan.generations = 0;
+        opt.onProgress = [&](const GAProgress &p) { plan.generations = p.generation; if (onProgress) onProgress(p); };
+        plan.tour = ga.run(opt);
+        plan.cost = ga.route_cost(plan.tour.data());
+        rotate(plan.tour.begin(), find(plan.tour.begin(), plan.tour.end(), 0), plan.tour.end());
+    }
+    plan.elapsedMs = ms(clk::now() - t0).count();
+    return plan;
+}
+
+// -------------------- Route Cache --------------------
+// LRU memo of solved routes, keyed by the canonical (sorted) stop set plus a hash of the map it was
+// solved on, so moving a place or editing the road file retires old entries. An exact hit skips the
+// solver; a near miss (one stop added or removed) warm-starts the GA from the cached tour.
+// On disk (route_cache.bin): header, then per entry, most recent first, the map hash, the stop
+// count and the tour as u16 map ids. The stop set is the sorted tour, so it is not stored twice.
+uint64_t map_hash(const vector<Point> &places, uint64_t extra = 0) {
+    uint64_t h = 0xcbf29ce484222325ull ^ extra;
+    auto mix = [&](uint64_t v) { uint64_t x = h ^ v; h = splitmix64(x); };
+    for (auto &p: places) {
+        for (unsigned char ch: p.name) h = (h ^ ch) * 0x100000001b3ull;
+        uint64_t bx, by;
+        memcpy(&bx, &p.x, 8); memcpy(&by, &p.y, 8);
+        mix(bx); mix(by);
+    }
+    return h;
+}
+
+struct RouteCache {
+    static const uint32_t kMagic = 0x43525350; // "PSRC"
+    static const uint32_t kVersion = 1;
+    struct Entry {
+        uint64_t mapHash;
+        vector<int> tour;  // map ids in visiting order
+        vector<int> stops; // same ids, sorted
+    };
+    size_t capacity;
+    list<Entry> lru; // front = most recently used
+    // key() -> entry; a multimap because distinct (map, stop set) pairs may share a 64-bit key
+    unordered_multimap<uint64_t, list<Entry>::iterator> index;
+    explicit RouteCache(size_t cap = 256) : capacity(cap) {}
+
+    static uint64_t key(uint64_t mapHash, const vector<int> &stops) {
+        uint64_t h = mapHash ^ stops.size();
+        for (int s: stops) { uint64_t x = h ^ (uint64_t)s; h = splitmix64(x); }
+        return h;
+    }
+    // the index slot of exactly this map and stop set, or index.end()
+    auto slot(uint64_t k, uint64_t mapHash, const vector<int> &stops) {
+        auto [it, end] = index.equal_range(k);
+        while (it != end && (it->second->mapHash != mapHash || it->second->stops != stops)) ++it;
+        return it == end ? index.end() : it;
+    }
+    const Entry* find(uint64_t mapHash, const vector<int> &stops) {
+        auto it = slot(key(mapHash, stops), mapHash, stops);
+        if (it == index.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return &lru.front();
+    }
+    // most recent entry on the same map whose stop set differs from `stops` by exactly one stop
+    const Entry* near_miss(uint64_t mapHash, const vector<int> &stops) const {
+        for (auto &e: lru) {
+            if (e.mapHash != mapHash || abs((int)e.stops.size() - (int)stops.size()) != 1) continue;
+            const vector<int> &big = e.stops.size() > stops.size() ? e.stops : stops;
+            const vector<int> &small = e.stops.size() > stops.size() ? stops : e.stops;
+            if (includes(big.begin(), big.end(), small.begin(), small.end())) return &e;
+        }
+        return nullptr;
+    }
+    void put(uint64_t mapHash, const vector<int> &tour) {
+        vector<int> stops(tour);
+        sort(stops.begin(), stops.end());
+        uint64_t k = key(mapHash, stops);
+        auto it = slot(k, mapHash, stops);
+        if (it != index.end()) { lru.erase(it->second); index.erase(it); }
+        lru.push_front({mapHash, tour, move(stops)});
+        index.emplace(k, lru.begin());
+        while (lru.size() > capacity) {
+            auto last = prev(lru.end());
+            auto [jt, end] = index.equal_range(key(last->mapHash, last->stops));
+            while (jt != end && jt->second != last) ++jt;
+            if (jt != end) index.erase(jt);
+            lru.pop_back();
+        }
+    }
+
+    bool save(const string &path) const {
+        TRACE_SCOPE("route_cache.save");
+        ofstream out(path, ios::binary);
+        if (!out) return false;
+        uint32_t hdr[3] = { kMagic, kVersion, 0 };
+        for (auto &e: lru) hdr[2] += e.tour.size() <= 0xFFFF && e.stops.back() <= 0xFFFF;
+        out.write((const char*)hdr, sizeof hdr);
+        vector<uint16_t> ids;
+        for (auto &e: lru) {
+            if (e.tour.size() > 0xFFFF || e.stops.back() > 0xFFFF) continue;
+            uint16_t len = e.tour.size();
+            ids.assign(e.tour.begin(), e.tour.end());
+            out.write((const char*)&e.mapHash, sizeof e.mapHash);
+            out.write((const char*)&len, sizeof len);
+            out.write((const char*)ids.data(), sizeof(uint16_t)*len);
+        }
+        return (bool)out;
+    }
+    bool load(const string &path) {
+        TRACE_SCOPE("route_cache.load");
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        uint32_t hdr[3];
+        in.read((char*)hdr, sizeof hdr);
+        if (!in || hdr[0] != kMagic || hdr[1] != kVersion) return false;
+        lru.clear(); index.clear();
+        vector<uint16_t> ids;
+        for (uint32_t i=0; i<hdr[2] && lru.size() < capacity; ++i) {
+            uint64_t mh; uint16_t len;
+            in.read((char*)&mh, sizeof mh); in.read((char*)&len, sizeof len);
+            ids.resize(len);
+            in.read((char*)ids.data(), sizeof(uint16_t)*len);
+            if (!in || len == 0) break;
+            Entry e{mh, vector<int>(ids.begin(), ids.end()), vector<int>(ids.begin(), ids.end())};
+            sort(e.stops.begin(), e.stops.end());
+            uint64_t k = key(mh, e.stops);
+            if (slot(k, mh, e.stops) != index.end()) continue; // a duplicate; the earlier copy is more recent
+            lru.push_back(move(e));
+            index.emplace(k, prev(lru.end()));
+        }
+        return true;
+    }
+};
+
+// Maps a cached tour (map ids) onto `stopIds` (sorted map ids), returning positions into stopIds:
+// stops that are gone are dropped, new ones are put where they lengthen the tour least.
+template<typename W>
+vector<int> adapt_tour(const vector<int> &cached, const vector<int> &stopIds, W d) {
+    vector<int> tour;
+    vector<char> placed(stopIds.size(), 0);
+    for (int id: cached) {
+        auto it = lower_bound(stopIds.begin(), stopIds.end(), id);
+        if (it != stopIds.end() && *it == id) { tour.push_back(it - stopIds.begin()); placed[tour.back()] = 1; }
+    }
+    for (int s=0; s<(int)stopIds.size(); ++s) {
+        if (placed[s]) continue;
+        int at = tour.size();
+        double bestDelta = numeric_limits<double>::infinity();
+        for (int i=0; i<(int)tour.size(); ++i) {
+            int a = tour[i], b = tour[(i+1) % tour.size()];
+            double delta = d(a, s) + d(s, b) - d(a, b);
+            if (delta < bestDelta) { bestDelta = delta; at = i+1; }
+        }
+        tour.insert(tour.begin() + at, s);
+    }
+    return tour;
+}
+
+// plan_route behind the cache. stops[i] is map place stopIds[i]; stopIds must be sorted.
+RoutePlan plan_route_cached(RouteCache &cache, uint64_t mapHash, const vector<int> &stopIds, const vector<Point> &stops,
+                            double budgetMs = 50, const vector<double> *costs = nullptr) {
+    TRACE_SCOPE("route.plan");
+    auto t0 = clk::now();
+    int n = stops.size();
+    auto d = [&](int a, int b) { return costs ? (*costs)[(size_t)a*n + b] : dist(stops[a], stops[b]); };
+    RoutePlan plan;
+    if (const RouteCache::Entry *e = cache.find(mapHash, stopIds)) {
+        TRACE_COUNT("route_cache.hits", 1);
+        plan.tour = adapt_tour(e->tour, stopIds, d);
+        rotate(plan.tour.begin(), find(plan.tour.begin(), plan.tour.end(), 0), plan.tour.end());
+        plan.cost = 0;
+        for (int i=0;i<n;++i) plan.cost += d(plan.tour[i], plan.tour[(i+1)%n]);
+        plan.solver = SOLVER_CACHED;
+        plan.generations = 0;
+        plan.elapsedMs = ms(clk::now() - t0).count();
+        return plan;
+    }
+    vector<int> warm;
+    if (const RouteCache::Entry *e = cache.near_miss(mapHash, stopIds)) warm = adapt_tour(e->tour, stopIds, d);
+    TRACE_COUNT(warm.empty() ? "route_cache.misses" : "route_cache.near_misses", 1);
+    plan = plan_route(stops, budgetMs, nullptr, costs, warm.empty() ? nullptr : &warm);
+    vector<int> ids;
+    for (int s: plan.tour) ids.push_back(stopIds[s]);
+    cache.put(mapHash, ids);
+    plan.elapsedMs = ms(clk::now() - t0).count();
+    return plan;
+}
+
+// -------------------- Life Rules --------------------
+// What a day does to a citizen is data: a rules file (--rules FILE, else ./life_rules.txt) parsed
+// once at startup and compiled into index tables. The file is the only copy of the rules, shared
+// with EuphoriSim, so modes that simulate days refuse to start without it. Places resolve to event
+// indices when a map is loaded, so the simulations themselves only ever index arrays. One directive
+// per line, '#' comments:
+//   event  <name> <energy> <happiness> <caption...>
+//   place  <event> <place name...>            ('*' = any place not listed)
+//   mood   <mood> <energy> <happiness>        start of each day
+//   random <mood> <probability> <energy> <happiness> <caption...>   chance at every stop
+//   sleep  <energy> <happiness>               overnight recovery (city simulation)
+// Any malformed line is an error naming file:line; EuphoriSim's reader applies the same rules.
+struct StatDelta { int8_t energy, happiness; };
+// everything the per-citizen kernels need, by Mood; thresholds are probabilities scaled to 2^32
+struct MoodRules {
+    StatDelta start[kMoods] = {}, random[kMoods] = {}, sleep = {};
+    uint32_t randomThreshold[kMoods] = {};
+    double randomProb[kMoods] = {};
+};
+struct LifeRules {
+    vector<string> eventName, eventCaption;
+    vector<StatDelta> eventDelta;
+    unordered_map<string, uint8_t> placeEvent;
+    int anyPlace = -1; // event for unlisted places
+    MoodRules mood;
+    string randomCaption[kMoods];
+
+    bool parse(const string &text, const string &source, string &err) {
+        *this = LifeRules();
+        istringstream in(text);
+        string line, kind;
+        vector<pair<string,string>> places; // resolved once all events are known
+        auto fail = [&](int ln, const string &msg) { err = source + ":" + to_string(ln) + ": " + msg; return false; };
+        auto delta = [](int e, int h, StatDelta &d) {
+            if (e < -100 || e > 100 || h < -100 || h > 100) return false;
+            d = { (int8_t)e, (int8_t)h }; return true;
+        };
+        auto rest = [](istringstream &ls) { string s; getline(ls >> ws, s); while (!s.empty() && isspace((unsigned char)s.back())) s.pop_back(); return s; };
+        for (int ln = 1; getline(in, line); ++ln) {
+            istringstream ls(line);
+            if (!(ls >> kind) || kind[0] == '#') continue;
+            string name; int e, h; double p; Mood m;
+            if (kind == "event") {
+                if (!(ls >> name >> e >> h)) return fail(ln, "expected 'event <name> <energy> <happiness> <caption>'");
+                if (find(eventName.begin(), eventName.end(), name) != eventName.end()) return fail(ln, "duplicate event '" + name + "'");
+                if (eventName.size() == 255) return fail(ln, "too many events");
+                StatDelta d;
+                if (!delta(e, h, d)) return fail(ln, "deltas must be within -100..100");
+                eventName.push_back(name); eventDelta.push_back(d); eventCaption.push_back(rest(ls));
+            } else if (kind == "place") {
+                if (!(ls >> name)) return fail(ln, "expected 'place <event> <place name>'");
+                string place = rest(ls);
+                if (place.empty()) return fail(ln, "missing place name");
+                places.emplace_back(name, place);
+            } else if (kind == "mood" || kind == "random") {
+                if (!(ls >> name) || !parse_mood(name, m)) return fail(ln, "unknown mood '" + name + "'");
+                if (kind == "random") {
+                    if (!(ls >> p >> e >> h) || p < 0 || p > 1) return fail(ln, "expected 'random <mood> <probability 0..1> <energy> <happiness> <caption>'");
+                    if (!delta(e, h, mood.random[m])) return fail(ln, "deltas must be within -100..100");
+                    mood.randomProb[m] = p;
+                    mood.randomThreshold[m] = (uint32_t)min(p * 4294967296.0, 4294967295.0);
+                    randomCaption[m] = rest(ls);
+                } else if (!(ls >> e >> h) || !delta(e, h, mood.start[m])) return fail(ln, "expected 'mood <mood> <energy> <happiness>'");
+            } else if (kind == "sleep") {
+                if (!(ls >> e >> h) || !delta(e, h, mood.sleep)) return fail(ln, "expected 'sleep <energy> <happiness>'");
+            } else return fail(ln, "unknown directive '" + kind + "'");
+        }
+        for (auto &[ev, place]: places) {
+            auto it = find(eventName.begin(), eventName.end(), ev);
+            if (it == eventName.end()) { err = source + ": place '" + place + "' uses unknown event '" + ev + "'"; return false; }
+            uint8_t id = (uint8_t)(it - eventName.begin());
+            if (place == "*") anyPlace = id; else placeEvent[place] = id;
+        }
+        if (anyPlace < 0) { err = source + ": no 'place <event> *' fallback"; return false; }
+        return true;
+    }
+    bool load(const string &path, string &err) {
+        ifstream in(path, ios::binary);
+        if (!in) { err = "cannot open " + path; return false; }
+        string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        return parse(text, path, err);
+    }
+    uint8_t event_at(const string &place) const {
+        auto it = placeEvent.find(place);
+        return it != placeEvent.end() ? it->second : (uint8_t)anyPlace;
+    }
+    // the one place names are looked up: index i of the result is places[i]'s event
+    vector<uint8_t> compile(const vector<Point> &places) const {
+        vector<uint8_t> ev;
+        for (auto &p: places) ev.push_back(event_at(p.name));
+        return ev;
+    }
+};
+// --rules (or ./life_rules.txt) loads into g_lifeRules before any mode that simulates days starts
+LifeRules g_lifeRules;
+LifeRules& life_rules() { return g_lifeRules; }
+
+// -------------------- Virtual Citizen LifeSim --------------------
+struct Citizen {
+    string name;
+    int energy; // 0-100
+    int happiness; // 0-100
+    Mood mood;
+    Citizen(string n="Alex"):name(n),energy(80),happiness(70),mood(MOOD_NEUTRAL){}
+    void apply(StatDelta d) {
+        energy = clamp(energy + d.energy, 0, 100);
+        happiness = clamp(happiness + d.happiness, 0, 100);
+    }
+    void integrate_mood(Mood m, const LifeRules &r = life_rules()) {
+        mood = m;
+        apply(r.mood.start[m]);
+    }
+};
+
+// -------------------- City Simulation --------------------
+// Population-scale LifeSim (--city N). Citizens are anonymous and stored as parallel arrays
+// (energy, happiness, mood), sorted into cohorts that share a daily schedule, so at each tick a
+// cohort is one contiguous range receiving one event delta from the compiled LifeRules. Every pass runs over fixed-size
+// blocks of kCityBlock citizens, which the compiler turns into vector add/min/max; the kernel
+// table picks an AVX2 build of the same loops at run time. Chunks of citizens go to the worker
+// pool, and random draws come from a counter-based hash of (seed, day, tick, citizen), so results
+// do not depend on the thread count.
+//   day:  ticks 0..T-1 (schedule stop t, then the mood's random event), then overnight
+//   overnight: mood re-derived from the day's end state, sleep recovery, next day's mood deltas
+const int kCityBlock = 64;
+
+inline uint32_t hash32(uint32_t x) { x ^= x >> 16; x *= 0x7feb352du; x ^= x >> 15; x *= 0x846ca68bu; x ^= x >> 16; return x; }
+inline int16_t clamp100(int v) { return (int16_t)min(max(v, 0), 100); }
+
+struct CityStats {
+    int64_t energy = 0, happiness = 0, exhausted = 0; // sums; exhausted = energy 0
+    int64_t mood[kMoods] = {};
+    void merge(const CityStats &o) {
+        energy += o.energy; happiness += o.happiness; exhausted += o.exhausted;
+        for (int c=0;c<kMoods;++c) mood[c] += o.mood[c];
+    }
+};
+
+// loop bodies, instantiated below for the generic and AVX2 kernels
+__attribute__((always_inline)) inline void city_delta_body(int16_t *__restrict e, int16_t *__restrict h, size_t n, int de, int dh) {
+    size_t i = 0;
+    for (; i + kCityBlock <= n; i += kCityBlock)
+        for (int j=0;j<kCityBlock;++j) { e[i+j] = clamp100(e[i+j] + de); h[i+j] = clamp100(h[i+j] + dh); }
+    for (; i < n; ++i) { e[i] = clamp100(e[i] + de); h[i] = clamp100(h[i] + dh); }
+}
+// per-mood table lookups written as masked sums (kMoods == 4) rather than an indexed load or a
+// branch chain, so the block loops stay vectorizable
+template<class T> __attribute__((always_inline)) inline T by_mood(uint8_t m, T calm, T neutral, T excited, T stressed) {
+    return (T)(-(T)(m == MOOD_CALM) & calm) | (T)(-(T)(m == MOOD_NEUTRAL) & neutral)
+         | (T)(-(T)(m == MOOD_EXCITED) & excited) | (T)(-(T)(m == MOOD_STRESSED) & stressed);
+}
+struct CityBlockStats {
+    int32_t energy = 0, happiness = 0, exhausted = 0, calm = 0, neutral = 0, excited = 0, stressed = 0;
+    void flush(CityStats &st) const {
+        st.energy += energy; st.happiness += happiness; st.exhausted += exhausted;
+        st.mood[MOOD_CALM] += calm; st.mood[MOOD_NEUTRAL] += neutral; st.mood[MOOD_EXCITED] += excited; st.mood[MOOD_STRESSED] += stressed;
+    }
+};
+__attribute__((always_inline)) inline void city_events_elem(int16_t &e, int16_t &h, uint8_t m, uint32_t r, const uint32_t *thr, const StatDelta *d, CityBlockStats &b) {
+    int hit = r < by_mood(m, thr[0], thr[1], thr[2], thr[3]);
+    int de = by_mood<int>(m, d[0].energy, d[1].energy, d[2].energy, d[3].energy);
+    int dh = by_mood<int>(m, d[0].happiness, d[1].happiness, d[2].happiness, d[3].happiness);
+    e = clamp100(e + hit*de); h = clamp100(h + hit*dh);
+    b.energy += e; b.happiness += h; b.exhausted += e == 0;
+    b.calm += m == MOOD_CALM; b.neutral += m == MOOD_NEUTRAL; b.excited += m == MOOD_EXCITED; b.stressed += m == MOOD_STRESSED;
+}
+// mood-driven random events over citizens [first, first+n), accumulating the tick's stats
+__attribute__((always_inline)) inline void city_events_body(int16_t *__restrict e, int16_t *__restrict h, const uint8_t *__restrict m,
+                                                            size_t n, uint32_t seed, uint32_t first, const MoodRules &rules, CityStats &st) {
+    uint32_t thr[kMoods]; StatDelta d[kMoods]; // local copies: the uint8 mood stores could alias `rules`
+    copy(rules.randomThreshold, rules.randomThreshold + kMoods, thr); copy(rules.random, rules.random + kMoods, d);
+    size_t i = 0;
+    for (; i + kCityBlock <= n; i += kCityBlock) {
+        CityBlockStats b; // int32 per block, widened once
+        for (int j=0;j<kCityBlock;++j) city_events_elem(e[i+j], h[i+j], m[i+j], hash32(seed ^ (first + (uint32_t)(i+j))), thr, d, b);
+        b.flush(st);
+    }
+    CityBlockStats b;
+    for (; i < n; ++i) city_events_elem(e[i], h[i], m[i], hash32(seed ^ (first + (uint32_t)i)), thr, d, b);
+    b.flush(st);
+}
+__attribute__((always_inline)) inline void city_overnight_elem(int16_t &e, int16_t &h, uint8_t &m, const StatDelta *d, StatDelta sleep) {
+    int en = e, hp = h;
+    // the day's end state sets tomorrow's mood
+    uint8_t mood = en < 25 || hp < 35 ? MOOD_STRESSED : en > 70 && hp > 75 ? MOOD_EXCITED : en >= 50 ? MOOD_CALM : MOOD_NEUTRAL;
+    int de = sleep.energy + by_mood<int>(mood, d[0].energy, d[1].energy, d[2].energy, d[3].energy);
+    int dh = sleep.happiness + by_mood<int>(mood, d[0].happiness, d[1].happiness, d[2].happiness, d[3].happiness);
+    m = mood; e = clamp100(en + de); h = clamp100(hp + dh);
+}
+__attribute__((always_inline)) inline void city_overnight_body(int16_t *__restrict e, int16_t *__restrict h, uint8_t *__restrict m, size_t n, const MoodRules &rules) {
+    StatDelta d[kMoods], sleep = rules.sleep;
+    copy(rules.start, rules.start + kMoods, d);
+    size_t i = 0;
+    for (; i + kCityBlock <= n; i += kCityBlock)
+        for (int j=0;j<kCityBlock;++j) city_overnight_elem(e[i+j], h[i+j], m[i+j], d, sleep);
+    for (; i < n; ++i) city_overnight_elem(e[i], h[i], m[i], d, sleep);
+}
+
+void city_delta_generic(int16_t *e, int16_t *h, size_t n, int de, int dh) { city_delta_body(e, h, n, de, dh); }
+void city_events_generic(int16_t *e, int16_t *h, const uint8_t *m, size_t n, uint32_t seed, uint32_t first, const MoodRules &r, CityStats &st) { city_events_body(e, h, m, n, seed, first, r, st); }
+void city_overnight_generic(int16_t *e, int16_t *h, uint8_t *m, size_t n, const MoodRules &r) { city_overnight_body(e, h, m, n, r); }
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void city_delta_avx2(int16_t *e, int16_t *h, size_t n, int de, int dh) { city_delta_body(e, h, n, de, dh); }
+__attribute__((target("avx2"))) void city_events_avx2(int16_t *e, int16_t *h, const uint8_t *m, size_t n, uint32_t seed, uint32_t first, const MoodRules &r, CityStats &st) { city_events_body(e, h, m, n, seed, first, r, st); }
+__attribute__((target("avx2"))) void city_overnight_avx2(int16_t *e, int16_t *h, uint8_t *m, size_t n, const MoodRules &r) { city_overnight_body(e, h, m, n, r); }
+#endif
+struct CityKernel {
+    const char *name;
+    void (*delta)(int16_t*, int16_t*, size_t, int, int);
+    void (*events)(int16_t*, int16_t*, const uint8_t*, size_t, uint32_t, uint32_t, const MoodRules&, CityStats&);
+    void (*overnight)(int16_t*, int16_t*, uint8_t*, size_t, const MoodRules&);
+};
+const CityKernel& city_kernel() {
+    static const CityKernel k = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return CityKernel{ "avx2", city_delta_avx2, city_events_avx2, city_overnight_avx2 };
+#endif
+        return CityKernel{ "generic", city_delta_generic, city_events_generic, city_overnight_generic };
+    }();
+    return k;
+}
+
+struct TickStats {
+    int day, tick;
+    double meanEnergy, meanHappiness, exhaustedShare;
+    double moodShare[kMoods];
+};
+
+struct CitySim {
+    static const size_t kChunk = 1 << 16; // citizens per worker task
+    vector<vector<StatDelta>> schedules;  // one per cohort: the compiled event delta of each stop, padded with {0,0}
+    vector<size_t> cohortStart;           // cohort s = citizens [cohortStart[s], cohortStart[s+1])
+    vector<int16_t, AlignedAllocator<int16_t, 64>> energy, happiness;
+    vector<uint8_t, AlignedAllocator<uint8_t, 64>> mood;
+    MoodRules rules;
+    int ticks = 0, day = 0;
+    uint64_t seed;
+
+    // cohort sizes are drawn at random, then every citizen starts like the interactive one:
+    // energy 80, happiness 70, a random mood's start-of-day deltas
+    CitySim(size_t citizens, vector<vector<StatDelta>> sched, const MoodRules &r, Rng &rng) : schedules(move(sched)), rules(r), seed(rng.next()) {
+        for (auto &s: schedules) ticks = max(ticks, (int)s.size());
+        for (auto &s: schedules) s.resize(ticks, StatDelta{0, 0});
+        vector<size_t> size(schedules.size(), 0);
+        for (size_t i=0;i<citizens;++i) size[rng.bounded(schedules.size())]++;
+        cohortStart.assign(1, 0);
+        for (size_t s: size) cohortStart.push_back(cohortStart.back() + s);
+        energy.assign(citizens, 80); happiness.assign(citizens, 70); mood.resize(citizens);
+        for (size_t i=0;i<citizens;++i) {
+            Mood m = (Mood)rng.bounded(kMoods);
+            mood[i] = m;
+            energy[i] = clamp100(energy[i] + rules.start[m].energy);
+            happiness[i] = clamp100(happiness[i] + rules.start[m].happiness);
+        }
+    }
+    size_t size() const { return energy.size(); }
+
+    TickStats tick(int t) {
+        TRACE_SCOPE("city.tick");
+        const CityKernel &k = city_kernel();
+        size_t n = size(), chunks = (n + kChunk - 1) / kChunk;
+        TRACE_COUNT("city.citizen_ticks", n);
+        uint64_t x = seed ^ ((uint64_t)day << 32) ^ (uint64_t)t;
+        uint32_t tickSeed = (uint32_t)splitmix64(x);
+        vector<CityStats> part(chunks);
+        worker_pool().parallel_for(chunks, [&](int c) {
+            size_t lo = c * kChunk, hi = min(n, lo + kChunk);
+            size_t s = upper_bound(cohortStart.begin(), cohortStart.end(), lo) - cohortStart.begin() - 1;
+            for (; s + 1 < cohortStart.size() && cohortStart[s] < hi; ++s) {
+                size_t a = max(lo, cohortStart[s]), b = min(hi, cohortStart[s+1]);
+                const StatDelta &d = schedules[s][t];
+                if (a < b && (d.energy || d.happiness)) k.delta(&energy[a], &happiness[a], b - a, d.energy, d.happiness);
+            }
+            k.events(&energy[lo], &happiness[lo], &mood[lo], hi - lo, tickSeed, (uint32_t)lo, rules, part[c]);
+        });
+        CityStats st;
+        for (auto &p: part) st.merge(p);
+        TickStats ts{ day, t, (double)st.energy / n, (double)st.happiness / n, (double)st.exhausted / n, {} };
+        for (int c=0;c<kMoods;++c) ts.moodShare[c] = (double)st.mood[c] / n;
+        return ts;
+    }
+    void overnight() {
+        TRACE_SCOPE("city.overnight");
+        const CityKernel &k = city_kernel();
+        size_t n = size(), chunks = (n + kChunk - 1) / kChunk;
+        worker_pool().parallel_for(chunks, [&](int c) {
+            size_t lo = c * kChunk, hi = min(n, lo + kChunk);
+            k.overnight(&energy[lo], &happiness[lo], &mood[lo], hi - lo, rules);
+        });
+        ++day;
+    }
+    void run(int days, const function<void(const TickStats&)> &onTick) {
+        for (int d=0; d<days; ++d) {
+            for (int t=0; t<ticks; ++t) { TickStats ts = tick(t); if (onTick) onTick(ts); }
+            overnight();
+        }
+    }
+};
+
+// --city N [--days D]: N citizens on random 2-4 stop schedules over the map's places
+int run_city(size_t citizens, int days, const vector<Point> &places) {
+    const LifeRules &rules = life_rules();
+    vector<uint8_t> placeEvent = rules.compile(places);
+    Rng rng = rng_stream(STREAM_CITY);
+    vector<vector<StatDelta>> schedules(32);
+    for (auto &s: schedules) {
+        int stops = rng.range(2, 4);
+        for (int i=0;i<stops;++i) s.push_back(rules.eventDelta[placeEvent[rng.bounded(places.size())]]);
+    }
+    auto t0 = clk::now();
+    CitySim sim(citizens, schedules, rules.mood, rng);
+    double setupMs = ms(clk::now() - t0).count();
+    cout << "City of " << citizens << " citizens, " << schedules.size() << " schedules, " << days << " day(s) of "
+         << sim.ticks << " ticks (" << city_kernel().name << " kernels, setup " << fixed << setprecision(1) << setupMs << " ms)\n";
+    cout << " day tick  energy  happy   calm neutral excited stressed exhausted\n";
+    t0 = clk::now();
+    sim.run(days, [](const TickStats &s) {
+        cout << setw(4) << s.day << setw(5) << s.tick << fixed << setprecision(1) << setw(8) << s.meanEnergy << setw(7) << s.meanHappiness;
+        for (int c=0;c<kMoods;++c) cout << setw(c == 3 ? 9 : c ? 8 : 7) << setprecision(3) << s.moodShare[c];
+        cout << setw(10) << s.exhaustedShare << "\n";
+    });
+    double sec = chrono::duration<double>(clk::now() - t0).count();
+    cout << fixed << setprecision(1) << "Simulated " << (double)citizens * days * sim.ticks / 1e6 << "M citizen-ticks in "
+         << sec * 1000 << " ms (" << setprecision(0) << citizens * days * sim.ticks / max(sec, 1e-9) / 1e6 << "M/s, stats printing included)\n";
+    return 0;
 }
-template<typename T>
-void shuffle_vec(vector<T> &v) {
-    for (int i = (int)v.size()-1; i>0; --i) {
-        int j = randint(0, i);
-        swap(v[i], v[j]);
+
+// -------------------- Self-learning Guessing Game --------------------
+// Counts over [1, n] in a Fenwick tree: O(log n) increment, prefix sum, point count and
+// weighted search (the smallest i whose prefix sum exceeds a target, by binary descent).
+struct FenwickCounts {
+    vector<uint32_t> tree; // 1-based
+    int n = 0, topBit = 0;
+    // every count starts at `init`: node i covers lowbit(i) numbers, so the build is O(n)
+    explicit FenwickCounts(int size = 0, uint32_t init = 0) : tree(size + 1), n(size) {
+        for (int i=1;i<=n;++i) tree[i] = init * (uint32_t)(i & -i);
+        topBit = n ? 1 << (31 - __builtin_clz(n)) : 0;
+    }
+    void add(int i, uint32_t d) { for (; i <= n; i += i & -i) tree[i] += d; }
+    uint64_t prefix(int i) const { uint64_t s = 0; for (; i > 0; i -= i & -i) s += tree[i]; return s; }
+    uint32_t count(int i) const { return (uint32_t)(prefix(i) - prefix(i - 1)); }
+    int search(uint64_t target) const {
+        int pos = 0;
+        for (int step = topBit; step; step >>= 1)
+            if (pos + step <= n && tree[pos + step] <= target) { pos += step; target -= tree[pos]; }
+        return pos + 1;
+    }
+};
+
+// How the program picks its next guess inside the [low, high] the hints leave open:
+//   GUESS_MODE     the original game: 70% the most-played number +/- 6% of the range, else uniform;
+//                  guesses outside the bounds fall back to the midpoint
+//   GUESS_SAMPLE   a number drawn in proportion to how often it was the player's
+//   GUESS_MEDIAN   the weighted median, splitting the remaining likelihood in half
+//   GUESS_MIDPOINT plain bisection, ignoring what it learned (baseline)
+enum GuessStrategy { GUESS_MODE, GUESS_SAMPLE, GUESS_MEDIAN, GUESS_MIDPOINT };
+const char* guess_strategy_name(GuessStrategy s) {
+    switch (s) {
+        case GUESS_MODE: return "mode";
+        case GUESS_SAMPLE: return "sample";
+        case GUESS_MEDIAN: return "median";
+        case GUESS_MIDPOINT: return "midpoint";
     }
+    return "?";
 }
 
-// -------------------- Typing-based Mood Detector --------------------
-struct TypingSample {
-    vector<double> intervals; // ms
-    double mean() const {
-        if (intervals.empty()) return 0;
-        double s = 0; for (double x: intervals) s += x;
-        return s / intervals.size();
+// Learns which numbers in [lo, hi] (up to 10^7 of them) the player thinks of. Counts are
+// Laplace-smoothed and the mode is kept up to date on every observation: counts only grow, so
+// it can only change to the number just counted.
+struct GuessLearner {
+    int lo, hi;
+    FenwickCounts freq;
+    int mode;
+    uint32_t modeCount = 1;
+    int rounds = 0;
+    GuessStrategy strategy;
+    Rng rng;
+    GuessLearner(int lo_=1, int hi_=100, GuessStrategy s=GUESS_MODE, Rng r=rng_stream(STREAM_GAME))
+        : lo(lo_), hi(hi_), freq(hi_-lo_+1, 1), mode(lo_), strategy(s), rng(r) {}
+    // the player's number, once known
+    void observe(int secret) {
+        if (secret < lo || secret > hi) return;
+        int i = secret - lo + 1;
+        freq.add(i, 1);
+        uint32_t c = freq.count(i);
+        if (c > modeCount) modeCount = c, mode = secret;
+        rounds++;
     }
-    double stddev() const {
-        if (intervals.empty()) return 0;
-        double m = mean();
-        double s = 0; for (double x: intervals) s += (x-m)*(x-m);
-        return sqrt(s / intervals.size());
+    int make_guess(int low, int high) {
+        low = max(low, lo); high = min(high, hi);
+        int mid = low + (high - low) / 2;
+        if (strategy == GUESS_MIDPOINT) return mid;
+        if (strategy == GUESS_MODE) {
+            int spread = max(1, (int)((int64_t)(hi - lo + 1) * 6 / 100));
+            int g = rng.uniform() < 0.7 ? clamp(mode + rng.range(-spread, spread), lo, hi) : rng.range(lo, hi);
+            return g < low || g > high ? mid : g;
+        }
+        // likelihood mass of [low, high] is prefix(high) - prefix(low-1); pick a point inside it
+        uint64_t base = freq.prefix(low - lo), mass = freq.prefix(high - lo + 1) - base;
+        uint64_t t = strategy == GUESS_MEDIAN ? (mass - 1) / 2 : min(mass - 1, (uint64_t)(rng.uniform() * mass));
+        return lo - 1 + freq.search(base + t);
     }
 };
 
-TypingSample record_typing_sample() {
-    cout << "Type a short sentence (press ENTER when done). Try to type normally.\n";
-    cout << "Start typing when you're ready >>> ";
-    TypingSample ts;
-    // We will capture character-by-character timing using cin.get()
-    // Note: terminal buffering may affect accuracy; still gives usable rhythm features.
-    cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear previous newline
-    cout.flush();
-    string s;
-    char c;
-    vector<clk::time_point> times;
-    // We'll read until newline
-    while (true) {
-        auto t1 = clk::now();
-        if (!cin.get(c)) break;
-        auto t2 = clk::now();
-        times.push_back(t2);
-        s.push_back(c);
-        if (c == '\n') break;
-        // If user typed a ctrl char, ignore
-        if ((int)s.size() > 500) break;
+// --selfplay ROUNDS [--guess-range N]: every strategy against scripted players, headless. A
+// player draws a secret, the learner guesses until it hits it (hints narrow the bounds as in the
+// game), then observes the secret.
+//   uniform    any number, equally likely
+//   favourite  80% one of 16 favourite numbers (Zipf weights), else uniform
+//   gaussian   normal around a fixed number, sd 5% of the range
+//   drifting   one of 4 favourites, one of which is replaced every 1000 rounds
+enum ScriptedPlayer { PLAYER_UNIFORM, PLAYER_FAVOURITE, PLAYER_GAUSSIAN, PLAYER_DRIFTING, kScriptedPlayers };
+const char* scripted_player_name(int p) {
+    static const char *names[kScriptedPlayers] = { "uniform", "favourite", "gaussian", "drifting" };
+    return names[p];
+}
+struct SecretPicker {
+    ScriptedPlayer kind;
+    int n;
+    Rng rng;
+    vector<int> favs;
+    vector<double> zipf; // cumulative weights of favs
+    double center = 0;
+    long long picks = 0;
+    SecretPicker(ScriptedPlayer k, int n_, Rng r) : kind(k), n(n_), rng(r) {
+        int f = kind == PLAYER_FAVOURITE ? 16 : kind == PLAYER_DRIFTING ? 4 : 0;
+        for (int i=0;i<f;++i) favs.push_back(rng.range(1, n));
+        double acc = 0;
+        for (int i=0;i<f;++i) zipf.push_back(acc += 1.0 / (i + 1));
+        center = 1 + rng.uniform() * (n - 1);
     }
-    // Build intervals between successive visible keys (ignore the first)
-    for (size_t i=1;i<times.size();++i) {
-        auto d = chrono::duration_cast<ms>(times[i] - times[i-1]).count();
-        // ignore very large gaps (pauses) and also extreme micro-gaps
-        if (d > 10 && d < 2000) ts.intervals.push_back(d);
+    int next() {
+        ++picks;
+        switch (kind) {
+            case PLAYER_UNIFORM: return rng.range(1, n);
+            case PLAYER_FAVOURITE:
+                if (rng.uniform() < 0.2) return rng.range(1, n);
+                return favs[lower_bound(zipf.begin(), zipf.end(), rng.uniform() * zipf.back()) - zipf.begin()];
+            case PLAYER_GAUSSIAN: {
+                double u1 = 1 - rng.uniform(), u2 = rng.uniform(); // Box-Muller
+                double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+                return clamp((int)lround(center + z * max(1.0, n * 0.05)), 1, n);
+            }
+            default:
+                if (picks % 1000 == 0) favs[rng.bounded(favs.size())] = rng.range(1, n);
+                return favs[rng.bounded(favs.size())];
+        }
     }
-    if (ts.intervals.empty()) {
-        // fallback: ask for approximate typing speed (words per minute)
-        cout << "(No accurate keystroke timing captured.) Enter approximate words per minute (WPM): ";
-        int wpm; cin >> wpm; cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        double msPerChar = 60000.0 / (wpm * 5.0);
-        for (int i=0;i<10;i++) ts.intervals.push_back(msPerChar + (rand01()-0.5)*msPerChar*0.2);
+};
+int run_selfplay(long long rounds, int n) {
+    const GuessStrategy strategies[] = { GUESS_MODE, GUESS_SAMPLE, GUESS_MEDIAN, GUESS_MIDPOINT };
+    const int maxTries = 1000; // a round that takes longer is abandoned
+    Rng root = rng_stream(STREAM_GAME);
+    cout << "Self-play: " << rounds << " rounds per pairing over 1.." << n << "\n";
+    cout << setw(10) << "player" << setw(10) << "strategy" << setw(12) << "mean tries" << setw(10) << "p99" << setw(10) << "max"
+         << setw(10) << "unsolved" << setw(14) << "rounds/s\n";
+    for (int p=0;p<kScriptedPlayers;++p) {
+        Rng playerSeed = root.split();
+        for (auto s: strategies) {
+            SecretPicker player((ScriptedPlayer)p, n, playerSeed); // same secrets for every strategy
+            GuessLearner gl(1, n, s, root.split());
+            vector<long long> hist(maxTries + 1, 0);
+            long long tries = 0, unsolved = 0;
+            auto t0 = clk::now();
+            for (long long r=0;r<rounds;++r) {
+                int secret = player.next(), low = 1, high = n, t = 0;
+                bool hit = false;
+                while (!hit && t < maxTries) {
+                    int g = gl.make_guess(low, high);
+                    ++t;
+                    if (g == secret) hit = true;
+                    else if (g < secret) low = g + 1;
+                    else high = g - 1;
+                }
+                unsolved += !hit;
+                hist[t]++; tries += t;
+                gl.observe(secret);
+            }
+            double sec = chrono::duration<double>(clk::now() - t0).count();
+            long long acc = 0; int p99 = 0, worst = 0;
+            for (int t=0;t<=maxTries;++t) {
+                if (hist[t]) worst = t;
+                acc += hist[t];
+                if (!p99 && acc * 100 >= rounds * 99) p99 = t;
+            }
+            cout << setw(10) << scripted_player_name(p) << setw(10) << guess_strategy_name(s) << fixed << setprecision(2)
+                 << setw(12) << (double)tries / rounds << setw(10) << p99 << setw(10) << worst << setw(10) << unsolved
+                 << setw(13) << setprecision(0) << rounds / max(sec, 1e-9) << "\n";
+        }
     }
-    return ts;
+    return 0;
 }
 
-enum Mood { MOOD_CALM, MOOD_NEUTRAL, MOOD_EXCITED, MOOD_STRESSED };
-string mood_name(Mood m){
-    switch(m){
-        case MOOD_CALM: return "Calm";
-        case MOOD_NEUTRAL: return "Neutral";
-        case MOOD_EXCITED: return "Excited";
-        case MOOD_STRESSED: return "Stressed";
+// -------------------- Benchmarks --------------------
+// Allocation counting for the suite, only in builds with -DEUPHORISIM_BENCH_ALLOCS=1 so the other
+// modes keep the library allocator: the global operator new/delete are replaced by ones that
+// forward to the library's aligned pair (each new still meets its own delete) and, while a
+// measurement is running, count calls and bytes. Over-aligned allocations (AlignedAllocator) go
+// to the aligned pair directly and are not counted. Without the flag the allocation columns are
+// left empty.
+#ifndef EUPHORISIM_BENCH_ALLOCS
+#define EUPHORISIM_BENCH_ALLOCS 0
+#endif
+atomic<bool> g_countAllocs{false};
+atomic<uint64_t> g_allocCalls{0}, g_allocBytes{0};
+#if EUPHORISIM_BENCH_ALLOCS
+const align_val_t kNewAlign{__STDCPP_DEFAULT_NEW_ALIGNMENT__};
+void* operator new(size_t n) {
+    if (g_countAllocs.load(memory_order_relaxed)) {
+        g_allocCalls.fetch_add(1, memory_order_relaxed);
+        g_allocBytes.fetch_add(n, memory_order_relaxed);
     }
-    return "Unknown";
+    return ::operator new(n, kNewAlign);
 }
+void* operator new[](size_t n) { return ::operator new(n); }
+void operator delete(void *p) noexcept { ::operator delete(p, kNewAlign); }
+void operator delete[](void *p) noexcept { ::operator delete(p); }
+void operator delete(void *p, size_t) noexcept { ::operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { ::operator delete(p); }
+#endif
 
-Mood infer_mood(const TypingSample &ts) {
-    double mean = ts.mean();
-    double sd = ts.stddev();
-    // heuristics (tuned to be robust):
-    // - low mean (fast typing) + low stddev -> Excited / confident
-    // - medium mean, medium sd -> Neutral
-    // - high mean (slow) + low sd -> Calm (deliberate)
-    // - high mean + high sd -> Stressed (pauses, hesitations)
-    if (mean < 120 && sd < 50) return MOOD_EXCITED;
-    if (mean < 160 && sd < 90) return MOOD_NEUTRAL;
-    if (mean >= 160 && sd < 120) return MOOD_CALM;
-    return MOOD_STRESSED;
-}
+// --bench: every hot path over synthetic inputs, swept over input size and (for the parallel
+// stages) worker count. Each case is timed in batches grown until one takes a fifth of the time
+// budget, then three batches are run and the fastest is kept; allocations come from the first
+// of those. Results print as a table and optionally as JSON (--bench-json), which is also the
+// format --bench-baseline compares against: slower than the baseline by more than the tolerance
+// counts as a regression and makes the exit status 1.
+struct BenchRecord {
+    string name;
+    long long size;
+    int threads;
+    double nsPerOp, opsPerSec, allocsPerOp, bytesPerOp;
+};
+struct BenchSuite {
+    double budgetMs = 200; // per case
+    string filter;         // substring of the case names to run
+    vector<BenchRecord> records;
 
-// -------------------- Music Recommender (simple) --------------------
-struct Song { string title, artist, vibe; };
-vector<Song> song_library = {
-    {"Sunrise Drive","Nova Lane","calm"},
-    {"Midnight Sprint","Electra","excited"},
-    {"Coffee & Rain","Slowfold","calm"},
-    {"Neon Pulse","The Jetstream","excited"},
-    {"Easy Sunday","Paper Boat","calm"},
-    {"Focus Mode","Binary Hearts","neutral"},
-    {"Uplift","StellarVox","excited"},
-    {"Quiet Corners","MellowMuse","calm"},
-    {"Walking Home","Alleyways","neutral"},
-    {"Heart Rate","PulseUnit","excited"}
-};
-
-vector<Song> recommend_by_mood(Mood m, int k=3) {
-    vector<Song> res;
-    vector<int> idx(song_library.size());
-    iota(idx.begin(), idx.end(), 0);
-    shuffle_vec(idx);
-    for (int id: idx) {
-        const Song &s = song_library[id];
-        if (m==MOOD_CALM && s.vibe=="calm") res.push_back(s);
-        else if (m==MOOD_EXCITED && s.vibe=="excited") res.push_back(s);
-        else if (m==MOOD_NEUTRAL && (s.vibe=="neutral"||s.vibe=="calm")) res.push_back(s);
-        else if (m==MOOD_STRESSED && s.vibe!="excited") res.push_back(s);
-        if ((int)res.size()>=k) break;
-    }
-    if (res.empty()) {
-        for (int i=0;i<k && i<(int)song_library.size();++i) res.push_back(song_library[i]);
+    bool wants(const string &name) const { return filter.empty() || name.find(filter) != string::npos; }
+    // fn(calls) performs `calls` calls of opsPerCall operations each
+    template<typename F>
+    void measure(const string &name, long long size, int threads, double opsPerCall, F fn) {
+        worker_pool().limit = threads - 1;
+        auto timed = [&](long long calls) { auto t0 = clk::now(); fn(calls); return ms(clk::now() - t0).count(); };
+        long long calls = 1;
+        double t = timed(calls);
+        while (t < budgetMs / 5) { calls *= t > 0 ? clamp<long long>((long long)(budgetMs / 5 / t) + 1, 2, 100) : 100; t = timed(calls); }
+        double best = t;
+        uint64_t a0 = g_allocCalls, b0 = g_allocBytes, a1 = a0, b1 = b0;
+        for (int rep = 0; rep < (t < budgetMs ? 3 : 1); ++rep) {
+            if (rep == 0) g_countAllocs = true;
+            double r = timed(calls);
+            if (rep == 0) { g_countAllocs = false; a1 = g_allocCalls; b1 = g_allocBytes; }
+            best = min(best, r);
+        }
+        worker_pool().limit = INT_MAX;
+        double ops = calls * opsPerCall;
+        double na = numeric_limits<double>::quiet_NaN();
+        BenchRecord rec{ name, size, threads, best * 1e6 / ops, ops / (best / 1000),
+                         EUPHORISIM_BENCH_ALLOCS ? (a1 - a0) / ops : na, EUPHORISIM_BENCH_ALLOCS ? (b1 - b0) / ops : na };
+        records.push_back(rec);
+        cout << left << setw(24) << name << right << setw(10) << size << setw(5) << threads << fixed << setprecision(1)
+             << setw(14) << rec.nsPerOp << setw(14) << setprecision(0) << rec.opsPerSec << setprecision(2);
+        if (EUPHORISIM_BENCH_ALLOCS) cout << setw(10) << rec.allocsPerOp << setw(12) << setprecision(1) << rec.bytesPerOp << "\n";
+        else cout << setw(10) << "-" << setw(12) << "-" << "\n";
+        cout.flush();
     }
-    return res;
-}
+};
 
-// -------------------- Small Map + Distance --------------------
-struct Point { string name; double x,y; };
-double dist(const Point &a, const Point &b) {
-    double dx = a.x - b.x, dy = a.y - b.y;
-    return sqrt(dx*dx + dy*dy);
+// synthetic inputs
+vector<Point> bench_map(int n, Rng &rng) {
+    vector<Point> pts(n);
+    for (int i=0;i<n;++i) pts[i] = { "p" + to_string(i), rng.uniform() * 1000, rng.uniform() * 1000 };
+    return pts;
+}
+vector<Song> bench_songs(size_t n, Rng &rng) {
+    static const char *vibes[] = { "calm", "excited", "neutral", "melancholy" };
+    vector<Song> songs(n);
+    for (size_t i=0;i<n;++i) {
+        Song &s = songs[i];
+        s.title = "Track " + to_string(i);
+        s.artist = "Artist " + to_string(rng.bounded(max<size_t>(1, n / 8)));
+        s.vibe = vibes[rng.bounded(4)];
+        for (auto &f: s.feat) f = (float)rng.uniform();
+    }
+    return songs;
+}
+// keystroke gaps (ms) in runs of a few hundred keys per mood: bursts, steady typing, pauses
+vector<double> bench_intervals(size_t n, Rng &rng) {
+    static const double mean[kMoods] = { 200, 150, 90, 260 }, sd[kMoods] = { 40, 50, 30, 140 };
+    vector<double> gaps(n);
+    int m = 0;
+    for (size_t i=0;i<n;++i) {
+        if (i % 300 == 0) m = rng.bounded(kMoods);
+        double u1 = 1 - rng.uniform(), u2 = rng.uniform();
+        double g = mean[m] + sd[m] * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+        if (rng.uniform() < 0.01) g += 2500; // pause
+        gaps[i] = max(15.0, g);
+    }
+    return gaps;
 }
 
-// -------------------- Genetic Algorithm for Route Optimization --------------------
-struct GA {
-    vector<Point> places;
-    int popSize;
-    int geneLen; // number of places to visit
-    double crossoverRate;
-    double mutationRate;
-    vector<vector<int>> population;
-    vector<double> fitness;
-    GA(const vector<Point>&p, int pop=120, double cr=0.8, double mr=0.12) {
-        places = p; popSize = pop; geneLen = p.size(); crossoverRate=cr; mutationRate=mr;
-        init_population();
+// side x side street grid with jittered segment costs and a few diagonal shortcuts
+RoadGraph bench_roads(int side, Rng &rng) {
+    RoadGraph g;
+    g.n = side * side;
+    vector<vector<pair<int,float>>> adj(g.n);
+    auto link = [&](int u, int v, float w) { adj[u].push_back({v, w}); adj[v].push_back({u, w}); };
+    for (int r=0;r<side;++r) for (int c=0;c<side;++c) {
+        int v = r*side + c;
+        if (c+1 < side) link(v, v+1, 10 + 5 * (float)rng.uniform());
+        if (r+1 < side) link(v, v+side, 10 + 5 * (float)rng.uniform());
+        if (r+1 < side && c+1 < side && rng.uniform() < 0.05) link(v, v+side+1, 12 + 4 * (float)rng.uniform());
     }
-    double route_cost(const vector<int>&chrom) {
-        // route starts at 0 (home), visits all indices in chrom order, and returns to home
-        double c = 0;
-        for (int i=0;i<(int)chrom.size()-1;++i)
-            c += dist(places[chrom[i]], places[chrom[i+1]]);
-        // do not force return if single point; but keep cycle:
-        c += dist(places[chrom.back()], places[chrom.front()]);
-        return c;
+    g.offset.assign(1, 0);
+    for (int v=0; v<g.n; ++v) {
+        for (auto [u, w]: adj[v]) g.head.push_back(u), g.weight.push_back(w);
+        g.offset.push_back(g.head.size());
+        g.x.push_back(v % side * 10); g.y.push_back(v / side * 10);
+    }
+    g.index_coords();
+    return g;
+}
+
+int run_bench(const string &filter, double budgetMs, const string &jsonPath, const string &baselinePath, double tolerancePct) {
+    BenchSuite suite;
+    suite.filter = filter; suite.budgetMs = budgetMs;
+    vector<int> threadSweep;
+    int maxThreads = (int)worker_pool().workers.size() + 1;
+    for (int t=1; t<maxThreads; t*=2) threadSweep.push_back(t);
+    threadSweep.push_back(maxThreads);
+    Rng rng(20240611); // fixed inputs, independent of --seed
+    cout << "Benchmarks (" << budgetMs << " ms per case, up to " << maxThreads << " thread(s))\n";
+    cout << left << setw(24) << "case" << right << setw(10) << "size" << setw(5) << "thr" << setw(14) << "ns/op"
+         << setw(14) << "ops/s" << setw(10) << "allocs/op" << setw(12) << "bytes/op" << "\n";
+
+    // maps: one full tour priced by the dispatched kernel; a GA generation (4 islands, 120 each)
+    for (int n: {5, 100, 1000, 100000}) {
+        if (!suite.wants("map.tour_cost")) break;
+        CoordStore cs(bench_map(n, rng));
+        vector<int> tour(n);
+        iota(tour.begin(), tour.end(), 0);
+        shuffle_vec(tour, rng);
+        volatile double sink = 0;
+        suite.measure("map.tour_cost", n, 1, 1, [&](long long calls) { for (long long i=0;i<calls;++i) sink = sink + tour_cost(cs, tour); });
     }
-    void init_population() {
-        population.clear(); fitness.clear();
-        vector<int> base(geneLen);
-        iota(base.begin(), base.end(), 0);
-        for (int i=0;i<popSize;++i) {
-            vector<int> chrom = base;
-            shuffle_vec(chrom);
-            population.push_back(chrom);
-            fitness.push_back(0);
+    for (int n: {5, 100, 1000, 10000, 100000}) {
+        if (!suite.wants("ga.generation")) break;
+        vector<Point> pts = bench_map(n, rng);
+        for (int t: threadSweep) {
+            GA ga(pts, 120, 0.85, 0.10, 4, 25, MIGRATE_RING, 7);
+            suite.measure("ga.generation", n, t, 1, [&](long long calls) { ga.run((int)calls); });
         }
     }
-    void evaluate() {
-        for (int i=0;i<popSize;++i) {
-            double c = route_cost(population[i]);
-            fitness[i] = 1.0 / (1.0 + c); // higher fitness for shorter cost
+
+    // roads: a 50-stop cost matrix from the contraction hierarchy and from per-source Dijkstra,
+    // which also cross-checks the hierarchy (both must agree up to float rounding)
+    int roadMismatches = 0;
+    for (int side: {30, 300}) {
+        if (!suite.wants("roads.matrix")) break;
+        RoadGraph g = bench_roads(side, rng);
+        ContractionHierarchy ch;
+        ch.build(g);
+        vector<int> nodes(50);
+        for (int &v: nodes) v = rng.bounded(g.n);
+        vector<double> viaCh = ch.matrix(nodes), viaDijkstra = road_matrix_dijkstra(g, nodes);
+        for (size_t i=0;i<viaCh.size();++i)
+            if (fabs(viaCh[i] - viaDijkstra[i]) > 1e-3 * max(1.0, viaDijkstra[i])) ++roadMismatches;
+        for (int t: threadSweep) {
+            suite.measure("roads.matrix_ch", g.n, t, 1, [&](long long calls) { for (long long k=0;k<calls;++k) ch.matrix(nodes); });
+            suite.measure("roads.matrix_dijkstra", g.n, t, 1, [&](long long calls) { for (long long k=0;k<calls;++k) road_matrix_dijkstra(g, nodes); });
         }
     }
-    int roulette_select() {
-        double s = 0; for (double f: fitness) s += f;
-        double r = rand01() * s;
-        double acc = 0;
-        for (int i=0;i<popSize;++i) {
-            acc += fitness[i];
-            if (acc >= r) return i;
-        }
-        return popSize-1;
-    }
-    pair<vector<int>,vector<int>> ordered_crossover(const vector<int>&a, const vector<int>&b) {
-        int n = geneLen;
-        int l = randint(0, n-1), r = randint(0, n-1);
-        if (l > r) swap(l,r);
-        vector<int> c1(n, -1), c2(n, -1);
-        vector<char> used1(n,0), used2(n,0);
-        // copy slice
-        for (int i=l;i<=r;++i) {
-            c1[i] = a[i]; used1[a[i]] = 1;
-            c2[i] = b[i]; used2[b[i]] = 1;
-        }
-        // fill remaining preserving order
-        int idx1 = (r+1)%n;
-        for (int i=0;i<n;++i) {
-            int v = b[(r+1+i)%n];
-            if (!used1[v]) { c1[idx1]=v; used1[v]=1; idx1=(idx1+1)%n; }
+    if (roadMismatches) cerr << "roads.matrix: " << roadMismatches << " entries differ between the hierarchy and Dijkstra\n";
+
+    // catalogs: mood sampling over a featureless catalog, HNSW ranking over a featured one
+    song_catalog(); // claim the call_once so the adopted catalogs below stay
+    string err;
+    for (int n: {10, 1000, 100000, 10000000}) {
+        if (!suite.wants("catalog.recommend_by_mood")) break;
+        g_catalog.adopt(build_catalog(bench_songs(n, rng), false), err);
+        Rng r(1);
+        suite.measure("catalog.recommend_by_mood", n, 1, 1, [&](long long calls) {
+            for (long long i=0;i<calls;++i) recommend_by_mood((Mood)(i & 3), 3, r);
+        });
+    }
+    for (int n: {10, 1000, 100000}) {
+        if (!suite.wants("catalog.recommend_for")) break;
+        g_catalog.adopt(build_catalog(bench_songs(n, rng), true), err);
+        Rng r(2);
+        suite.measure("catalog.recommend_for", n, 1, 1, [&](long long calls) {
+            for (long long i=0;i<calls;++i) {
+                SongFeatures target;
+                for (auto &f: target) f = (float)r.uniform();
+                recommend_for(target, (Mood)(i & 3), 3, r);
+            }
+        });
+    }
+    g_catalog.adopt(build_catalog(song_library, true), err);
+
+    // interval streams: per-gap rhythm tracking, threshold inference, feature extraction per 40 keys
+    for (int n: {100, 10000, 1000000}) {
+        vector<double> gaps = bench_intervals(n, rng);
+        if (suite.wants("mood.rhythm"))
+            suite.measure("mood.rhythm", n, 1, n, [&](long long calls) {
+                for (long long c=0;c<calls;++c) { RhythmAnalyzer ra; double t = 0; for (double g: gaps) ra.key(t += g); }
+            });
+        if (suite.wants("mood.infer")) {
+            vector<pair<double,double>> windows; // (mean, sd) of every 20-gap window
+            for (int i=0;i+20<=n;i+=20) { Welford w; for (int j=i;j<i+20;++j) w.add(gaps[j]); windows.push_back({w.mean, w.stddev()}); }
+            volatile int sink = 0;
+            suite.measure("mood.infer", n, 1, n, [&](long long calls) {
+                for (long long c=0;c<calls;++c) {
+                    Welford w;
+                    for (double g: gaps) w.add(g);
+                    int acc = infer_mood(w.mean, w.stddev());
+                    for (auto &[m, s]: windows) acc += infer_mood(m, s);
+                    sink = sink + acc;
+                }
+            });
         }
-        int idx2 = (r+1)%n;
-        for (int i=0;i<n;++i) {
-            int v = a[(r+1+i)%n];
-            if (!used2[v]) { c2[idx2]=v; used2[v]=1; idx2=(idx2+1)%n; }
+        if (suite.wants("mood.features") && n >= 40) {
+            vector<KeyEvent> ev(n + 1);
+            int64_t t = 0;
+            for (int i=0;i<=n;++i) { ev[i] = { t, 'a' + (int)(i % 26) }; if (i < n) t += (int64_t)(gaps[i] * 1e6); }
+            float f[kMoodFeatures];
+            suite.measure("mood.features", n, 1, n / 40, [&](long long calls) {
+                for (long long c=0;c<calls;++c) for (size_t i=0;i+41<=ev.size();i+=40) extract_features(&ev[i], 41, f);
+            });
         }
-        return {c1,c2};
     }
-    void mutate(vector<int>&chrom) {
-        if (rand01() > mutationRate) return;
-        int i = randint(0, geneLen-1), j = randint(0, geneLen-1);
-        swap(chrom[i], chrom[j]);
+
+    // life: one citizen through a stream of compiled events; the city engine per citizen-tick
+    if (suite.wants("life.citizen_apply")) {
+        const LifeRules &rules = life_rules();
+        vector<uint8_t> events(4096);
+        for (auto &e: events) e = rng.bounded(rules.eventDelta.size());
+        Citizen c;
+        volatile int sink = 0;
+        suite.measure("life.citizen_apply", events.size(), 1, events.size(), [&](long long calls) {
+            for (long long k=0;k<calls;++k) for (uint8_t e: events) c.apply(rules.eventDelta[e]);
+            sink = c.energy;
+        });
+    }
+    for (int n: {1000, 100000, 1000000, 10000000}) {
+        if (!suite.wants("life.city_tick")) break;
+        const LifeRules &rules = life_rules();
+        vector<vector<StatDelta>> schedules(32);
+        for (auto &s: schedules) for (int i=0, stops=rng.range(2, 4); i<stops; ++i) s.push_back(rules.eventDelta[rng.bounded(rules.eventDelta.size())]);
+        Rng r(3);
+        CitySim sim(n, schedules, rules.mood, r);
+        for (int t: threadSweep)
+            suite.measure("life.city_tick", n, t, n, [&](long long calls) {
+                for (long long k=0;k<calls;++k) { int tick = k % sim.ticks; sim.tick(tick); if (tick == sim.ticks - 1) sim.overnight(); }
+            });
     }
-    vector<int> run(int generations=300) {
-        evaluate();
-        vector<int> best = population[0];
-        double bestCost = route_cost(best);
-        for (int gen=0; gen<generations; ++gen) {
-            vector<vector<int>> newpop;
-            // elitism: keep best
-            int eliteIdx = 0;
-            double bestF = fitness[0];
-            for (int i=1;i<popSize;++i) if (fitness[i] > bestF) { bestF = fitness[i]; eliteIdx = i; }
-            newpop.push_back(population[eliteIdx]);
-            while ((int)newpop.size() < popSize) {
-                int p1 = roulette_select();
-                int p2 = roulette_select();
-                vector<int> child1 = population[p1], child2 = population[p2];
-                if (rand01() < crossoverRate) {
-                    auto cross = ordered_crossover(population[p1], population[p2]);
-                    child1 = cross.first; child2 = cross.second;
+
+    // guessing game: a learner (weighted median) solving a favourite-number player's secrets
+    for (int n: {100, 10000, 10000000}) {
+        if (!suite.wants("game.guess_round")) break;
+        SecretPicker player(PLAYER_FAVOURITE, n, Rng(4));
+        GuessLearner gl(1, n, GUESS_MEDIAN, Rng(5));
+        suite.measure("game.guess_round", n, 1, 1, [&](long long calls) {
+            for (long long k=0;k<calls;++k) {
+                int secret = player.next(), low = 1, high = n;
+                for (int g; (g = gl.make_guess(low, high)) != secret; ) {
+                    if (g < secret) low = g + 1; else high = g - 1;
                 }
-                mutate(child1); mutate(child2);
-                newpop.push_back(child1);
-                if ((int)newpop.size() < popSize) newpop.push_back(child2);
-            }
-            population.swap(newpop);
-            evaluate();
-            // update best
-            for (int i=0;i<popSize;++i) {
-                double c = route_cost(population[i]);
-                if (c < bestCost) { bestCost = c; best = population[i]; }
+                gl.observe(secret);
             }
-            // occasional early break if stable
-            if (gen % 80 == 0 && gen>0 && bestCost < 1e-6) break;
+        });
+    }
+
+    if (!jsonPath.empty()) {
+        ofstream o(jsonPath);
+        o << "{\n  \"results\": [\n";
+        for (size_t i=0;i<suite.records.size();++i) {
+            auto &r = suite.records[i];
+            o << "    {\"name\": " << json_string(r.name) << ", \"size\": " << r.size << ", \"threads\": " << r.threads
+              << setprecision(6) << ", \"ns_per_op\": " << r.nsPerOp << ", \"ops_per_sec\": " << r.opsPerSec
+              << ", \"allocs_per_op\": ";
+            if (EUPHORISIM_BENCH_ALLOCS) o << r.allocsPerOp << ", \"bytes_per_op\": " << r.bytesPerOp << "}";
+            else o << "null, \"bytes_per_op\": null}";
+            o << (i + 1 < suite.records.size() ? ",\n" : "\n");
         }
-        return best;
+        o << "  ]\n}\n";
+        if (!o) { cerr << "cannot write " << jsonPath << "\n"; return 1; }
+        cout << "Wrote " << suite.records.size() << " results to " << jsonPath << "\n";
+    }
+    if (baselinePath.empty()) return roadMismatches ? 1 : 0;
+
+    // baseline: the same JSON, one result per line
+    ifstream in(baselinePath);
+    if (!in) { cerr << "cannot open " << baselinePath << "\n"; return 1; }
+    map<tuple<string,long long,int>, double> base;
+    auto field = [](const string &line, const string &key) -> string {
+        size_t p = line.find("\"" + key + "\": ");
+        if (p == string::npos) return "";
+        p += key.size() + 4;
+        if (line[p] == '"') return line.substr(p + 1, line.find('"', p + 1) - p - 1);
+        return line.substr(p, line.find_first_of(",}", p) - p);
+    };
+    for (string line; getline(in, line); )
+        if (!field(line, "name").empty())
+            base[{ field(line, "name"), atoll(field(line, "size").c_str()), atoi(field(line, "threads").c_str()) }] = atof(field(line, "ns_per_op").c_str());
+    int regressions = 0, compared = 0;
+    cout << "\nAgainst " << baselinePath << " (tolerance " << tolerancePct << "%):\n";
+    for (auto &r: suite.records) {
+        auto it = base.find({ r.name, r.size, r.threads });
+        if (it == base.end() || it->second <= 0) continue;
+        double change = (r.nsPerOp / it->second - 1) * 100;
+        bool slower = change > tolerancePct;
+        ++compared; regressions += slower;
+        cout << left << setw(24) << r.name << right << setw(10) << r.size << setw(5) << r.threads << fixed << setprecision(1)
+             << setw(14) << it->second << setw(14) << r.nsPerOp << setw(8) << showpos << change << "%" << noshowpos
+             << (slower ? "  REGRESSION" : change < -tolerancePct ? "  faster" : "") << "\n";
+    }
+    cout << compared << " case(s) compared, " << regressions << " regression(s)\n";
+    return regressions || roadMismatches ? 1 : 0;
+}
+
+// --bench-select: milliseconds per GA generation for each selection strategy as the population grows.
+// Tours are kept short (32 stops) so selection, not crossover, dominates the generation.
+int bench_selection() {
+    Rng mapRng(2024);
+    vector<Point> pts;
+    for (int i=0;i<32;++i) pts.push_back({"p"+to_string(i), mapRng.uniform()*100, mapRng.uniform()*100});
+    const SelectionStrategy strategies[] = { SEL_ROULETTE, SEL_PREFIX, SEL_ALIAS, SEL_TOURNAMENT };
+    cout << "ms per generation (32 stops, 1 island)\n" << setw(8) << "pop";
+    for (auto s: strategies) cout << setw(12) << selection_name(s);
+    cout << "\n";
+    for (int P: {160, 1000, 10000, 100000}) {
+        cout << setw(8) << P;
+        for (auto s: strategies) {
+            if (s == SEL_ROULETTE && P > 10000) { cout << setw(12) << "-"; continue; } // O(pop^2): minutes per generation
+            GA ga(pts, P, 0.85, 0.10, 1, 25, MIGRATE_RING, 99);
+            ga.selection = s;
+            int gens = max(3, 400000 / P);
+            auto t0 = clk::now();
+            ga.run(gens);
+            cout << setw(12) << fixed << setprecision(3) << ms(clk::now() - t0).count() / gens;
+            cout.flush();
+        }
+        cout << "\n";
+    }
+    return 0;
+}
+
+// -------------------- Server Mode --------------------
+// --serve PATH: a long-running daemon on a Unix domain socket, so the catalog, the mood model and
+// the worker threads are set up once instead of per session. Every message either way is a 4-byte
+// little-endian length followed by that many bytes of text; the first line names the request:
+//   MOOD [k]          body: keystroke gaps in ms, whitespace separated
+//                     -> "OK <mood> <gaps used> <mean ms> <stddev ms>", then k "title<TAB>artist" lines
+//   ROUTE [budget_ms] body: one "x y" line per stop, Home first
+//                     -> "OK <cost> <solve ms>", the visiting order as stop indices, the solver name
+//   STATS             -> request counts, p50/p99 latency and batching totals
+// Failures answer "ERR <reason>". Each connection is served in order by its own reader thread, and
+// the work itself runs on a fixed pool. Small routes (the exact solver's range) are not dispatched
+// one by one: they collect for up to a millisecond and are solved as a batch, once per distinct
+// stop set. --load-gen PATH is the matching client.
+const uint32_t kMaxFrame = 16 << 20;
+
+// Log-bucketed latency histogram (4% wide buckets from 1 us to ~150 s); lock-free to record into.
+struct LatencyHistogram {
+    static const int kBuckets = 480;
+    atomic<uint64_t> count[kBuckets]{};
+    atomic<uint64_t> total{0};
+    static int bucket(double us) { return clamp((int)(log(max(us, 1.0)) / log(1.04)), 0, kBuckets-1); }
+    void add(double us) { count[bucket(us)].fetch_add(1, memory_order_relaxed); total.fetch_add(1, memory_order_relaxed); }
+    double percentile_ms(double q) const {
+        uint64_t n = total.load(), want = max<uint64_t>(1, (uint64_t)ceil(q * n)), acc = 0;
+        if (!n) return 0;
+        for (int b=0;b<kBuckets;++b) if ((acc += count[b].load()) >= want) return pow(1.04, b + 0.5) / 1000;
+        return pow(1.04, kBuckets) / 1000;
     }
 };
 
-// -------------------- Virtual Citizen LifeSim --------------------
-struct Citizen {
-    string name;
-    int energy; // 0-100
-    int happiness; // 0-100
-    Mood mood;
-    Citizen(string n="Alex"):name(n),energy(80),happiness(70),mood(MOOD_NEUTRAL){}
-    void apply_event(const string &ev) {
-        if (ev=="exercise") { energy -= 20; happiness += 8; }
-        else if (ev=="work") { energy -= 30; happiness += 4; }
-        else if (ev=="coffee") { energy += 15; happiness += 3; }
-        else if (ev=="relax") { energy += 20; happiness += 6; }
-        else if (ev=="errand") { energy -= 10; happiness -= 2; }
-        energy = clamp(energy, 0, 100);
-        happiness = clamp(happiness, 0, 100);
-    }
-    void integrate_mood(Mood m) {
-        mood = m;
-        if (m==MOOD_CALM) { energy += 5; happiness += 8; }
-        if (m==MOOD_EXCITED) { energy += 15; happiness += 12; }
-        if (m==MOOD_STRESSED) { energy -= 10; happiness -= 12; }
-        energy = clamp(energy, 0, 100);
-        happiness = clamp(happiness, 0, 100);
+// parses the "x y" stop lines of a ROUTE body
+bool parse_stops(const char *p, vector<Point> &stops, string &err) {
+    for (char *end; ; ) {
+        while (isspace((unsigned char)*p)) ++p;
+        if (!*p) break;
+        double x = strtod(p, &end);
+        if (end == p) { err = "stop " + to_string(stops.size()) + ": expected 'x y'"; return false; }
+        p = end;
+        double y = strtod(p, &end);
+        if (end == p) { err = "stop " + to_string(stops.size()) + ": expected 'x y'"; return false; }
+        p = end;
+        stops.push_back({ to_string(stops.size()), x, y });
+    }
+    if (stops.size() < 2) { err = "a route needs at least 2 stops"; return false; }
+    return true;
+}
+string route_reply(const RoutePlan &plan) {
+    char head[64];
+    snprintf(head, sizeof head, "OK %.3f %.3f\n", plan.cost, plan.elapsedMs);
+    string r = head;
+    for (size_t i=0;i<plan.tour.size();++i) { if (i) r += ' '; r += to_string(plan.tour[i]); }
+    return r + "\n" + solver_name(plan.solver) + "\n";
+}
+// the gaps become a typed line and are classified like one in --batch: by the --mood-model when one
+// is loaded (the body carries no key codes, so digraph and correction features see none), by the
+// infer_mood thresholds otherwise
+string serve_mood(const char *p, int k) {
+    thread_local vector<KeyEvent> ev;
+    ev.assign(1, { 0, 0 });
+    for (char *end; ; p = end) {
+        double d = strtod(p, &end);
+        if (end == p) break;
+        ev.push_back({ ev.back().ns + (int64_t)llround(clamp(d, -1e9, 1e9) * 1e6), 0 });
+    }
+    while (isspace((unsigned char)*p)) ++p;
+    if (*p) return "ERR MOOD body must be gap lengths in ms\n";
+    Welford w = gap_stats(ev.data(), ev.size());
+    if (!w.n) return "ERR no usable gaps (10-2000 ms)\n";
+    Mood m = classify_mood(ev.data(), ev.size(), w);
+    // songs are drawn from the session seed and the gaps themselves, so a request gets the same
+    // answer whichever worker serves it, and again in a server started with the same --seed
+    uint64_t x = g_seed ^ (STREAM_MUSIC * 0xD1B54A32D192ED03ull);
+    for (auto &e: ev) { x ^= (uint64_t)e.ns; splitmix64(x); }
+    Rng rng(splitmix64(x));
+    char head[96];
+    snprintf(head, sizeof head, "OK %s %lld %.1f %.1f\n", mood_name(m).c_str(), w.n, w.mean, w.stddev());
+    string r = head;
+    for (auto &s: recommend_for(mood_target(w.mean, w.stddev()), m, k, rng)) r += s.title + "\t" + s.artist + "\n";
+    return r;
+}
+
+// Collects small route jobs from all connections and hands them to the pool in batches: a batch
+// closes a window after its first job or at kMaxBatch jobs, and identical stop sets in it (same
+// coordinates, same budget) are solved once.
+struct RouteBatcher {
+    static const int kMaxStops = 12; // larger routes go to the pool individually
+    static const int kMaxBatch = 64;
+    struct Job { vector<Point> stops; double budgetMs; shared_ptr<promise<string>> reply; };
+    ThreadPool &pool;
+    double windowMs;
+    mutex mu;
+    condition_variable cv;
+    vector<Job> pending;
+    bool stopping = false;
+    int running = 0; // batches handed to the pool and not finished; guarded by mu
+    atomic<long long> batches{0}, jobs{0}, solves{0};
+    thread th;
+
+    RouteBatcher(ThreadPool &p, double window) : pool(p), windowMs(window), th([this] { loop(); }) {}
+    // waits for batches still solving on the pool, which use `this` until they finish
+    ~RouteBatcher() {
+        { lock_guard<mutex> lk(mu); stopping = true; }
+        cv.notify_all();
+        th.join();
+        unique_lock<mutex> lk(mu);
+        cv.wait(lk, [&] { return running == 0; });
+    }
+    void add(Job j) {
+        lock_guard<mutex> lk(mu);
+        pending.push_back(move(j));
+        if (pending.size() == 1 || pending.size() >= kMaxBatch) cv.notify_all();
+    }
+    void loop() {
+        unique_lock<mutex> lk(mu);
+        for (;;) {
+            cv.wait(lk, [&] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            auto close = steady::now() + chrono::duration_cast<steady::duration>(ms(windowMs));
+            cv.wait_until(lk, close, [&] { return stopping || pending.size() >= kMaxBatch; });
+            auto batch = make_shared<vector<Job>>();
+            batch->swap(pending);
+            ++running;
+            lk.unlock();
+            ++batches; jobs += batch->size();
+            pool.submit([this, batch] {
+                solve(*batch);
+                lock_guard<mutex> done(mu); // notified under the lock, so the destructor cannot finish first
+                --running;
+                cv.notify_all();
+            });
+            lk.lock();
+        }
+    }
+    static bool same_route(const Job &a, const Job &b) {
+        return a.budgetMs == b.budgetMs && equal(a.stops.begin(), a.stops.end(), b.stops.begin(), b.stops.end(),
+                                                 [](const Point &p, const Point &q) { return p.x == q.x && p.y == q.y; });
+    }
+    // the batch's distinct stop sets are solved side by side on the shared worker pool, then every
+    // job is answered from its stop set's solution
+    void solve(vector<Job> &batch) {
+        TRACE_SCOPE("serve.route_batch");
+        unordered_multimap<uint64_t, int> slot; // hash -> index into distinct; hashes may collide
+        vector<int> distinct, owner(batch.size());
+        for (size_t i=0;i<batch.size();++i) {
+            uint64_t bits;
+            memcpy(&bits, &batch[i].budgetMs, 8);
+            uint64_t h = map_hash(batch[i].stops, bits);
+            auto [it, end] = slot.equal_range(h);
+            while (it != end && !same_route(batch[distinct[it->second]], batch[i])) ++it;
+            if (it == end) { slot.emplace(h, (int)distinct.size()); owner[i] = distinct.size(); distinct.push_back(i); }
+            else owner[i] = it->second;
+        }
+        vector<string> replies(distinct.size());
+        worker_pool().parallel_for(distinct.size(), [&](int d) {
+            const Job &j = batch[distinct[d]];
+            replies[d] = route_reply(plan_route(j.stops, j.budgetMs));
+        });
+        solves += distinct.size();
+        for (size_t i=0;i<batch.size();++i) batch[i].reply->set_value(replies[owner[i]]);
     }
 };
 
-// -------------------- Self-learning Guessing Game --------------------
-struct GuessLearner {
-    // track frequency distribution of user's guesses (1..100)
-    vector<int> freq;
-    int rounds;
-    GuessLearner():freq(101,1),rounds(0){} // laplace smoothing
-    void update_with_user_guess(int guess) {
-        if (guess>=1 && guess<=100) freq[guess] += 1;
-        rounds++;
+enum RequestKind { REQ_MOOD, REQ_ROUTE, REQ_OTHER, kRequestKinds };
+const char* request_kind_name(int k) { return k == REQ_MOOD ? "mood" : k == REQ_ROUTE ? "route" : "other"; }
+
+#ifndef _WIN32
+bool read_full(int fd, void *buf, size_t n) {
+    for (char *p = (char*)buf; n; ) {
+        ssize_t r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r;
     }
-    // produce a guess distribution weighted by user's past guesses but add exploration
-    int make_guess() {
-        // compute weighted choice: user often guesses some numbers; we can try to place target where user less often guesses to force their adaptation
-        // Here we implement a simple strategy: choose numbers near user's high-frequency guesses but sometimes explore.
-        int total = 0; for (int i=1;i<=100;++i) total += freq[i];
-        double r = rand01();
-        if (r < 0.7) {
-            // exploit: sample from freq distribution but take mode +/- small perturbation
-            int mode=1; for (int i=1;i<=100;++i) if (freq[i] > freq[mode]) mode = i;
-            int delta = randint(-6,6);
-            int g = clamp(mode + delta, 1, 100);
-            return g;
+    return true;
+}
+bool write_full(int fd, const void *buf, size_t n) {
+    for (const char *p = (const char*)buf; n; ) {
+        ssize_t r = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r;
+    }
+    return true;
+}
+bool read_frame(int fd, string &msg) {
+    unsigned char len[4];
+    if (!read_full(fd, len, 4)) return false;
+    uint32_t n = len[0] | len[1] << 8 | len[2] << 16 | (uint32_t)len[3] << 24;
+    if (n > kMaxFrame) return false;
+    msg.resize(n);
+    return read_full(fd, &msg[0], n);
+}
+bool write_frame(int fd, const string &msg) {
+    uint32_t n = msg.size();
+    unsigned char len[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)(n >> 16), (unsigned char)(n >> 24) };
+    return write_full(fd, len, 4) && write_full(fd, msg.data(), n);
+}
+sockaddr_un unix_address(const string &path, string &err) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) err = "socket path too long: " + path;
+    else memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+volatile sig_atomic_t g_serverStop = 0;
+
+struct Server {
+    ThreadPool pool;
+    RouteBatcher batcher;
+    LatencyHistogram latency[kRequestKinds];
+    atomic<long long> errors{0};
+    steady::time_point started = steady::now();
+    mutex connMu;
+    vector<int> connFds;
+    unordered_map<thread::id, thread> connThreads; // one reader per open connection
+    vector<thread::id> finished;                    // readers done serving, not yet joined
+
+    Server(int workers, double batchWindowMs) : pool(workers), batcher(pool, batchWindowMs) {}
+
+    string stats() const {
+        ostringstream o;
+        o << fixed << setprecision(3);
+        double up = chrono::duration<double>(steady::now() - started).count();
+        for (int k=0;k<kRequestKinds;++k) {
+            uint64_t n = latency[k].total;
+            if (!n) continue;
+            o << request_kind_name(k) << ": " << n << " served, p50 " << latency[k].percentile_ms(0.5) << " ms, p99 "
+              << latency[k].percentile_ms(0.99) << " ms\n";
+        }
+        o << "route batches: " << batcher.batches << " (" << batcher.jobs << " small routes, " << batcher.solves << " solved)\n";
+        o << "errors: " << errors << ", uptime " << setprecision(1) << up << " s\n";
+        return o.str();
+    }
+    // runs one request to completion (on the pool, or the batcher for small routes)
+    string handle(const string &msg, int &kind) {
+        size_t eol = msg.find('\n');
+        string head = msg.substr(0, eol);
+        const char *body = eol == string::npos ? "" : msg.c_str() + eol + 1;
+        istringstream hs(head);
+        string verb;
+        hs >> verb;
+        kind = verb == "MOOD" ? REQ_MOOD : verb == "ROUTE" ? REQ_ROUTE : REQ_OTHER;
+        if (verb == "STATS") return "OK\n" + stats();
+        auto reply = make_shared<promise<string>>();
+        future<string> res = reply->get_future();
+        if (kind == REQ_MOOD) {
+            int k = 3;
+            hs >> k;
+            k = clamp(k, 1, 50);
+            pool.submit([reply, body, k] { reply->set_value(serve_mood(body, k)); });
+        } else if (kind == REQ_ROUTE) {
+            double budget = 50;
+            hs >> budget;
+            budget = clamp(budget, 0.1, 10000.0);
+            RouteBatcher::Job job{ {}, budget, reply };
+            string err;
+            if (!parse_stops(body, job.stops, err)) return "ERR " + err + "\n";
+            if (job.stops.size() > 10000) return "ERR at most 10000 stops\n";
+            if ((int)job.stops.size() <= RouteBatcher::kMaxStops) batcher.add(move(job));
+            else pool.submit([job = move(job)] { job.reply->set_value(route_reply(plan_route(job.stops, job.budgetMs))); });
         } else {
-            return randint(1,100);
+            return "ERR unknown request '" + verb + "'\n";
+        }
+        return res.get(); // msg (and so body) outlives the job
+    }
+    void serve_connection(int fd) {
+        for (string msg; read_frame(fd, msg); ) {
+            auto t0 = steady::now();
+            int kind;
+            string out = handle(msg, kind);
+            if (out.compare(0, 3, "ERR") == 0) ++errors;
+            latency[kind].add(chrono::duration<double, micro>(steady::now() - t0).count());
+            if (!write_frame(fd, out)) break;
+        }
+        lock_guard<mutex> lk(connMu);
+        connFds.erase(find(connFds.begin(), connFds.end(), fd));
+        ::close(fd);
+        finished.push_back(this_thread::get_id());
+    }
+    void accept_connection(int fd) {
+        lock_guard<mutex> lk(connMu);
+        connFds.push_back(fd);
+        thread t([this, fd] { serve_connection(fd); });
+        thread::id id = t.get_id();
+        connThreads.emplace(id, move(t)); // the reader cannot reach `finished` before this, it needs connMu
+    }
+    // joins the readers of connections that have closed, so a long-running server holds threads
+    // only for the connections still open
+    void reap_connections() {
+        vector<thread> done;
+        {
+            lock_guard<mutex> lk(connMu);
+            for (thread::id id: finished) {
+                auto it = connThreads.find(id);
+                done.push_back(move(it->second));
+                connThreads.erase(it);
+            }
+            finished.clear();
         }
+        for (auto &t: done) t.join();
+    }
+};
+
+int run_server(const string &path, int workers, double batchWindowMs) {
+    string err;
+    sockaddr_un addr = unix_address(path, err);
+    if (!err.empty()) { cerr << err << "\n"; return 1; }
+    // a socket left by an earlier server is replaced; anything else at the path is not ours to delete
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) { cerr << "cannot listen on " << path << ": exists and is not a socket\n"; return 1; }
+        ::unlink(path.c_str());
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (sockaddr*)&addr, sizeof addr) != 0 || listen(lfd, 128) != 0) {
+        cerr << "cannot listen on " << path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    signal(SIGINT, [](int) { g_serverStop = 1; });
+    signal(SIGTERM, [](int) { g_serverStop = 1; });
+    song_catalog(); // load once before the workers share it
+    auto srv = make_unique<Server>(workers, batchWindowMs);
+    cerr << "Serving on " << path << " with " << workers << " worker(s); Ctrl-C to stop\n";
+    while (!g_serverStop) {
+        srv->reap_connections();
+        pollfd p{ lfd, POLLIN, 0 };
+        if (poll(&p, 1, 200) <= 0) continue;
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd >= 0) srv->accept_connection(fd);
+    }
+    ::close(lfd);
+    ::unlink(path.c_str());
+    {
+        lock_guard<mutex> lk(srv->connMu);
+        for (int fd: srv->connFds) shutdown(fd, SHUT_RDWR); // wakes readers; requests in flight still finish
+    }
+    for (auto &[id, t]: srv->connThreads) t.join(); // no new readers start now; the map is stable
+    cerr << "\n" << srv->stats();
+    return 0;
+}
+
+// --load-gen PATH: `concurrency` connections issue `requests` requests in total, synchronously,
+// and report throughput and client-side latency. Routes are drawn from a fixed set of 32 stop sets
+// so the server's batching has repeats to merge; with --route-stops above 12 they bypass the batcher.
+int run_load_gen(const string &path, long long requests, int concurrency, const string &mix, int routeStops) {
+    string err;
+    sockaddr_un addr = unix_address(path, err);
+    if (!err.empty()) { cerr << err << "\n"; return 1; }
+    double moodShare = mix == "mood" ? 1 : mix == "route" ? 0 : 0.7;
+    Rng rng(g_seed);
+    vector<string> routes;
+    for (int r=0;r<32;++r) {
+        string msg = "ROUTE 20\n";
+        for (auto &p: bench_map(max(2, routeStops), rng)) msg += to_string(p.x) + " " + to_string(p.y) + "\n";
+        routes.push_back(msg);
+    }
+    LatencyHistogram latency[kRequestKinds];
+    atomic<long long> next{0}, failed{0};
+    vector<Rng> clientRng;
+    for (int c=0;c<concurrency;++c) clientRng.push_back(rng.split());
+    auto t0 = steady::now();
+    vector<thread> clients;
+    for (int c=0;c<concurrency;++c) clients.emplace_back([&, c] {
+        Rng &r = clientRng[c];
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof addr) != 0) {
+            if (fd >= 0) ::close(fd);
+            failed += 1;
+            return;
+        }
+        string msg, reply;
+        while (next++ < requests) {
+            int kind = r.uniform() < moodShare ? REQ_MOOD : REQ_ROUTE;
+            if (kind == REQ_MOOD) {
+                msg = "MOOD 3\n";
+                for (double g: bench_intervals(40, r)) msg += to_string((int)g) + " ";
+            } else {
+                msg = routes[r.bounded(routes.size())];
+            }
+            auto s = steady::now();
+            if (!write_frame(fd, msg) || !read_frame(fd, reply)) { failed += 1; break; }
+            latency[kind].add(chrono::duration<double, micro>(steady::now() - s).count());
+            if (reply.compare(0, 2, "OK") != 0) failed += 1;
+        }
+        ::close(fd);
+    });
+    for (auto &t: clients) t.join();
+    double sec = chrono::duration<double>(steady::now() - t0).count();
+    uint64_t done = 0;
+    cout << fixed << setprecision(3);
+    for (int k=0;k<kRequestKinds;++k) {
+        uint64_t n = latency[k].total;
+        done += n;
+        if (n) cout << request_kind_name(k) << ": " << n << " requests, p50 " << latency[k].percentile_ms(0.5) << " ms, p99 "
+                    << latency[k].percentile_ms(0.99) << " ms\n";
+    }
+    cout << done << " requests in " << sec << " s over " << concurrency << " connection(s) (" << setprecision(0)
+         << done / max(sec, 1e-9) << " req/s), " << failed << " failed\n";
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    string reply;
+    if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof addr) == 0 && write_frame(fd, "STATS\n") && read_frame(fd, reply))
+        cout << "Server " << reply.substr(3);
+    if (fd >= 0) ::close(fd);
+    return failed ? 1 : 0;
+}
+#else
+int run_server(const string &, int, double) { cerr << "--serve needs Unix domain sockets\n"; return 1; }
+int run_load_gen(const string &, long long, int, const string &, int) { cerr << "--load-gen needs Unix domain sockets\n"; return 1; }
+#endif
+
+// -------------------- Self-Test --------------------
+// --self-test: checks the fast paths against slow, obviously-right references on small inputs
+// (Held-Karp vs brute force, the hierarchy vs Dijkstra, the P-square estimates vs sorted data, ...)
+// and the loaders against corrupt files. Fixed inputs, independent of --seed; exits 1 on a failure.
+struct SelfTest {
+    int checks = 0, failures = 0;
+    void check(const string &name, bool ok, const string &detail) {
+        ++checks;
+        if (!ok) ++failures;
+        cout << (ok ? "  ok    " : "  FAIL  ") << name << ": " << detail << "\n";
+        cout.flush();
     }
 };
 
+void self_test_routes(SelfTest &st, Rng &rng) {
+    // Held-Karp against every tour that starts at Home
+    int maps = 0, wrong = 0;
+    for (int n=2; n<=8; ++n)
+        for (int trial=0; trial<20; ++trial, ++maps) {
+            vector<double> D = distance_matrix(CoordStore(bench_map(n, rng)));
+            auto cycle = [&](const vector<int> &t) {
+                double c = 0;
+                for (int i=0;i<n;++i) c += D[t[i]*n + t[(i+1)%n]];
+                return c;
+            };
+            vector<int> t(n);
+            iota(t.begin(), t.end(), 0);
+            double brute = numeric_limits<double>::infinity();
+            do brute = min(brute, cycle(t)); while (next_permutation(t.begin()+1, t.end()));
+            vector<int> hk = held_karp(D, n), sorted = hk;
+            sort(sorted.begin(), sorted.end());
+            bool perm = hk[0] == 0 && sorted == t;
+            if (!perm || fabs(cycle(hk) - brute) > 1e-9 * max(1.0, brute)) ++wrong;
+        }
+    st.check("route.held_karp", !wrong, to_string(maps - wrong) + "/" + to_string(maps) + " maps of 2..8 stops match brute force");
+}
+
+void self_test_roads(SelfTest &st, Rng &rng, const string &dir) {
+    auto agree = [](const vector<double> &a, const vector<double> &b) {
+        int bad = a.size() != b.size();
+        for (size_t i=0; !bad && i<a.size(); ++i) bad += fabs(a[i] - b[i]) > 1e-3 * max(1.0, b[i]);
+        return !bad;
+    };
+    RoadGraph g = bench_roads(20, rng);
+    ContractionHierarchy ch;
+    ch.build(g);
+    vector<int> nodes(60);
+    for (int &v: nodes) v = rng.bounded(g.n);
+    vector<double> viaCh = ch.matrix(nodes);
+    st.check("roads.ch_matrix", agree(viaCh, road_matrix_dijkstra(g, nodes)), "60-stop matrix on a 20x20 grid matches Dijkstra");
+
+    // two components: pairs across them must come out unreachable from both
+    string graphPath = dir + "/split.roads";
+    { ofstream(graphPath) << "# two islands\ne 0 1 5\ne 1 2 7.5\ne 0 2 20\ne 3 4 2\nv 0 0 0\nv 4 9 9\n"; }
+    RoadGraph split;
+    string err;
+    bool loaded = load_road_graph(graphPath, split, err);
+    ContractionHierarchy chSplit;
+    vector<int> ends = { 0, 2, 3, 4 };
+    vector<double> m;
+    if (loaded) { chSplit.build(split); m = chSplit.matrix(ends); }
+    st.check("roads.unreachable", loaded && agree(m, road_matrix_dijkstra(split, ends)) && m[1] == 12.5 && m[2] == kUnreachable,
+             loaded ? "disconnected graph matches Dijkstra, cross pairs unreachable" : err);
+    { ofstream(graphPath) << "e 0 1 5\ne 1 2 -3\n"; }
+    st.check("roads.negative_cost", !load_road_graph(graphPath, split, err), "graph with a negative cost rejected");
+
+    // a saved hierarchy reloads for its own graph only, and never from a damaged file
+    string chPath = dir + "/grid.ch";
+    bool saved = ch.save(chPath, 42);
+    ContractionHierarchy back;
+    bool same = saved && back.load(chPath, 42, g.n) && back.matrix(nodes) == viaCh;
+    bool otherGraph = !back.load(chPath, 43, g.n) && !back.load(chPath, 42, g.n + 1);
+    filesystem::resize_file(chPath, filesystem::file_size(chPath) - 4);
+    bool truncated = !back.load(chPath, 42, g.n) && back.n == 0;
+    st.check("roads.ch_file", same && otherGraph && truncated, "hierarchy round-trips; wrong fingerprint, node count and truncation rejected");
+}
+
+void self_test_catalog(SelfTest &st, Rng &rng) {
+    vector<Song> songs = bench_songs(3000, rng);
+    vector<char> buf = build_catalog(songs, true);
+    SongCatalog cat;
+    string err;
+    bool same = cat.adopt(buf, err) && cat.verify(err) && cat.size() == (int)songs.size();
+    for (int t=0; same && t<cat.size(); ++t) {
+        Song s = cat.song(t);
+        same = s.title == songs[t].title && s.artist == songs[t].artist && s.vibe == songs[t].vibe && s.feat == songs[t].feat;
+    }
+    // the index must find a stored track from its own features
+    int found = 0;
+    for (int i=0; same && i<50; ++i) {
+        int t = rng.bounded(cat.size());
+        auto hits = cat.nearest(songs[t].feat, 1, [&](string_view v) { return v == songs[t].vibe; });
+        found += !hits.empty() && hits[0].first == 0;
+    }
+    st.check("catalog.round_trip", same && found == 50, same ? "3000 tracks read back; " + to_string(found) + "/50 found by their own features" : err);
+
+    // damaged copies: open() must refuse anything a query could read out of bounds through,
+    // verify() whatever is left
+    CatalogHeader h;
+    memcpy(&h, buf.data(), sizeof h);
+    auto patched = [&](size_t off, auto v) { vector<char> b = buf; memcpy(b.data() + off, &v, sizeof v); return b; };
+    vector<char> truncated(buf.begin(), buf.begin() + buf.size() / 2), stub(buf.begin(), buf.begin() + sizeof h - 1);
+    struct Case { const char *what; vector<char> b; };
+    vector<Case> refused = {
+        { "short header", stub },
+        { "truncated file", truncated },
+        { "bad magic", patched(offsetof(CatalogHeader, magic), (uint32_t)0x12345678) },
+        { "future version", patched(offsetof(CatalogHeader, version), SongCatalog::kVersion + 1) },
+        { "huge track count", patched(offsetof(CatalogHeader, nTracks), (uint32_t)0xFFFFFFFF) },
+        { "huge upper-link count", patched(offsetof(CatalogHeader, upperLen), (uint64_t)-1) },
+        { "misaligned section", patched(offsetof(CatalogHeader, postingsOff), h.postingsOff + 1) },
+        { "posting range past the end", patched(h.postStartOff + 4 * h.nVibes, h.nTracks + 1) },
+        { "entry point out of range", patched(h.entryOff, h.nTracks) },
+    };
+    int refusedOk = 0;
+    string missed;
+    for (auto &c: refused) {
+        if (!cat.adopt(c.b, err)) ++refusedOk;
+        else missed += string(" ") + c.what + ";";
+    }
+    st.check("catalog.corrupt_header", refusedOk == (int)refused.size(), to_string(refusedOk) + "/" + to_string(refused.size()) + " damaged headers refused" + (missed.empty() ? "" : "; accepted:" + missed));
+    bool postingCaught = cat.adopt(patched(h.postingsOff, h.nTracks), err) && !cat.verify(err);
+    uint32_t badLink = h.nTracks + 7;
+    bool linkCaught = cat.adopt(patched(h.level0Off, badLink), err) && !cat.verify(err);
+    st.check("catalog.verify", postingCaught && linkCaught, "posting and index link out of range found by verify");
+}
+
+void self_test_models(SelfTest &st, const string &dir) {
+    string path = dir + "/model.txt";
+    auto vec = [](float v) { string s; for (int j=0;j<kMoodFeatures;++j) s += to_string(v) + " "; return s + "\n"; };
+    // header for a model of this kind with nf features, unit standardization
+    auto header = [&](const string &kind, int nf) { return "mood-model 1 " + kind + " " + to_string(nf) + "\n" + vec(0) + vec(1); };
+    auto leaf = [&]() { string s = "-1 0 0 0"; for (int c=0;c<kMoods;++c) s += c ? " 0" : " 1"; return s + "\n"; };
+    auto split = [&](int feature, int left, int right) {
+        string s = to_string(feature) + " 0.5 " + to_string(left) + " " + to_string(right);
+        for (int c=0;c<kMoods;++c) s += " 0";
+        return s + "\n";
+    };
+    string rows;
+    for (int i=0;i<3;++i) rows += to_string(i) + " " + vec((float)i);
+    string forest = header("forest", kMoodFeatures) + "trees 1\ntree 3\n" + split(0, 1, 2) + leaf() + leaf();
+    auto loads = [&](const string &text) {
+        { ofstream(path) << text; }
+        MoodModel m;
+        string err;
+        return m.load(path, err);
+    };
+
+    bool good = loads(header("knn", kMoodFeatures) + "knn 2 3\n" + rows) && loads(forest);
+    // a saved model reads back as the same classifier
+    MoodModel knn;
+    knn.kind = MODEL_KNN; knn.k = 1;
+    for (int j=0;j<kMoodFeatures;++j) knn.mu[j] = 0, knn.sd[j] = 1;
+    for (int i=0;i<kMoods;++i) { knn.labels.push_back(i); for (int j=0;j<kMoodFeatures;++j) knn.points.push_back((float)i); }
+    MoodModel back;
+    string err;
+    bool roundTrip = knn.save(path) && back.load(path, err) && back.kind == MODEL_KNN && back.k == 1
+                  && back.labels == knn.labels && back.points == knn.points;
+    for (int i=0; roundTrip && i<kMoods; ++i) {
+        float x[kMoodFeatures];
+        fill(x, x + kMoodFeatures, i + 0.1f);
+        Mood a, b;
+        knn.classify(x, 1, &a); back.classify(x, 1, &b);
+        roundTrip = a == b && a == (Mood)i;
+    }
+    st.check("model.load", good && roundTrip, "knn and forest models load; a saved knn model classifies the same after reload");
+
+    struct Case { const char *what; string text; };
+    vector<Case> bad = {
+        { "not a model", "hello\n" },
+        { "wrong feature count", header("knn", kMoodFeatures + 1) + "knn 2 3\n" + rows },
+        { "unknown kind", header("svm", kMoodFeatures) },
+        { "knn k = 0", header("knn", kMoodFeatures) + "knn 0 3\n" + rows },
+        { "knn k above the rows", header("knn", kMoodFeatures) + "knn 4 3\n" + rows },
+        { "knn tag", header("knn", kMoodFeatures) + "kmm 2 3\n" + rows },
+        { "knn rows truncated", header("knn", kMoodFeatures) + "knn 2 4\n" + rows },
+        { "no trees", header("forest", kMoodFeatures) + "trees 0\n" },
+        { "trees tag", header("forest", kMoodFeatures) + "forest 1\ntree 1\n" + leaf() },
+        { "tree tag", header("forest", kMoodFeatures) + "trees 1\ntrie 1\n" + leaf() },
+        { "tree cycle", header("forest", kMoodFeatures) + "trees 1\ntree 3\n" + split(0, 0, 2) + leaf() + leaf() },
+        { "child out of range", header("forest", kMoodFeatures) + "trees 1\ntree 3\n" + split(0, 1, 3) + leaf() + leaf() },
+        { "split on a missing feature", header("forest", kMoodFeatures) + "trees 1\ntree 3\n" + split(kMoodFeatures, 1, 2) + leaf() + leaf() },
+        { "empty tree", header("forest", kMoodFeatures) + "trees 1\ntree 0\n" },
+        { "forest truncated", forest.substr(0, forest.size() - leaf().size()) },
+    };
+    int rejected = 0;
+    string missed;
+    for (auto &c: bad) {
+        if (!loads(c.text)) ++rejected;
+        else missed += string(" ") + c.what + ";";
+    }
+    st.check("model.reject", rejected == (int)bad.size(), to_string(rejected) + "/" + to_string(bad.size()) + " malformed models rejected" + (missed.empty() ? "" : "; accepted:" + missed));
+}
+
+void self_test_stats(SelfTest &st, Rng &rng) {
+    // P-square: each estimate must sit within one percentile of the exact rank
+    const int n = 100000;
+    const double ps[] = { 0.05, 0.5, 0.9, 0.99 };
+    const char *dists[] = { "uniform", "exponential", "bimodal" };
+    double worst = 0;
+    for (int d=0; d<3; ++d) {
+        vector<double> xs(n);
+        for (double &x: xs) {
+            double u = rng.uniform();
+            x = d == 0 ? u : d == 1 ? -log(1 - u) : (rng.uniform() < 0.7 ? 100 : 400) + 30 * u;
+        }
+        vector<double> sorted = xs;
+        sort(sorted.begin(), sorted.end());
+        for (double p: ps) {
+            P2Quantile q(p);
+            for (double x: xs) q.add(x);
+            double rank = (double)(lower_bound(sorted.begin(), sorted.end(), q.value()) - sorted.begin()) / n;
+            worst = max(worst, fabs(rank - p));
+        }
+    }
+    ostringstream os;
+    os << "p5/p50/p90/p99 of " << size(dists) << " distributions ranked within " << setprecision(2) << worst * 100 << "% of exact";
+    st.check("stats.p2_quantile", worst <= 0.01, os.str());
+
+    // Fenwick counts against a plain array
+    const int N = 1000;
+    FenwickCounts f(N, 1);
+    vector<uint64_t> naive(N + 1, 1);
+    naive[0] = 0;
+    for (int k=0;k<5000;++k) { int i = rng.range(1, N); uint32_t d = rng.bounded(5); f.add(i, d); naive[i] += d; }
+    vector<uint64_t> pre(N + 1, 0);
+    for (int i=1;i<=N;++i) pre[i] = pre[i-1] + naive[i];
+    int bad = 0;
+    for (int i=1;i<=N;++i) bad += f.prefix(i) != pre[i] || f.count(i) != naive[i];
+    for (int k=0;k<2000;++k) {
+        uint64_t target = (uint64_t)(rng.uniform() * pre[N]);
+        bad += f.search(target) != upper_bound(pre.begin(), pre.end(), target) - pre.begin();
+    }
+    st.check("stats.fenwick", !bad, "prefix, count and search match a plain array over 1..1000");
+
+    // selection draws land in proportion to fitness, whichever table drives them
+    GA ga(bench_map(30, rng), 64, 0.8, 0.1, 1, 25, MIGRATE_RING, 1);
+    auto &isl = ga.isl[0];
+    for (double &w: isl.fitness) w = 0.01 + pow(rng.uniform(), 3);
+    const int draws = 64 * 20000;
+    double worstShare = 0;
+    for (SelectionStrategy s: { SEL_ROULETTE, SEL_PREFIX, SEL_ALIAS }) {
+        ga.selection = s;
+        isl.prepare_selection();
+        vector<int> hits(ga.popSize);
+        for (int k=0;k<draws;++k) ++hits[isl.select()];
+        for (int i=0;i<ga.popSize;++i) worstShare = max(worstShare, fabs((double)hits[i] / draws - isl.fitness[i] / isl.totalFitness));
+    }
+    os.str("");
+    os << "roulette, prefix and alias draws within " << setprecision(2) << worstShare * 100 << "% of each fitness share";
+    st.check("ga.selection", worstShare < 1e-3, os.str());
+}
+
+void self_test_ring(SelfTest &st) {
+    auto ring = make_unique<SpscRing<uint32_t, 1024>>();
+    const uint32_t n = 1000000;
+    thread producer([&] {
+        for (uint32_t i=0;i<n;++i) while (!ring->push(i)) this_thread::yield();
+    });
+    uint32_t next = 0, v;
+    bool ordered = true;
+    while (next < n) {
+        if (!ring->pop(v)) { this_thread::yield(); continue; }
+        ordered &= v == next++;
+    }
+    producer.join();
+    st.check("ring.spsc", ordered && !ring->pop(v), "1M values through a 1024-slot ring, in order, across two threads");
+}
+
+int run_self_test() {
+    Rng rng(20240611);
+    string dir = (filesystem::temp_directory_path() / ("euphorisim-selftest-" + to_string(getpid()))).string();
+    filesystem::create_directories(dir);
+    SelfTest st;
+    cout << "Self-test\n";
+    self_test_routes(st, rng);
+    self_test_roads(st, rng, dir);
+    self_test_catalog(st, rng);
+    self_test_models(st, dir);
+    self_test_stats(st, rng);
+    self_test_ring(st);
+    error_code ec;
+    filesystem::remove_all(dir, ec);
+    cout << st.checks - st.failures << "/" << st.checks << " checks passed\n";
+    return st.failures ? 1 : 0;
+}
+
 // -------------------- Main Application Flow --------------------
-int main(){
+int main(int argc, char **argv){
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
-    srand((unsigned)time(nullptr));
+    g_seed = ((uint64_t)random_device{}() << 32) ^ (uint64_t)time(nullptr);
+    string roadsPath; // --roads: price routes on a road graph instead of straight lines
+    string routeCachePath = "route_cache.bin"; // --route-cache: solved routes persist here ("" disables)
+    string catalogPath; // --catalog: binary song catalog (see --build-catalog); built-in library otherwise
+    string replayKeys, recordKeys; // --replay-keys / --record-keys: key log to type from / to save typing to
+    bool watch = false; // --watch: continuous mood tracking instead of the interactive session
+    bool batch = false; // --batch: score key logs (the remaining arguments) and exit
+    long long cityCitizens = 0; int cityDays = 7; // --city N [--days D]: population-scale LifeSim
+    long long selfplayRounds = 0; // --selfplay ROUNDS: pit the guessing strategies against scripted players
+    int guessRange = 100; // --guess-range N: the guessing game's numbers are 1..N
+    double refineMs = 5000; // --refine-ms: background GA refinement budget for the interactive route; inert
+                            // on the built-in 5-place map, whose routes are always solved exactly
+    string tracePrefix; // --trace PREFIX: phase timings and GA telemetry, written to PREFIX.* at exit
+    string servePath, loadGenPath; // --serve PATH: daemon on a Unix socket; --load-gen PATH: drive one
+    int serveWorkers = max(1u, thread::hardware_concurrency()); // --serve-workers N
+    double batchWindowMs = 1; // --batch-window MS: how long small routes collect before a batch is solved
+    long long loadRequests = 10000; int loadConcurrency = 8, loadRouteStops = 8; // --requests, --concurrency, --route-stops
+    string loadMix = "mixed"; // --mix mood|route|mixed
+    bool bench = false; // --bench: the benchmark suite (--bench-filter, --bench-time MS, --bench-json, --bench-baseline, --bench-tolerance PCT)
+    string benchFilter, benchJson, benchBaseline;
+    double benchMs = 200, benchTolerance = 10;
+    string rulesPath = "life_rules.txt"; // --rules: place events and mood effects
+    string moodModelPath, trainOut; // --mood-model: classifier weights; --train-mood OUT: fit one from a manifest
+    ModelKind modelKind = MODEL_LOGISTIC; // --model logistic|forest|knn (for --train-mood)
+    BatchFormat batchFormat = BATCH_CSV; // --format csv|jsonl
+    vector<string> batchFiles;
+    for (int i=1;i<argc;++i) {
+        string a = argv[i];
+        if (a == "--seed" && i+1 < argc) g_seed = strtoull(argv[++i], nullptr, 10);
+        else if (a == "--roads" && i+1 < argc) roadsPath = argv[++i];
+        else if (a == "--route-cache" && i+1 < argc) routeCachePath = argv[++i];
+        else if (a == "--catalog" && i+1 < argc) catalogPath = argv[++i];
+        else if (a == "--build-catalog" && i+2 < argc) return build_catalog_file(argv[i+1], argv[i+2]);
+        else if (a == "--verify-catalog" && i+1 < argc) return verify_catalog_file(argv[i+1]);
+        else if (a == "--self-test") return run_self_test();
+        else if (a == "--watch") watch = true;
+        else if (a == "--replay-keys" && i+1 < argc) replayKeys = argv[++i];
+        else if (a == "--record-keys" && i+1 < argc) recordKeys = argv[++i];
+        else if (a == "--bench-select") return bench_selection();
+        else if (a == "--bench") bench = true;
+        else if (a == "--trace" && i+1 < argc) tracePrefix = argv[++i];
+        else if (a == "--refine-ms" && i+1 < argc) refineMs = max(1.0, atof(argv[++i]));
+        else if (a == "--serve" && i+1 < argc) servePath = argv[++i];
+        else if (a == "--serve-workers" && i+1 < argc) serveWorkers = max(1, atoi(argv[++i]));
+        else if (a == "--batch-window" && i+1 < argc) batchWindowMs = max(0.0, atof(argv[++i]));
+        else if (a == "--load-gen" && i+1 < argc) loadGenPath = argv[++i];
+        else if (a == "--requests" && i+1 < argc) loadRequests = max(1LL, atoll(argv[++i]));
+        else if (a == "--concurrency" && i+1 < argc) loadConcurrency = max(1, atoi(argv[++i]));
+        else if (a == "--route-stops" && i+1 < argc) loadRouteStops = clamp(atoi(argv[++i]), 2, 10000);
+        else if (a == "--mix" && i+1 < argc) loadMix = argv[++i];
+        else if (a == "--bench-filter" && i+1 < argc) benchFilter = argv[++i];
+        else if (a == "--bench-time" && i+1 < argc) benchMs = max(1.0, atof(argv[++i]));
+        else if (a == "--bench-json" && i+1 < argc) benchJson = argv[++i];
+        else if (a == "--bench-baseline" && i+1 < argc) benchBaseline = argv[++i];
+        else if (a == "--bench-tolerance" && i+1 < argc) benchTolerance = atof(argv[++i]);
+        else if (a == "--batch") batch = true;
+        else if (a == "--city" && i+1 < argc) cityCitizens = atoll(argv[++i]);
+        else if (a == "--days" && i+1 < argc) cityDays = atoi(argv[++i]);
+        else if (a == "--rules" && i+1 < argc) rulesPath = argv[++i];
+        else if (a == "--selfplay" && i+1 < argc) selfplayRounds = atoll(argv[++i]);
+        else if (a == "--guess-range" && i+1 < argc) guessRange = clamp(atoi(argv[++i]), 2, 10000000);
+        else if (a == "--mood-model" && i+1 < argc) moodModelPath = argv[++i];
+        else if (a == "--train-mood" && i+1 < argc) trainOut = argv[++i];
+        else if (a == "--model" && i+1 < argc) {
+            string k = argv[++i];
+            modelKind = k == "forest" ? MODEL_FOREST : k == "knn" ? MODEL_KNN : MODEL_LOGISTIC;
+        }
+        else if (a == "--format" && i+1 < argc) batchFormat = string(argv[++i]) == "jsonl" ? BATCH_JSONL : BATCH_CSV;
+        else if (a == "-" || a.compare(0, 2, "--") != 0) batchFiles.push_back(a);
+    }
+
+    if (!tracePrefix.empty()) {
+#if EUPHORISIM_TRACE
+        g_trace.prefix = tracePrefix;
+        g_trace.enabled = true;
+        atexit([] { g_trace.write(); });
+#else
+        cerr << "--trace: instrumentation was compiled out (EUPHORISIM_TRACE=0)\n";
+#endif
+    }
+    TRACE_SCOPE("session");
+    if (!trainOut.empty()) {
+        if (batchFiles.empty()) { cerr << "--train-mood OUT needs a manifest of '<mood> <key log>' lines\n"; return 1; }
+        return train_mood_model(trainOut, batchFiles[0], modelKind);
+    }
+    if (!moodModelPath.empty()) {
+        string err;
+        if (!g_moodModel.load(moodModelPath, err)) { cerr << err << "\n"; return 1; }
+    }
+    // scoring logs, watching moods, the guessing game, the server and its load generator simulate no days
+    if (!batch && !watch && selfplayRounds <= 0 && servePath.empty() && loadGenPath.empty()) {
+        string err;
+        if (!g_lifeRules.load(rulesPath, err)) { cerr << err << " (life rules; pass --rules FILE)\n"; return 1; }
+    }
+    vector<Point> mapPlaces = {
+        {"Home", 0,0}, {"Office", 5,1}, {"Gym", -1,4}, {"Market", 3,-2}, {"Park", -3,-1}
+    };
+    if (watch) return watch_mood(replayKeys);
+    if (cityCitizens > 0) return run_city(cityCitizens, max(1, cityDays), mapPlaces);
+    // headless modes that rank songs use the --catalog file or fail, rather than quietly falling back
+    if ((batch || !servePath.empty()) && !catalogPath.empty()) {
+        string err;
+        if (!g_catalog.open(catalogPath, err)) { cerr << err << "\n"; return 1; }
+    }
+    if (batch) return run_batch(batchFiles, batchFormat);
+    if (selfplayRounds > 0) return run_selfplay(selfplayRounds, guessRange);
+    if (bench) return run_bench(benchFilter, benchMs, benchJson, benchBaseline, benchTolerance);
+    if (!loadGenPath.empty()) return run_load_gen(loadGenPath, loadRequests, loadConcurrency, loadMix, loadRouteStops);
+    if (!servePath.empty()) return run_server(servePath, serveWorkers, batchWindowMs);
+
+    cout << "=== EuphoriSim — Mood-Driven Life & Route Simulator ===\n";
+    cout << "(session seed " << g_seed << " — pass --seed " << g_seed << " to replay)\n\n";
 
-    cout << "=== EuphoriSim — Mood-Driven Life & Route Simulator ===\n\n";
+    // The session is a pipeline on a small executor of its own (the worker pool may have no threads
+    // on a single core): everything that does not depend on the user is loaded while they type, and
+    // a GA route keeps being refined while the day is simulated and the game is played. Background
+    // tasks never print; their results are reported where the main thread joins them. The catalog
+    // and road loads overlap in every session; refinement needs a GA route, which the built-in
+    // 5-place map never produces (plan_route solves a handful of stops exactly).
+    RouteCache routeCache;
+    ThreadPool executor(2);
+    auto catalogReady = executor.submit([&] {
+        TRACE_SCOPE("session.load_catalog");
+        string err, note;
+        if (!catalogPath.empty()) {
+            if (g_catalog.open(catalogPath, err)) note = "Song catalog: " + to_string(g_catalog.size()) + " tracks from " + catalogPath + "\n";
+            else note = "Song catalog unavailable (" + err + "); using the built-in library.\n";
+        }
+        song_catalog(); // builds the built-in catalog and its index when no file was opened
+        return note;
+    });
+    struct LoadedRoads { unique_ptr<RoadNetwork> net; string err; double loadMs = 0; };
+    auto roadsReady = executor.submit([&] {
+        LoadedRoads r;
+        if (roadsPath.empty()) return r;
+        auto t0 = clk::now();
+        r.net = make_unique<RoadNetwork>();
+        if (!r.net->open(roadsPath, r.err)) r.net.reset();
+        r.loadMs = ms(clk::now() - t0).count();
+        return r;
+    });
+    auto routeCacheReady = executor.submit([&] { if (!routeCachePath.empty()) routeCache.load(routeCachePath); });
 
     // 1) Typing sample and mood inference
     cout << "Phase 1: Typing-based mood detection\n";
-    TypingSample ts = record_typing_sample();
+    TypingSample ts = record_typing_sample(replayKeys, recordKeys);
     cout << "Measured intervals: mean=" << (int)ts.mean() << "ms stddev=" << (int)ts.stddev() << "ms\n";
-    Mood m = infer_mood(ts);
-    cout << "Inferred mood: " << mood_name(m) << "\n\n";
+    Mood m = classify_mood(ts.events.data(), ts.events.size(), ts.stats);
+    cout << "Inferred mood: " << mood_name(m);
+    if (g_moodModel.loaded && ts.events.size() >= 2) cout << " (" << model_kind_name(g_moodModel.kind) << " model)";
+    cout << "\n\n";
 
-    // Music recommendations
+    // Music recommendations (the catalog was loaded during capture)
+    if (string note = catalogReady.get(); !note.empty()) cout << note << "\n";
     cout << "Music recommendations for your mood:\n";
-    auto recs = recommend_by_mood(m, 3);
+    Rng musicRng = rng_stream(STREAM_MUSIC);
+    auto recs = recommend_for(ts, m, 3, musicRng);
     for (int i=0;i<(int)recs.size();++i) {
         cout << i+1 << ". " << recs[i].title << " — " << recs[i].artist << "\n";
     }
     cout << "\n";
 
-    // 2) Map creation (small set)
-    vector<Point> mapPlaces = {
-        {"Home", 0,0}, {"Office", 5,1}, {"Gym", -1,4}, {"Market", 3,-2}, {"Park", -3,-1}
-    };
+    // 2) Map (small set, defined above)
     cout << "Map places:\n";
     for (int i=0;i<(int)mapPlaces.size();++i) cout << i << ": " << mapPlaces[i].name << " ("<<mapPlaces[i].x<<","<<mapPlaces[i].y<<")\n";
     cout << "\n";
@@ -368,56 +5049,84 @@ int main(){
     for (auto &p: gaPlaces) cout << p.name << ", ";
     cout << "\n\n";
 
-    // 3) Run GA to find efficient route
-    cout << "Optimizing route with a Genetic Algorithm (this runs locally)...\n";
-    GA ga(gaPlaces, 160, 0.85, 0.10);
-    auto bestChrom = ga.run(250); // returns ordering of indices in gaPlaces
+    // 3) Find an efficient route (exact for small selections, GA otherwise)
+    vector<double> roadCosts;
+    uint64_t roadsFingerprint = 0;
+    if (!roadsPath.empty()) {
+        LoadedRoads roads = roadsReady.get();
+        if (roads.net) {
+            auto t0 = clk::now();
+            roadsFingerprint = roads.net->fingerprint;
+            roadCosts = roads.net->stop_matrix(gaPlaces);
+            cout << "Road network: " << roads.net->graph.n << " nodes" << (roads.net->fromCache ? " (hierarchy from cache)" : " (hierarchy built and cached)")
+                 << ", loaded in " << fixed << setprecision(1) << roads.loadMs << " ms, stop costs in " << ms(clk::now() - t0).count() << " ms\n";
+        } else {
+            cout << "Road network unavailable (" << roads.err << "); using straight-line distance.\n";
+        }
+    }
+    cout << "Optimizing route (this runs locally)...\n";
+    routeCacheReady.get();
+    uint64_t mapKey = map_hash(mapPlaces, roadCosts.empty() ? 0 : roadsFingerprint);
+    RoutePlan plan = plan_route_cached(routeCache, mapKey, chosenIdx, gaPlaces, 50, roadCosts.empty() ? nullptr : &roadCosts);
+    if (!routeCachePath.empty()) routeCache.save(routeCachePath);
+    // A GA plan is only the best of its 50 ms budget: keep refining it, warm-started from that tour,
+    // while the day and the game run, and collect the result at the summary. Exact and cached
+    // plans are already as good as they get, and with the built-in map every plan is one of those.
+    atomic<bool> stopRefining{false};
+    future<RoutePlan> refined;
+    if (plan.solver == SOLVER_GA || plan.solver == SOLVER_GA_LOCAL)
+        refined = executor.submit([&, warm = plan.tour] {
+            TRACE_SCOPE("session.refine_route");
+            return plan_route(gaPlaces, refineMs, nullptr, roadCosts.empty() ? nullptr : &roadCosts, &warm, &stopRefining);
+        });
+    const vector<int> &bestChrom = plan.tour; // ordering of indices in gaPlaces, starting at Home
+    cout << "Solver: " << solver_name(plan.solver) << (plan.warmStarted ? ", warm-started from a cached route" : "")
+         << " (" << fixed << setprecision(3) << plan.elapsedMs << " ms)\n";
     cout << "Optimized route:\n";
-    double routeCost = 0;
     for (size_t i=0;i<bestChrom.size();++i) {
         cout << gaPlaces[bestChrom[i]].name;
         if (i+1<bestChrom.size()) cout << " -> ";
-        if (i+1<bestChrom.size()) routeCost += dist(gaPlaces[bestChrom[i]], gaPlaces[bestChrom[i+1]]);
     }
-    routeCost += dist(gaPlaces[bestChrom.back()], gaPlaces[bestChrom.front()]);
+    double routeCost = roadCosts.empty() ? tour_cost(CoordStore(gaPlaces), bestChrom) : plan.cost;
     cout << " -> (return)\n";
-    cout << "Estimated route cost (Euclidean): " << fixed << setprecision(2) << routeCost << "\n\n";
+    cout << "Estimated route cost (" << (roadCosts.empty() ? "Euclidean" : "road network") << "): " << fixed << setprecision(2) << routeCost << "\n\n";
 
     // 4) LifeSim: create citizen and simulate day using mood & route
+    const LifeRules &rules = life_rules();
+    vector<uint8_t> placeEvent = rules.compile(gaPlaces);
     Citizen c("Basava");
-    c.integrate_mood(m);
+    c.integrate_mood(m, rules);
     cout << "Simulating a day for citizen '"<<c.name<<"' with mood "<<mood_name(c.mood)<<"\n";
     cout << "Start: Energy="<<c.energy<<" Happiness="<<c.happiness<<"\n";
-    // We'll map place types to events
+    // each stop applies its place's event, then maybe the mood's random event
+    Rng simRng = rng_stream(STREAM_LIFESIM);
     for (size_t i=0;i<bestChrom.size();++i) {
-        string place = gaPlaces[bestChrom[i]].name;
-        if (place=="Office") { c.apply_event("work"); cout << "[Office] Work happened. "; }
-        else if (place=="Gym") { c.apply_event("exercise"); cout << "[Gym] Workout. "; }
-        else if (place=="Market") { c.apply_event("errand"); cout << "[Market] Errand. "; }
-        else if (place=="Park") { c.apply_event("relax"); cout << "[Park] Relaxing walk. "; }
-        else { c.apply_event("coffee"); cout << "["<<place<<"] Quick stop. "; }
+        TRACE_SCOPE("life.stop");
+        int ev = placeEvent[bestChrom[i]];
+        c.apply(rules.eventDelta[ev]);
+        cout << "[" << gaPlaces[bestChrom[i]].name << "] " << rules.eventCaption[ev] << " ";
         cout << "Energy="<<c.energy<<" Happiness="<<c.happiness<<"\n";
-        // small random events influenced by mood
-        if (m==MOOD_EXCITED && rand01() < 0.18) { c.happiness += 6; cout << "  Surprise positive event! Happiness boosted.\n"; }
-        if (m==MOOD_STRESSED && rand01() < 0.12) { c.energy -= 8; cout << "  Minor stressor occurred.\n"; }
+        if (rules.mood.randomProb[m] > 0 && simRng.uniform() < rules.mood.randomProb[m]) {
+            c.apply(rules.mood.random[m]);
+            cout << "  " << rules.randomCaption[m] << "\n";
+        }
     }
     cout << "End of day: Energy="<<c.energy<<" Happiness="<<c.happiness<<"\n\n";
 
     // 5) Self-learning guessing game
     cout << "Mini-game: Self-learning Guessing Challenge\n";
-    cout << "Rules: You will think of a number (1-100). The program will try to guess.\n";
+    cout << "Rules: You will think of a number (1-" << guessRange << "). The program will try to guess.\n";
     cout << "After each guess, respond with:\n  L  (if your number is Lower)\n  H  (if your number is Higher)\n  C  (if Correct)\nWe'll play up to 10 rounds. Program learns your guess habits.\n\n";
-    GuessLearner gl;
+    GuessLearner gl(1, guessRange);
     for (int round=1; round<=6; ++round) {
-        cout << "Round " << round << ": Think of a number 1..100. Press ENTER when ready.";
+        TRACE_SCOPE("game.round");
+        cout << "Round " << round << ": Think of a number 1.." << guessRange << ". Press ENTER when ready.";
         getline(cin, line);
         int attempt = 0;
         bool solved = false;
-        int low=1, high=100;
+        int low=1, high=guessRange;
         while (attempt < 10) {
-            int guess = gl.make_guess();
-            // clamp to current bounds
-            if (guess < low || guess > high) guess = (low+high)/2;
+            int guess = gl.make_guess(low, high);
             cout << "Program guesses: " << guess << "  (respond H/L/C) > ";
             string resp;
             getline(cin, resp);
@@ -426,14 +5135,12 @@ int main(){
             attempt++;
             if (r=='C') {
                 cout << "Program: Yay! I guessed it in " << attempt << " tries.\n\n";
-                gl.update_with_user_guess(guess);
+                gl.observe(guess);
                 solved = true; break;
             } else if (r=='H') {
                 low = max(low, guess+1);
-                gl.update_with_user_guess(guess);
             } else if (r=='L') {
                 high = min(high, guess-1);
-                gl.update_with_user_guess(guess);
             } else {
                 cout << "Invalid response. Please reply H/L/C. Try again.\n";
             }
@@ -446,13 +5153,29 @@ int main(){
     }
     cout << "Thanks for playing. The learner has updated its model and will adapt next time!\n\n";
 
+    // Join the background refinement; a better tour replaces the cached one for next time
+    vector<int> finalRoute = bestChrom;
+    if (refined.valid()) {
+        stopRefining = true;
+        RoutePlan r = refined.get();
+        if (r.cost < plan.cost - 1e-9) {
+            cout << "Route refined in the background: cost " << fixed << setprecision(2) << plan.cost << " -> " << r.cost
+                 << " (" << r.generations << " more generations)\n\n";
+            finalRoute = r.tour;
+            vector<int> ids;
+            for (int s: r.tour) ids.push_back(chosenIdx[s]);
+            routeCache.put(mapKey, ids);
+            if (!routeCachePath.empty()) routeCache.save(routeCachePath);
+        }
+    }
+
     // Wrap-up summary
     cout << "=== Day Summary ===\n";
     cout << "Mood: " << mood_name(m) << "\n";
     cout << "Suggested tracks: ";
     for (auto &s: recs) cout << s.title << " ("<<s.artist<<"), ";
     cout << "\nOptimized route: ";
-    for (auto &p: gaPlaces) cout << p.name << " ";
+    for (int i: finalRoute) cout << gaPlaces[i].name << " ";
     cout << "\nCitizen '"<<c.name<<"' final Energy="<<c.energy<<" Happiness="<<c.happiness<<"\n";
     cout << "\nYou can re-run the program, pick different places, or provide longer typing samples to refine mood detection.\n";
     cout << "EuphoriSim - unique fusion project by you. Credit: you >:) \n";